@@ -23,6 +23,7 @@
 
 #include "arena.h"
 #include "message.h"
+#include "layout.h"
 #include <vector>
 #include <string.h>
 #include <stdio.h>
@@ -38,10 +39,56 @@ ReaderArena::ReaderArena(MessageReader* message)
     : message(message),
       readLimiter(message->getOptions().traversalLimitInWords * WORDS),
       ignoreErrors(false),
-      segment0(this, SegmentId(0), message->getSegment(0), &readLimiter) {}
+      validated(false),
+      segment0(this, SegmentId(0), message->getSegment(0), &readLimiter),
+      segmentStorageUsed(0) {}
 
 ReaderArena::~ReaderArena() {}
 
+void ReaderArena::reset() {
+  readLimiter.reset(message->getOptions().traversalLimitInWords * WORDS);
+  ignoreErrors = false;
+  validated = false;
+  segment0.ptr = message->getSegment(0);
+  segment0.validated = false;
+
+  // clear() keeps the vector's capacity.
+  moreSegments.clear();
+  segmentStorageUsed = 0;
+}
+
+bool ReaderArena::validate() {
+  if (validated) {
+    return true;
+  }
+
+  if (segment0.getSize() == 0 * WORDS) {
+    reportInvalidData("Message did not contain a root pointer.");
+    return false;
+  }
+
+  if (!validateMessage(&segment0, message->getOptions().nestingLimit)) {
+    return false;
+  }
+
+  assumeValid();
+  return true;
+}
+
+void ReaderArena::assumeValid() {
+  // From here on containsInterval() skips its bounds checks, so this is only sound as long as
+  // nothing changes the segments:  the MessageReader must keep returning the same memory, with
+  // the same content, until reset() clears the flag.  Segments looked up later inherit the flag,
+  // since validation already followed every reference into them.
+  validated = true;
+  segment0.validated = true;
+  for (SegmentReader* segment: moreSegments) {
+    if (segment != nullptr) {
+      segment->validated = true;
+    }
+  }
+}
+
 SegmentReader* ReaderArena::tryGetSegment(SegmentId id) {
   if (id == SegmentId(0)) {
     if (segment0.getArray() == nullptr) {
@@ -52,14 +99,12 @@ SegmentReader* ReaderArena::tryGetSegment(SegmentId id) {
   }
 
   // TODO:  Lock a mutex so that reading is thread-safe.  Take a reader lock during the first
-  //   lookup, unlock it before calling getSegment(), then take a writer lock to update the map.
+  //   lookup, unlock it before calling getSegment(), then take a writer lock to update the table.
   //   Bleh, lazy initialization is sad.
 
-  if (moreSegments != nullptr) {
-    auto iter = moreSegments->find(id.value);
-    if (iter != moreSegments->end()) {
-      return iter->second.get();
-    }
+  uint index = id.value - 1;
+  if (index < moreSegments.size() && moreSegments[index] != nullptr) {
+    return moreSegments[index];
   }
 
   ArrayPtr<const word> newSegment = message->getSegment(id.value);
@@ -67,14 +112,25 @@ SegmentReader* ReaderArena::tryGetSegment(SegmentId id) {
     return nullptr;
   }
 
-  if (moreSegments == nullptr) {
-    // OK, the segment exists, so allocate the map.
-    moreSegments = std::unique_ptr<SegmentMap>(new SegmentMap);
+  // OK, the segment exists, so make room for it.
+  if (segmentStorage == nullptr) {
+    segmentStorage = std::unique_ptr<std::deque<SegmentReader>>(new std::deque<SegmentReader>);
+  }
+  if (index >= moreSegments.size()) {
+    moreSegments.resize(index + 1);
   }
 
-  std::unique_ptr<SegmentReader>* slot = &(*moreSegments)[id.value];
-  *slot = std::unique_ptr<SegmentReader>(new SegmentReader(this, id, newSegment, &readLimiter));
-  return slot->get();
+  if (segmentStorageUsed < segmentStorage->size()) {
+    SegmentReader& recycled = (*segmentStorage)[segmentStorageUsed];
+    recycled.id = id;
+    recycled.ptr = newSegment;
+    recycled.validated = validated;
+  } else {
+    segmentStorage->emplace_back(this, id, newSegment, &readLimiter);
+    segmentStorage->back().validated = validated;
+  }
+  moreSegments[index] = &(*segmentStorage)[segmentStorageUsed++];
+  return moreSegments[index];
 }
 
 void ReaderArena::reportInvalidData(const char* description) {
@@ -96,31 +152,42 @@ void ReaderArena::reportReadLimitReached() {
 
 // =======================================================================================
 
-BuilderArena::BuilderArena(MessageBuilder* message)
-    : message(message), segment0(nullptr, SegmentId(0), nullptr, nullptr) {}
+BuilderArena::BuilderArena(MessageBuilder* message, bool concurrent, bool reuseFreedSpace,
+                           bool zeroOverwritten)
+    : message(message), concurrent(concurrent), reuseFreedSpace(reuseFreedSpace),
+      zeroOverwritten(zeroOverwritten || reuseFreedSpace),
+      segment0(nullptr, SegmentId(0), nullptr, nullptr, concurrent) {}
 BuilderArena::~BuilderArena() {}
 
 SegmentBuilder* BuilderArena::getSegment(SegmentId id) {
   // This method is allowed to crash if the segment ID is not valid.
   if (id == SegmentId(0)) {
     return &segment0;
+  } else if (concurrent) {
+    return moreSegments->segmentTable.load(std::memory_order_acquire)[id.value - 1];
   } else {
     return moreSegments->builders[id.value - 1].get();
   }
 }
 
 SegmentBuilder* BuilderArena::getSegmentWithAvailable(WordCount minimumAvailable) {
-  // TODO:  Mutex-locking?  Do we want to allow people to build different parts of the same message
-  // in different threads?
-
   if (segment0.getArena() == nullptr) {
     // We're allocating the first segment.
-    ArrayPtr<word> ptr = message->allocateSegment(minimumAvailable / WORDS);
+    ArrayPtr<word> ptr = allocateSegmentMemory(minimumAvailable);
+
+    if (concurrent) {
+      // Set up the multi-segment state now, before any other threads can get involved.
+      moreSegments = std::unique_ptr<MultiSegmentState>(new MultiSegmentState());
+      moreSegments->forOutput.resize(1);
+    }
 
     // Re-allocate segment0 in-place.  This is a bit of a hack, but we have not returned any
     // pointers to this segment yet, so it should be fine.
     segment0.~SegmentBuilder();
-    return new (&segment0) SegmentBuilder(this, SegmentId(0), ptr, &this->dummyLimiter);
+    return new (&segment0) SegmentBuilder(
+        this, SegmentId(0), ptr, &this->dummyLimiter, concurrent);
+  } else if (concurrent) {
+    return getSegmentWithAvailableConcurrently(minimumAvailable);
   } else {
     if (segment0.available() >= minimumAvailable) {
       return &segment0;
@@ -129,29 +196,315 @@ SegmentBuilder* BuilderArena::getSegmentWithAvailable(WordCount minimumAvailable
     if (moreSegments == nullptr) {
       moreSegments = std::unique_ptr<MultiSegmentState>(new MultiSegmentState());
     } else {
-      // TODO:  Check for available space in more than just the last segment.  We don't want this
-      //   to be O(n), though, so we'll need to maintain some sort of table.  Complicating matters,
-      //   we want SegmentBuilders::allocate() to be fast, so we can't update any such table when
-      //   allocation actually happens.  Instead, we could have a priority queue based on the
-      //   last-known available size, and then re-check the size when we pop segments off it and
-      //   shove them to the back of the queue if they have become too small.
-      if (moreSegments->builders.back()->available() >= minimumAvailable) {
-        return moreSegments->builders.back().get();
+      if (!moreSegments->builders.empty()) {
+        SegmentBuilder* last = moreSegments->builders.back().get();
+        if (last->available() >= minimumAvailable) {
+          // Common case:  the newest segment still has room.
+          return last;
+        }
+      }
+
+      // Look for an existing segment with enough space, so that small objects can fill in the
+      // space left at the end of earlier segments.  Keys in the queue only overestimate the space
+      // available, so we re-check the top candidate, and if it has become too small we re-queue
+      // it with its real size.  Since that size is below minimumAvailable, each segment is
+      // re-queued at most once per call.
+      auto& queue = moreSegments->available;
+      while (!queue.empty() && queue.top().lastKnownAvailable >= minimumAvailable) {
+        SegmentBuilder* segment = queue.top().segment;
+        WordCount segmentAvailable = segment->available();
+        if (segmentAvailable >= minimumAvailable) {
+          // Leave the stale key in place; it is still an upper bound.
+          return segment;
+        }
+        queue.pop();
+        queue.push(AvailableSegment { segmentAvailable, segment });
       }
     }
 
-    std::unique_ptr<SegmentBuilder> newBuilder = std::unique_ptr<SegmentBuilder>(
-        new SegmentBuilder(this, SegmentId(moreSegments->builders.size() + 1),
-            message->allocateSegment(minimumAvailable / WORDS), &this->dummyLimiter));
-    SegmentBuilder* result = newBuilder.get();
-    moreSegments->builders.push_back(std::move(newBuilder));
+    SegmentBuilder* result = addSegment(minimumAvailable);
+    moreSegments->available.push(AvailableSegment { result->available(), result });
+    return result;
+  }
+}
 
-    // Keep forOutput the right size so that we don't have to re-allocate during
-    // getSegmentsForOutput(), which callers might reasonably expect is a thread-safe method.
-    moreSegments->forOutput.resize(moreSegments->builders.size() + 1);
+static uint threadSlot() {
+  static std::atomic<uint> nextSlot(0);
+  static thread_local uint slot = nextSlot.fetch_add(1, std::memory_order_relaxed);
+  return slot;
+}
 
-    return result;
+SegmentBuilder* BuilderArena::getSegmentWithAvailableConcurrently(WordCount minimumAvailable) {
+  // Check segment0 and this thread's own segment without locking.  Another thread may use up the
+  // space before our caller gets to allocate it, in which case the caller's allocate() returns null
+  // and it just asks again.
+  if (segment0.available() >= minimumAvailable) {
+    return &segment0;
+  }
+
+  std::atomic<SegmentBuilder*>& slot =
+      moreSegments->threadSegments[threadSlot() % MultiSegmentState::THREAD_SLOTS];
+
+  SegmentBuilder* segment = slot.load(std::memory_order_acquire);
+  if (segment != nullptr && segment->available() >= minimumAvailable) {
+    return segment;
+  }
+
+  std::lock_guard<std::mutex> lock(moreSegments->mutex);
+
+  // Another thread sharing the slot may have added a segment while we waited for the lock.
+  segment = slot.load(std::memory_order_relaxed);
+  if (segment != nullptr && segment->available() >= minimumAvailable) {
+    return segment;
+  }
+
+  segment = addSegment(minimumAvailable);
+  slot.store(segment, std::memory_order_release);
+  return segment;
+}
+
+SegmentBuilder* BuilderArena::addSegment(WordCount minimumAvailable) {
+  // In concurrent mode, the caller must hold moreSegments->mutex.
+
+  ArrayPtr<word> memory = takeSpareSegment(minimumAvailable);
+  if (memory == nullptr) {
+    memory = allocateSegmentMemory(minimumAvailable);
+  }
+
+  std::unique_ptr<SegmentBuilder> newBuilder = std::unique_ptr<SegmentBuilder>(
+      new SegmentBuilder(this, SegmentId(moreSegments->builders.size() + 1),
+          memory, &this->dummyLimiter, concurrent));
+  SegmentBuilder* result = newBuilder.get();
+  moreSegments->builders.push_back(std::move(newBuilder));
+  if (concurrent) {
+    publishSegment(result);
+  }
+
+  // Keep forOutput the right size so that we don't have to re-allocate during
+  // getSegmentsForOutput(), which callers might reasonably expect is a thread-safe method.
+  moreSegments->forOutput.resize(moreSegments->builders.size() + 1);
+
+  return result;
+}
+
+SegmentBuilder* BuilderArena::addExternalSegment(ArrayPtr<const word> content) {
+  std::unique_lock<std::mutex> lock;
+  if (concurrent) {
+    lock = std::unique_lock<std::mutex>(moreSegments->mutex);
+  } else if (moreSegments == nullptr) {
+    moreSegments = std::unique_ptr<MultiSegmentState>(new MultiSegmentState());
+  }
+
+  // Not added to `available` or the thread slots, since it has no space to give.
+  std::unique_ptr<SegmentBuilder> newBuilder = std::unique_ptr<SegmentBuilder>(
+      new SegmentBuilder(this, SegmentId(moreSegments->builders.size() + 1),
+          content, &this->dummyLimiter));
+  SegmentBuilder* result = newBuilder.get();
+  moreSegments->builders.push_back(std::move(newBuilder));
+  if (concurrent) {
+    publishSegment(result);
+  }
+  moreSegments->forOutput.resize(moreSegments->builders.size() + 1);
+
+  return result;
+}
+
+void BuilderArena::publishSegment(SegmentBuilder* segment) {
+  // Caller must hold moreSegments->mutex, and must already have added `segment` to `builders`.
+
+  uint index = segment->getSegmentId().value - 1;
+  SegmentBuilder** table = moreSegments->segmentTable.load(std::memory_order_relaxed);
+  if (index < moreSegments->segmentTableCapacity) {
+    // Nobody reads this entry until they've learned of the segment from us.
+    table[index] = segment;
+  } else {
+    uint newCapacity = moreSegments->segmentTableCapacity == 0 ?
+        16 : moreSegments->segmentTableCapacity * 2;
+    std::unique_ptr<SegmentBuilder*[]> newTable(new SegmentBuilder*[newCapacity]);
+    for (uint i = 0; i < index; i++) {
+      newTable[i] = table[i];
+    }
+    newTable[index] = segment;
+    moreSegments->segmentTable.store(newTable.get(), std::memory_order_release);
+    moreSegments->segmentTables.push_back(std::move(newTable));
+    moreSegments->segmentTableCapacity = newCapacity;
+  }
+}
+
+ArrayPtr<word> BuilderArena::allocateSegmentMemory(WordCount minimumSize) {
+  ArrayPtr<word> result = message->allocateSegment(minimumSize / WORDS);
+#if CAPNPROTO_ALLOCATION_STATS
+  addToStat(stats.wordsReserved, result.size());
+  addToStat(stats.segmentsAllocated, 1);
+#endif
+  return result;
+}
+
+ArrayPtr<word> BuilderArena::takeSpareSegment(WordCount minimumSize) {
+  auto& spares = moreSegments->spareSegments;
+  for (auto iter = spares.begin(); iter != spares.end(); ++iter) {
+    if (iter->size() * WORDS >= minimumSize) {
+      ArrayPtr<word> result = *iter;
+      *iter = spares.back();
+      spares.pop_back();
+      return result;
+    }
+  }
+  return nullptr;
+}
+
+void BuilderArena::requeueSegment(SegmentBuilder* segment) {
+  // The segment's allocation pointer was rolled back, so its key in `available` may now
+  // underestimate its space, which would hide that space from getSegmentWithAvailable().  Queue it
+  // again under its real size.  The stale entry is harmless, but so that repeated rollbacks don't
+  // pile up entries, rebuild the queue from scratch once it is twice as long as it needs to be.
+  auto& queue = moreSegments->available;
+  if (queue.size() >= 2 * moreSegments->builders.size()) {
+    std::vector<AvailableSegment> entries;
+    entries.reserve(moreSegments->builders.size());
+    for (auto& builder: moreSegments->builders) {
+      entries.push_back(AvailableSegment { builder->available(), builder.get() });
+    }
+    queue = std::priority_queue<AvailableSegment>(
+        std::less<AvailableSegment>(), std::move(entries));
+  } else {
+    queue.push(AvailableSegment { segment->available(), segment });
+  }
+}
+
+void BuilderArena::addToFreeList(SegmentBuilder* segment, ArrayPtr<word> block) {
+  std::unique_lock<std::mutex> lock;
+  if (concurrent) {
+    lock = std::unique_lock<std::mutex>(moreSegments->mutex);
+  } else if (moreSegments == nullptr) {
+    moreSegments = std::unique_ptr<MultiSegmentState>(new MultiSegmentState());
+    moreSegments->forOutput.resize(1);
+  }
+
+  auto& freeLists = moreSegments->freeLists;
+  uint id = segment->getSegmentId().value;
+  if (freeLists.size() <= id) {
+    freeLists.resize(id + 1);
+  }
+  auto& freeList = freeLists[id];
+
+  // Bound the list so that searching it stays cheap.  A block that doesn't make it onto the list
+  // is still zeroed; it just won't be reused.
+  static constexpr uint MAX_FREE_BLOCKS_PER_SEGMENT = 64;
+  if (freeList.size() < MAX_FREE_BLOCKS_PER_SEGMENT) {
+    freeList.push_back(block);
+  }
+}
+
+word* BuilderArena::allocateFromFreeList(SegmentBuilder* segment, WordCount amount) {
+  std::unique_lock<std::mutex> lock;
+  if (moreSegments == nullptr) {
+    return nullptr;
+  } else if (concurrent) {
+    lock = std::unique_lock<std::mutex>(moreSegments->mutex);
+  }
+
+  uint id = segment->getSegmentId().value;
+  if (id >= moreSegments->freeLists.size()) {
+    return nullptr;
+  }
+
+  // First fit.  Any remainder stays on the list.
+  auto& freeList = moreSegments->freeLists[id];
+  for (auto iter = freeList.begin(); iter != freeList.end(); ++iter) {
+    if (iter->size() * WORDS >= amount) {
+      word* result = iter->begin();
+      *iter = iter->slice(amount / WORDS, iter->size());
+      if (iter->size() == 0) {
+        *iter = freeList.back();
+        freeList.pop_back();
+      }
+      return result;
+    }
+  }
+  return nullptr;
+}
+
+static ArrayPtr<word> zeroAndRelease(SegmentBuilder& segment) {
+  // Returns the segment's memory, zeroing the part that was used.
+  word* start = segment.getPtrUnchecked(0 * WORDS);
+  size_t used = segment.currentlyAllocated().size();
+  memset(start, 0, used * sizeof(word));
+  segment.getArena()->countZeroed(used * WORDS);
+  return arrayPtr(start, segment.getSize() / WORDS);
+}
+
+void BuilderArena::compact() {
+  if (segment0.getArena() == nullptr) {
+    // Nothing allocated yet.
+    return;
+  }
+
+  // Copy the live objects into scratch space first, since the destination may be segment 0 itself.
+  word* root = segment0.getPtrUnchecked(0 * WORDS);
+  WordCount size = REFERENCE_SIZE_IN_WORDS + StructBuilder::compactedRootSize(&segment0, root);
+  Array<word> scratch = newArray<word>(size / WORDS);
+  memset(scratch.begin(), 0, scratch.size() * sizeof(word));
+  {
+    SegmentBuilder scratchSegment(this, SegmentId(0), scratch, &dummyLimiter, false);
+    scratchSegment.allocate(REFERENCE_SIZE_IN_WORDS);
+    StructBuilder::compactRoot(&segment0, root, &scratchSegment, scratch.begin());
+    CAPNPROTO_ASSERT(scratchSegment.available() == 0 * WORDS,
+        "BuilderArena::compact() computed the wrong size.");
+  }
+
+  // Every segment except the destination becomes a spare.
+  std::vector<ArrayPtr<word>> spares;
+  if (moreSegments != nullptr) {
+    spares = std::move(moreSegments->spareSegments);
+    for (auto& builder: moreSegments->builders) {
+      if (!builder->isExternal()) {
+        spares.push_back(zeroAndRelease(*builder));
+      }
+    }
+  } else {
+    moreSegments = std::unique_ptr<MultiSegmentState>(new MultiSegmentState());
+  }
+  ArrayPtr<word> oldSegment0 = zeroAndRelease(segment0);
+  ArrayPtr<word> destination;
+  if (oldSegment0.size() * WORDS >= size) {
+    destination = oldSegment0;
+  } else {
+    spares.push_back(oldSegment0);
+  }
+
+  moreSegments->builders.clear();
+  moreSegments->forOutput.resize(1);
+  moreSegments->freeLists.clear();
+  moreSegments->available = std::priority_queue<AvailableSegment>();
+  for (auto& slot: moreSegments->threadSegments) {
+    slot.store(nullptr, std::memory_order_relaxed);
+  }
+  moreSegments->spareSegments = std::move(spares);
+
+  if (destination == nullptr) {
+    destination = takeSpareSegment(size);
   }
+  if (destination == nullptr) {
+    destination = allocateSegmentMemory(size);
+  }
+
+  segment0.~SegmentBuilder();
+  new (&segment0) SegmentBuilder(this, SegmentId(0), destination, &this->dummyLimiter, concurrent);
+  memcpy(segment0.allocate(size), scratch.begin(), scratch.size() * sizeof(word));
+}
+
+AllocationStats BuilderArena::getAllocationStats() {
+  AllocationStats result;
+#if CAPNPROTO_ALLOCATION_STATS
+  result.wordsAllocated = stats.wordsAllocated.load(std::memory_order_relaxed);
+  result.wordsReserved = stats.wordsReserved.load(std::memory_order_relaxed);
+  result.segmentsAllocated = stats.segmentsAllocated.load(std::memory_order_relaxed);
+  result.farReferences = stats.farReferences.load(std::memory_order_relaxed);
+  result.defaultValueCopies = stats.defaultValueCopies.load(std::memory_order_relaxed);
+  result.wordsZeroed = stats.wordsZeroed.load(std::memory_order_relaxed);
+#endif
+  return result;
 }
 
 ArrayPtr<const ArrayPtr<const word>> BuilderArena::getSegmentsForOutput() {
@@ -160,15 +513,13 @@ ArrayPtr<const ArrayPtr<const word>> BuilderArena::getSegmentsForOutput() {
   // segments is actually changing due to an activity in another thread, then the caller has a
   // problem regardless of locking here.
 
-  if (moreSegments == nullptr) {
-    if (segment0.getArena() == nullptr) {
-      // We haven't actually allocated any segments yet.
-      return nullptr;
-    } else {
-      // We have only one segment so far.
-      segment0ForOutput = segment0.currentlyAllocated();
-      return arrayPtr(&segment0ForOutput, 1);
-    }
+  if (segment0.getArena() == nullptr) {
+    // We haven't actually allocated any segments yet.
+    return nullptr;
+  } else if (moreSegments == nullptr) {
+    // We have only one segment so far.
+    segment0ForOutput = segment0.currentlyAllocated();
+    return arrayPtr(&segment0ForOutput, 1);
   } else {
     CAPNPROTO_DEBUG_ASSERT(moreSegments->forOutput.size() == moreSegments->builders.size() + 1,
         "Bug in capnproto::internal::BuilderArena:  moreSegments->forOutput wasn't resized "
@@ -181,7 +532,15 @@ ArrayPtr<const ArrayPtr<const word>> BuilderArena::getSegmentsForOutput() {
     for (auto& builder: moreSegments->builders) {
       result[i++] = builder->currentlyAllocated();
     }
-    return result;
+
+    // Nothing can point into a released external segment, so if it's last, there's no need to
+    // send even an empty entry for it.
+    size_t count = result.size();
+    while (count > 1 && result[count - 1].size() == 0 &&
+           moreSegments->builders[count - 2]->isExternal()) {
+      --count;
+    }
+    return arrayPtr(result.begin(), count);
   }
 }
 
@@ -194,6 +553,11 @@ SegmentReader* BuilderArena::tryGetSegment(SegmentId id) {
       return &segment0;
     }
   } else {
+    std::unique_lock<std::mutex> lock;
+    if (concurrent && moreSegments != nullptr) {
+      lock = std::unique_lock<std::mutex>(moreSegments->mutex);
+    }
+
     if (moreSegments == nullptr || id.value > moreSegments->builders.size()) {
       return nullptr;
     } else {
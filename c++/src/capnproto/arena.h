@@ -26,7 +26,10 @@
 
 #include <vector>
 #include <memory>
-#include <unordered_map>
+#include <deque>
+#include <queue>
+#include <atomic>
+#include <mutex>
 #include "macros.h"
 #include "type-safety.h"
 #include "message.h"
@@ -79,6 +82,8 @@ public:
                        ReadLimiter* readLimiter);
 
   CAPNPROTO_ALWAYS_INLINE(bool containsInterval(const word* from, const word* to));
+  // Checks that the interval is within the segment and counts it against the read limit.  Always
+  // true once the message has been validated; see ReaderArena::validate().
 
   inline Arena* getArena();
   inline SegmentId getSegmentId();
@@ -92,20 +97,30 @@ public:
 private:
   Arena* arena;
   SegmentId id;
+  bool validated;
   ArrayPtr<const word> ptr;
   ReadLimiter* readLimiter;
 
   CAPNPROTO_DISALLOW_COPY(SegmentReader);
 
   friend class SegmentBuilder;
+  friend class ReaderArena;
 };
 
 class SegmentBuilder: public SegmentReader {
 public:
   inline SegmentBuilder(BuilderArena* arena, SegmentId id, ArrayPtr<word> ptr,
+                        ReadLimiter* readLimiter, bool concurrent);
+  inline SegmentBuilder(BuilderArena* arena, SegmentId id, ArrayPtr<const word> external,
                         ReadLimiter* readLimiter);
+  // Constructs a segment whose content is caller-owned memory that must not be written.  It
+  // starts out fully allocated, so nothing else is ever allocated in it.  See
+  // BuilderArena::addExternalSegment().
 
   CAPNPROTO_ALWAYS_INLINE(word* allocate(WordCount amount));
+  // Allocate the given number of words from the segment, or return nullptr if there isn't enough
+  // space left.  If the segment was constructed with concurrent = true, this may be called from
+  // multiple threads at once.
   inline word* getPtrUnchecked(WordCount offset);
 
   inline BuilderArena* getArena();
@@ -114,10 +129,33 @@ public:
 
   inline ArrayPtr<const word> currentlyAllocated();
 
+  inline bool tryTruncate(word* from, word* to);
+  // If [from, to) is the most recently allocated space in the segment, un-allocate it and return
+  // true.  The caller is responsible for having zeroed the space.
+
   inline void reset();
 
+  inline bool isExternal();
+  // Whether the segment's memory belongs to the caller (see addExternalSegment()), in which case
+  // it must never be written, zeroed, or reused.
+
+  inline void releaseExternal();
+  // For an external segment whose reference has been overwritten:  empties the segment, so that
+  // getSegmentsForOutput() no longer writes the caller's memory out with the message.  The
+  // segment keeps its ID, since later segments may be referenced by ID.
+
 private:
   word* pos;
+  // In concurrent mode, pos is only accessed with GCC's __atomic builtins, and may temporarily (or,
+  // after a failed allocation, permanently) point past the end of the segment.  Use currentPos()
+  // to read it.  It isn't a std::atomic because then the default mode's plain pointer bump could
+  // no longer be kept in a register across allocations.
+
+  bool concurrent;
+  bool external;
+
+  inline word* allocateConcurrently(WordCount amount);
+  inline word* currentPos();
 
   CAPNPROTO_DISALLOW_COPY(SegmentBuilder);
 };
@@ -164,6 +202,18 @@ public:
   ~ReaderArena();
   CAPNPROTO_DISALLOW_COPY(ReaderArena);
 
+  void reset();
+  // Start over with whatever segments the MessageReader now returns:  segment zero is looked up
+  // again, other segments are forgotten, and the traversal limit is restored.  The segment table
+  // and the SegmentReaders allocated for it are kept and reused.
+
+  bool validate();
+  // Check the whole message with validateMessage().  If it is valid, mark it validated, so that
+  // containsInterval() no longer checks bounds or counts against the read limit.
+
+  void assumeValid();
+  // Mark the message validated without checking it.
+
   // implements Arena ------------------------------------------------
   SegmentReader* tryGetSegment(SegmentId id) override;
   void reportInvalidData(const char* description) override;
@@ -173,17 +223,42 @@ private:
   MessageReader* message;
   ReadLimiter readLimiter;
   bool ignoreErrors;
+  bool validated;
 
   // Optimize for single-segment messages so that small messages are handled quickly.
   SegmentReader segment0;
 
-  typedef std::unordered_map<uint, std::unique_ptr<SegmentReader>> SegmentMap;
-  std::unique_ptr<SegmentMap> moreSegments;
+  std::vector<SegmentReader*> moreSegments;
+  // Indexed by segment ID - 1, so following a far reference costs an array lookup.  Filled in
+  // lazily, since MessageReader::getSegment() may have to do work (InputStreamMessageReader reads
+  // segments from the stream on demand).  Null entries haven't been looked up yet.  The table only
+  // grows once getSegment() confirms that a segment exists, so a bogus segment ID in a far reference
+  // can't make us allocate a huge table.
+
+  std::unique_ptr<std::deque<SegmentReader>> segmentStorage;
+  // The SegmentReaders pointed to by moreSegments.  A deque allocates them in blocks and never
+  // moves them.
+
+  size_t segmentStorageUsed;
+  // How many elements of segmentStorage are in use.  Elements past this are left over from before
+  // the last reset() and are recycled before the deque is grown.
 };
 
 class BuilderArena final: public Arena {
 public:
-  BuilderArena(MessageBuilder* message);
+  explicit BuilderArena(MessageBuilder* message, bool concurrent = false,
+                        bool reuseFreedSpace = false, bool zeroOverwritten = false);
+  // If `concurrent` is true, all methods except getSegmentsForOutput() may be called from multiple
+  // threads simultaneously, and all segments allocate concurrently.  See
+  // MessageBuilder::enableConcurrentBuilding().
+  //
+  // If `zeroOverwritten` is true, objects whose references are overwritten are zeroed and their
+  // space released with releaseSpace(); otherwise they are simply abandoned.  See
+  // MessageBuilder::enableOverwriteZeroing().
+  //
+  // If `reuseFreedSpace` is true, space released with releaseSpace() that can't simply be given
+  // back to the end of its segment is remembered and reused by allocateFreedSpace().  Implies
+  // `zeroOverwritten`.  See MessageBuilder::enableFreedSpaceReuse().
   ~BuilderArena();
   CAPNPROTO_DISALLOW_COPY(BuilderArena);
 
@@ -197,7 +272,41 @@ public:
   ArrayPtr<const ArrayPtr<const word>> getSegmentsForOutput();
   // Get an array of all the segments, suitable for writing out.  This only returns the allocated
   // portion of each segment, whereas tryGetSegment() returns something that includes
-  // not-yet-allocated space.
+  // not-yet-allocated space.  Released external segments at the end are left off entirely.
+
+  inline bool zeroesOverwrittenObjects() const { return zeroOverwritten; }
+
+  inline void releaseSpace(SegmentBuilder* segment, word* start, WordCount size);
+  // Give back the space of an object that is no longer reachable.  The caller must have zeroed it.
+  // If it was the last thing allocated in its segment, the segment's allocation pointer is rolled
+  // back; otherwise, if space reuse is enabled, it is added to the segment's free list.
+
+  inline word* allocateFreedSpace(SegmentBuilder* segment, WordCount amount);
+  // Allocate zeroed space in the given segment from its free list.  Returns null if space reuse is
+  // disabled or no freed block is large enough.  Called when segment->allocate() fails, so that
+  // the segment fills its holes before the message grows into another segment.
+
+  SegmentBuilder* addExternalSegment(ArrayPtr<const word> content);
+  // Add a segment consisting of caller-owned memory, which must stay valid and unchanged for as
+  // long as the message is used.  getSegmentsForOutput() returns the memory itself rather than a
+  // copy, so a message can carry a large blob without ever copying it.  Nothing is allocated in
+  // the segment, the builder never writes to it, and compact() copies what is reachable out of it.
+
+  void compact();
+  // Rewrite the message so that it occupies only segment 0, containing exactly the objects
+  // reachable from the root.  If segment 0 is too small, a new segment 0 is allocated.  The memory
+  // of all other segments is zeroed and kept to be reused if the message grows again.  All
+  // existing pointers into the message are invalidated.  Must not be called while other threads
+  // are building the message.
+
+  AllocationStats getAllocationStats();
+  // All zero unless compiled with CAPNPROTO_ALLOCATION_STATS.
+
+  // Allocation statistics.  These compile to nothing unless CAPNPROTO_ALLOCATION_STATS is set.
+  inline void countAllocation(WordCount amount);
+  inline void countFarReference();
+  inline void countDefaultValueCopy();
+  inline void countZeroed(WordCount amount);
 
   // TODO:  Methods to deal with bundled capabilities.
 
@@ -209,15 +318,107 @@ public:
 private:
   MessageBuilder* message;
   ReadLimiter dummyLimiter;
+  bool concurrent;
+  bool reuseFreedSpace;
+  bool zeroOverwritten;
 
   SegmentBuilder segment0;
   ArrayPtr<const word> segment0ForOutput;
 
+#if CAPNPROTO_ALLOCATION_STATS
+  struct StatCounters {
+    // Atomic so that concurrent building doesn't lose counts.  When not building concurrently we
+    // avoid the locked add; see addToStat().
+    std::atomic<uint64_t> wordsAllocated;
+    std::atomic<uint64_t> wordsReserved;
+    std::atomic<uint64_t> segmentsAllocated;
+    std::atomic<uint64_t> farReferences;
+    std::atomic<uint64_t> defaultValueCopies;
+    std::atomic<uint64_t> wordsZeroed;
+
+    StatCounters()
+        : wordsAllocated(0), wordsReserved(0), segmentsAllocated(0), farReferences(0),
+          defaultValueCopies(0), wordsZeroed(0) {}
+  };
+  StatCounters stats;
+
+  inline void addToStat(std::atomic<uint64_t>& counter, uint64_t amount) {
+    if (concurrent) {
+      counter.fetch_add(amount, std::memory_order_relaxed);
+    } else {
+      counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+  }
+#endif
+
+  struct AvailableSegment {
+    WordCount lastKnownAvailable;
+    SegmentBuilder* segment;
+
+    inline bool operator<(const AvailableSegment& other) const {
+      return lastKnownAvailable < other.lastKnownAvailable;
+    }
+  };
+
   struct MultiSegmentState {
     std::vector<std::unique_ptr<SegmentBuilder>> builders;
     std::vector<ArrayPtr<const word>> forOutput;
+
+    std::vector<ArrayPtr<word>> spareSegments;
+    // Zeroed segments left over from compact(), handed out again before asking the MessageBuilder
+    // for more memory.
+
+    std::vector<std::vector<ArrayPtr<word>>> freeLists;
+    // Indexed by segment ID.  Zeroed blocks released by releaseSpace(), when space reuse is
+    // enabled.  In concurrent mode, guarded by `mutex`.
+
+    std::priority_queue<AvailableSegment> available;
+    // Every segment other than segment0, keyed by how much space it had available the last time we
+    // looked.  SegmentBuilder::allocate() doesn't update this (it needs to stay fast), so the keys
+    // are upper bounds; getSegmentWithAvailable() re-checks a segment when popping it.  Not used in
+    // concurrent mode.
+
+    std::mutex mutex;
+    // Only used in concurrent mode.  Guards the vectors above as well as calls to
+    // MessageBuilder::allocateSegment().
+
+    std::atomic<SegmentBuilder**> segmentTable;
+    // Only used in concurrent mode.  A copy of `builders` (indexed by segment ID - 1) that
+    // getSegment() can read without taking the mutex.  Entries are only ever appended, under the
+    // mutex.  When the table fills up, a copy twice the size is published in its place; the old
+    // copies are kept in `segmentTables` until the arena is destroyed, since other threads may
+    // still be reading them.  Any thread that has seen a far reference to a segment has also seen
+    // (through whatever synchronization gave it the reference) a table containing that segment.
+
+    std::vector<std::unique_ptr<SegmentBuilder*[]>> segmentTables;
+    uint segmentTableCapacity;
+    // Guarded by `mutex`.
+
+    static constexpr uint THREAD_SLOTS = 8;
+    std::atomic<SegmentBuilder*> threadSegments[THREAD_SLOTS];
+    // Only used in concurrent mode.  Each thread is assigned one of these slots, which points at
+    // the segment that thread most recently added.  Threads allocate from their own slot's segment
+    // when the segment they are working in fills up, so that they don't all contend on the same
+    // allocation pointer.  Slots can be read without taking the mutex.
+
+    MultiSegmentState(): segmentTable(nullptr), segmentTableCapacity(0) {
+      for (auto& slot: threadSegments) {
+        slot.store(nullptr, std::memory_order_relaxed);
+      }
+    }
   };
   std::unique_ptr<MultiSegmentState> moreSegments;
+  // In concurrent mode, this is allocated as soon as segment0 is, so that threads never race to
+  // create it.
+
+  SegmentBuilder* addSegment(WordCount minimumAvailable);
+  void publishSegment(SegmentBuilder* segment);
+  ArrayPtr<word> takeSpareSegment(WordCount minimumSize);
+  ArrayPtr<word> allocateSegmentMemory(WordCount minimumSize);
+  void requeueSegment(SegmentBuilder* segment);
+  void addToFreeList(SegmentBuilder* segment, ArrayPtr<word> block);
+  word* allocateFromFreeList(SegmentBuilder* segment, WordCount amount);
+  SegmentBuilder* getSegmentWithAvailableConcurrently(WordCount minimumAvailable);
 };
 
 // =======================================================================================
@@ -244,11 +445,11 @@ inline bool ReadLimiter::canRead(WordCount amount, Arena* arena) {
 
 inline SegmentReader::SegmentReader(Arena* arena, SegmentId id, ArrayPtr<const word> ptr,
                                     ReadLimiter* readLimiter)
-    : arena(arena), id(id), ptr(ptr), readLimiter(readLimiter) {}
+    : arena(arena), id(id), validated(false), ptr(ptr), readLimiter(readLimiter) {}
 
 inline bool SegmentReader::containsInterval(const word* from, const word* to) {
-  return from >= this->ptr.begin() && to <= this->ptr.end() &&
-      readLimiter->canRead(intervalLength(from, to), arena);
+  return validated || (from >= this->ptr.begin() && to <= this->ptr.end() &&
+      readLimiter->canRead(intervalLength(from, to), arena));
 }
 
 inline Arena* SegmentReader::getArena() { return arena; }
@@ -263,25 +464,57 @@ inline ArrayPtr<const word> SegmentReader::getArray() { return ptr; }
 // -------------------------------------------------------------------
 
 inline SegmentBuilder::SegmentBuilder(
-    BuilderArena* arena, SegmentId id, ArrayPtr<word> ptr, ReadLimiter* readLimiter)
+    BuilderArena* arena, SegmentId id, ArrayPtr<word> ptr, ReadLimiter* readLimiter,
+    bool concurrent)
     : SegmentReader(arena, id, ptr, readLimiter),
-      pos(ptr.begin()) {}
+      pos(ptr.begin()), concurrent(concurrent), external(false) {}
+
+inline SegmentBuilder::SegmentBuilder(
+    BuilderArena* arena, SegmentId id, ArrayPtr<const word> external, ReadLimiter* readLimiter)
+    : SegmentReader(arena, id, external, readLimiter),
+      pos(const_cast<word*>(external.end())), concurrent(false), external(true) {}
 
 inline word* SegmentBuilder::allocate(WordCount amount) {
+  if (CAPNPROTO_EXPECT_FALSE(concurrent)) {
+    return allocateConcurrently(amount);
+  }
+
   if (amount > intervalLength(pos, ptr.end())) {
     return nullptr;
   } else {
-    // TODO:  Atomic increment, backtracking if we go over, would make this thread-safe.  How much
-    //   would it cost in the single-threaded case?  Is it free?  Benchmark it.
     word* result = pos;
     pos += amount;
     return result;
   }
 }
 
+inline word* SegmentBuilder::allocateConcurrently(WordCount amount) {
+  // Claim the space first and check whether we went over afterwards.  If we did, we try to give
+  // the space back, which only works if no one else has allocated since; otherwise, the segment is
+  // simply left full.  Either way, nothing past the end is ever handed out, so concurrent callers
+  // always receive disjoint ranges.
+  // (The builtins don't scale pointer arithmetic, so the addend is in bytes.)
+  word* result = __atomic_fetch_add(&pos, amount / WORDS * sizeof(word), __ATOMIC_RELAXED);
+  if (result <= ptr.end() && amount <= intervalLength(result, ptr.end())) {
+    return result;
+  } else {
+    word* expected = result + amount;
+    __atomic_compare_exchange_n(&pos, &expected, result, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return nullptr;
+  }
+}
+
+inline word* SegmentBuilder::currentPos() {
+  word* result = concurrent ? __atomic_load_n(&pos, __ATOMIC_RELAXED) : pos;
+  word* end = getPtrUnchecked(getSize());
+  return result > end ? end : result;
+}
+
 inline word* SegmentBuilder::getPtrUnchecked(WordCount offset) {
   // const_cast OK because SegmentBuilder's constructor always initializes its SegmentReader base
-  // class with a pointer that was originally non-const.
+  // class with a pointer that was originally non-const, except for external segments, which are
+  // never written.
   return const_cast<word*>(ptr.begin() + offset);
 }
 
@@ -292,17 +525,88 @@ inline BuilderArena* SegmentBuilder::getArena() {
 }
 
 inline WordCount SegmentBuilder::available() {
-  return intervalLength(pos, ptr.end());
+  return intervalLength(currentPos(), ptr.end());
 }
 
 inline ArrayPtr<const word> SegmentBuilder::currentlyAllocated() {
-  return arrayPtr(ptr.begin(), pos - ptr.begin());
+  return arrayPtr(ptr.begin(), currentPos() - ptr.begin());
+}
+
+inline bool SegmentBuilder::tryTruncate(word* from, word* to) {
+  if (CAPNPROTO_EXPECT_FALSE(external)) {
+    return false;
+  } else if (CAPNPROTO_EXPECT_FALSE(concurrent)) {
+    return __atomic_compare_exchange_n(&pos, &to, from, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  } else if (pos == to) {
+    pos = from;
+    return true;
+  } else {
+    return false;
+  }
+}
+
+inline bool SegmentBuilder::isExternal() { return external; }
+
+inline void SegmentBuilder::releaseExternal() {
+  // External segments are never concurrent, so a plain store is fine.
+  pos = const_cast<word*>(ptr.begin());
 }
 
 inline void SegmentBuilder::reset() {
   word* start = getPtrUnchecked(0 * WORDS);
-  memset(start, 0, (pos - start) * sizeof(word));
-  pos = start;
+  memset(start, 0, (currentPos() - start) * sizeof(word));
+  if (concurrent) {
+    __atomic_store_n(&pos, start, __ATOMIC_RELAXED);
+  } else {
+    pos = start;
+  }
+}
+
+// -------------------------------------------------------------------
+
+inline void BuilderArena::countAllocation(WordCount amount) {
+#if CAPNPROTO_ALLOCATION_STATS
+  addToStat(stats.wordsAllocated, amount / WORDS);
+#else
+  (void)amount;
+#endif
+}
+
+inline void BuilderArena::countFarReference() {
+#if CAPNPROTO_ALLOCATION_STATS
+  addToStat(stats.farReferences, 1);
+#endif
+}
+
+inline void BuilderArena::countDefaultValueCopy() {
+#if CAPNPROTO_ALLOCATION_STATS
+  addToStat(stats.defaultValueCopies, 1);
+#endif
+}
+
+inline void BuilderArena::countZeroed(WordCount amount) {
+#if CAPNPROTO_ALLOCATION_STATS
+  addToStat(stats.wordsZeroed, amount / WORDS);
+#else
+  (void)amount;
+#endif
+}
+
+inline void BuilderArena::releaseSpace(SegmentBuilder* segment, word* start, WordCount size) {
+  if (size == 0 * WORDS) {
+    return;
+  } else if (segment->tryTruncate(start, start + size)) {
+    if (!concurrent && segment != &segment0) {
+      requeueSegment(segment);
+    }
+  } else if (reuseFreedSpace) {
+    addToFreeList(segment, arrayPtr(start, size / WORDS));
+  }
+}
+
+inline word* BuilderArena::allocateFreedSpace(SegmentBuilder* segment, WordCount amount) {
+  return reuseFreedSpace ? allocateFromFreeList(segment, amount) : nullptr;
 }
 
 }  // namespace internal
@@ -27,6 +27,7 @@
 #include "common.h"
 #include <capnproto/serialize.h>
 #include <capnproto/serialize-packed.h>
+#include <capnproto/io-uring.h>
 #if HAVE_SNAPPY
 #include <capnproto/serialize-snappy.h>
 #endif  // HAVE_SNAPPY
@@ -55,10 +56,62 @@ public:
   }
 };
 
+class CountingUringOutputStream: public UringOutputStream {
+public:
+  CountingUringOutputStream(int fd): UringOutputStream(fd), throughput(0) {}
+
+  uint64_t throughput;
+
+  void write(const void* buffer, size_t size) override {
+    UringOutputStream::write(buffer, size);
+    throughput += size;
+  }
+};
+
+class LoopingInputStream: public BufferedInputStream {
+  // Reads the same bytes over and over.  The array must hold whole messages, so that wrapping
+  // around always happens at a message boundary.
+
+public:
+  explicit LoopingInputStream(ArrayPtr<const byte> array): array(array), pos(array.begin()) {}
+  CAPNPROTO_DISALLOW_COPY(LoopingInputStream);
+
+  ArrayPtr<const byte> getReadBuffer() override {
+    if (pos == array.end()) pos = array.begin();
+    return arrayPtr(pos, array.end());
+  }
+
+  size_t read(void* buffer, size_t minBytes, size_t maxBytes) override {
+    byte* dst = reinterpret_cast<byte*>(buffer);
+    size_t total = 0;
+    while (total < minBytes) {
+      ArrayPtr<const byte> available = getReadBuffer();
+      size_t amount = std::min(available.size(), maxBytes - total);
+      memcpy(dst + total, pos, amount);
+      pos += amount;
+      total += amount;
+    }
+    return total;
+  }
+
+  void skip(size_t bytes) override {
+    while (bytes > 0) {
+      size_t amount = std::min(getReadBuffer().size(), bytes);
+      pos += amount;
+      bytes -= amount;
+    }
+  }
+
+private:
+  ArrayPtr<const byte> array;
+  const byte* pos;
+};
+
 // =======================================================================================
 
 struct Uncompressed {
   typedef FdInputStream& BufferedInput;
+  typedef InputStream Input;
   typedef InputStreamMessageReader MessageReader;
 
   class ArrayMessageReader: public FlatArrayMessageReader {
@@ -78,6 +131,7 @@ struct Uncompressed {
 
 struct Packed {
   typedef BufferedInputStreamWrapper BufferedInput;
+  typedef BufferedInputStream Input;
   typedef PackedMessageReader MessageReader;
 
   class ArrayMessageReader: private ArrayInputStream, public PackedMessageReader {
@@ -105,6 +159,7 @@ static byte snappyCompressedBuffer[SNAPPY_COMPRESSED_BUFFER_SIZE];
 
 struct SnappyCompressed {
   typedef BufferedInputStreamWrapper BufferedInput;
+  typedef BufferedInputStream Input;
   typedef SnappyPackedMessageReader MessageReader;
 
   class ArrayMessageReader: private ArrayInputStream, public SnappyPackedMessageReader {
@@ -133,7 +188,7 @@ struct NoScratch {
   template <typename Compression>
   class MessageReader: public Compression::MessageReader {
   public:
-    inline MessageReader(typename Compression::BufferedInput& input, ScratchSpace& scratch)
+    inline MessageReader(typename Compression::Input& input, ScratchSpace& scratch)
         : Compression::MessageReader(input) {}
   };
 
@@ -149,6 +204,38 @@ struct NoScratch {
     inline MessageBuilder(ScratchSpace& scratch): MallocMessageBuilder() {}
   };
 
+  template <typename Compression>
+  class StreamReader {
+    // Reads each message from the stream with a new reader, like a loop that declares its reader
+    // inside the loop body.
+
+  public:
+    inline StreamReader(BufferedInputStream& input, ScratchSpace& scratch): StreamReader(input) {}
+    inline explicit StreamReader(BufferedInputStream& input): input(input), constructed(false) {}
+    ~StreamReader() { destroy(); }
+
+    capnproto::MessageReader& next() {
+      // The previous reader has to finish reading its message before the next one starts.
+      destroy();
+      new(&space) Reader(input);
+      constructed = true;
+      return *reinterpret_cast<Reader*>(&space);
+    }
+
+  private:
+    typedef typename Compression::MessageReader Reader;
+    BufferedInputStream& input;
+    typename std::aligned_storage<sizeof(Reader), alignof(Reader)>::type space;
+    bool constructed;
+
+    void destroy() {
+      if (constructed) {
+        reinterpret_cast<Reader*>(&space)->~Reader();
+        constructed = false;
+      }
+    }
+  };
+
   class ObjectSizeCounter {
   public:
     ObjectSizeCounter(uint64_t iters): counter(0) {}
@@ -170,6 +257,42 @@ struct NoScratch {
   };
 };
 
+struct AdaptiveFirstSegment {
+  // Like NoScratch, but all builders in the same role share an AdaptiveFirstSegmentSize, so the
+  // first segment is sized from the messages built so far rather than fixed.
+  struct ScratchSpace {
+    AdaptiveFirstSegmentSize firstSegmentSize;
+  };
+
+  template <typename Compression>
+  class MessageReader: public Compression::MessageReader {
+  public:
+    inline MessageReader(typename Compression::Input& input, ScratchSpace& scratch)
+        : Compression::MessageReader(input) {}
+  };
+
+  template <typename Compression>
+  class ArrayMessageReader: public Compression::ArrayMessageReader {
+  public:
+    inline ArrayMessageReader(ArrayPtr<const byte> input, ScratchSpace& scratch)
+        : Compression::ArrayMessageReader(input) {}
+  };
+
+  class MessageBuilder: public MallocMessageBuilder {
+  public:
+    inline MessageBuilder(ScratchSpace& scratch): MallocMessageBuilder(scratch.firstSegmentSize) {}
+  };
+
+  template <typename Compression>
+  class StreamReader: public NoScratch::StreamReader<Compression> {
+  public:
+    inline StreamReader(BufferedInputStream& input, ScratchSpace& scratch)
+        : NoScratch::StreamReader<Compression>(input) {}
+  };
+
+  typedef NoScratch::ObjectSizeCounter ObjectSizeCounter;
+};
+
 constexpr size_t SCRATCH_SIZE = 128 * 1024;
 word scratchSpace[6 * SCRATCH_SIZE];
 int scratchCounter = 0;
@@ -190,7 +313,7 @@ struct UseScratch {
   template <typename Compression>
   class MessageReader: public Compression::MessageReader {
   public:
-    inline MessageReader(typename Compression::BufferedInput& input, ScratchSpace& scratch)
+    inline MessageReader(typename Compression::Input& input, ScratchSpace& scratch)
         : Compression::MessageReader(
             input, ReaderOptions(), arrayPtr(scratch.words, SCRATCH_SIZE)) {}
   };
@@ -209,6 +332,31 @@ struct UseScratch {
         : MallocMessageBuilder(arrayPtr(scratch.words, SCRATCH_SIZE)) {}
   };
 
+  template <typename Compression>
+  class StreamReader {
+    // Reads every message from the stream with the same reader, calling reset() between them.
+
+  public:
+    inline StreamReader(BufferedInputStream& input, ScratchSpace& scratch)
+        : input(input), scratch(scratch) {}
+
+    capnproto::MessageReader& next() {
+      if (reader == nullptr) {
+        reader = std::unique_ptr<Reader>(
+            new Reader(input, ReaderOptions(), arrayPtr(scratch.words, SCRATCH_SIZE)));
+      } else {
+        reader->reset();
+      }
+      return *reader;
+    }
+
+  private:
+    typedef typename Compression::MessageReader Reader;
+    BufferedInputStream& input;
+    ScratchSpace& scratch;
+    std::unique_ptr<Reader> reader;
+  };
+
   class ObjectSizeCounter {
   public:
     ObjectSizeCounter(uint64_t iters): iters(iters), maxSize(0) {}
@@ -327,11 +475,87 @@ struct BenchmarkMethods {
     return output.throughput;
   }
 
+  static void uringClientReceiver(
+      int inputFd, ProducerConsumerQueue<typename TestCase::Expectation>* expectations,
+      uint64_t iters) {
+    UringInputStream input(inputFd);
+    typename ReuseStrategy::ScratchSpace scratch;
+
+    for (; iters > 0; --iters) {
+      typename TestCase::Expectation expected = expectations->next();
+      typename ReuseStrategy::template MessageReader<Compression> reader(input, scratch);
+      if (!TestCase::checkResponse(
+          reader.template getRoot<typename TestCase::Response>(), expected)) {
+        throw std::logic_error("Incorrect response.");
+      }
+    }
+  }
+
+  static uint64_t uringClient(int inputFd, int outputFd, uint64_t iters) {
+    // Like asyncClient(), but requests only go out when half the output buffer is full.  This is
+    // fine because the sender never waits for a response; it flushes when it's done.
+    ProducerConsumerQueue<typename TestCase::Expectation> expectations;
+    std::thread receiverThread(uringClientReceiver, inputFd, &expectations, iters);
+
+    uint64_t throughput;
+    {
+      CountingUringOutputStream output(outputFd);
+      typename ReuseStrategy::ScratchSpace scratch;
+
+      for (uint64_t i = iters; i > 0; --i) {
+        typename ReuseStrategy::MessageBuilder builder(scratch);
+        expectations.post(TestCase::setupRequest(
+            builder.template initRoot<typename TestCase::Request>()));
+        Compression::write(output, builder);
+      }
+
+      output.flush();
+      throughput = output.throughput;
+    }
+
+    receiverThread.join();
+    return throughput;
+  }
+
+  static uint64_t uringServer(int inputFd, int outputFd, uint64_t iters) {
+    // Responses are batched until the server runs out of requests to handle, so a burst of
+    // requests is answered with a few large writes.
+    UringInputStream input(inputFd);
+    CountingUringOutputStream output(outputFd);
+    typename ReuseStrategy::ScratchSpace builderScratch;
+    typename ReuseStrategy::ScratchSpace readerScratch;
+
+    for (; iters > 0; --iters) {
+      {
+        typename ReuseStrategy::MessageBuilder builder(builderScratch);
+        typename ReuseStrategy::template MessageReader<Compression> reader(input, readerScratch);
+        TestCase::handleRequest(reader.template getRoot<typename TestCase::Request>(),
+                                builder.template initRoot<typename TestCase::Response>());
+        Compression::write(output, builder);
+      }
+
+      if (!input.isDataReady()) {
+        output.flush();
+      }
+    }
+
+    output.flush();
+    return output.throughput;
+  }
+
+  static uint64_t passByUringPipe(uint64_t iters) {
+    return passByPipe(uringClient, uringServer, iters);
+  }
+
   static uint64_t passByObject(uint64_t iters, bool countObjectSize) {
     typename ReuseStrategy::ScratchSpace requestScratch;
     typename ReuseStrategy::ScratchSpace responseScratch;
 
     typename ReuseStrategy::ObjectSizeCounter counter(iters);
+#if CAPNPROTO_ALLOCATION_STATS
+    AllocationStats allocationStats;
+    uint64_t totalIters = iters;
+#endif
 
     for (; iters > 0; --iters) {
       typename ReuseStrategy::MessageBuilder requestMessage(requestScratch);
@@ -348,9 +572,28 @@ struct BenchmarkMethods {
 
       if (countObjectSize) {
         counter.add(requestMessage, responseMessage);
+#if CAPNPROTO_ALLOCATION_STATS
+        allocationStats += requestMessage.getAllocationStats();
+        allocationStats += responseMessage.getAllocationStats();
+#endif
       }
     }
 
+#if CAPNPROTO_ALLOCATION_STATS
+    if (countObjectSize && totalIters > 0) {
+      // stdout is reserved for the number the runner reads, so report on stderr.
+      fprintf(stderr,
+          "allocation stats per request/response pair:  %.1f words allocated, %.1f words reserved, "
+          "%.2f segments, %.2f far references, %.2f default value copies, %.1f words zeroed\n",
+          double(allocationStats.wordsAllocated) / totalIters,
+          double(allocationStats.wordsReserved) / totalIters,
+          double(allocationStats.segmentsAllocated) / totalIters,
+          double(allocationStats.farReferences) / totalIters,
+          double(allocationStats.defaultValueCopies) / totalIters,
+          double(allocationStats.wordsZeroed) / totalIters);
+    }
+#endif
+
     return counter.get();
   }
 
@@ -394,6 +637,49 @@ struct BenchmarkMethods {
 
     return throughput;
   }
+
+  static uint64_t passByStream(uint64_t iters) {
+    // Measures the per-message cost of reading a stream of requests, as a server does.  A batch of
+    // requests is serialized once up front; the server side then reads and handles `iters`
+    // messages, cycling through the batch.  Compare "reuse" (one reader, reset() per message)
+    // with "no-reuse" (a new reader per message) to see the cost of setting up a reader.
+    static constexpr uint BATCH_SIZE = 64;
+
+    std::string batch;
+    {
+      typename ReuseStrategy::ScratchSpace scratch;
+      for (uint i = 0; i < BATCH_SIZE; i++) {
+        typename ReuseStrategy::MessageBuilder builder(scratch);
+        TestCase::setupRequest(builder.template initRoot<typename TestCase::Request>());
+
+        // Packing never more than doubles the size, nor does Snappy.
+        size_t maxBytes = 64;
+        for (auto segment: builder.getSegmentsForOutput()) {
+          maxBytes += segment.size() * sizeof(word) * 2;
+        }
+        Array<byte> bytes = newArray<byte>(maxBytes);
+        ArrayOutputStream output(bytes.asPtr());
+        Compression::write(output, builder);
+        batch.append(reinterpret_cast<const char*>(output.getArray().begin()),
+                     output.getArray().size());
+      }
+    }
+
+    LoopingInputStream input(arrayPtr(reinterpret_cast<const byte*>(batch.data()), batch.size()));
+    typename ReuseStrategy::ScratchSpace readerScratch;
+    typename ReuseStrategy::ScratchSpace builderScratch;
+    typename ReuseStrategy::template StreamReader<Compression> reader(input, readerScratch);
+    uint64_t throughput = uint64_t(batch.size()) * iters / BATCH_SIZE;
+
+    for (; iters > 0; --iters) {
+      capnproto::MessageReader& message = reader.next();
+      typename ReuseStrategy::MessageBuilder builder(builderScratch);
+      TestCase::handleRequest(message.getRoot<typename TestCase::Request>(),
+                              builder.template initRoot<typename TestCase::Response>());
+    }
+
+    return throughput;
+  }
 };
 
 struct BenchmarkTypes {
@@ -405,6 +691,7 @@ struct BenchmarkTypes {
 
   typedef capnp::UseScratch ReusableResources;
   typedef capnp::NoScratch SingleUseResources;
+  typedef capnp::AdaptiveFirstSegment AdaptiveResources;
 
   template <typename TestCase, typename ReuseStrategy, typename Compression>
   struct BenchmarkMethods: public capnp::BenchmarkMethods<TestCase, ReuseStrategy, Compression> {};
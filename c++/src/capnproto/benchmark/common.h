@@ -57,6 +57,12 @@ static inline double fastRandDouble(double range) {
   return nextFastRand() * range / std::numeric_limits<uint32_t>::max();
 }
 
+static inline uint64_t currentRealNanos() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+}
+
 inline int32_t div(int32_t a, int32_t b) {
   if (b == 0) return std::numeric_limits<int32_t>::max();
   // INT_MIN / -1 => SIGFPE.  Who knew?
@@ -165,32 +171,38 @@ static void readAll(int fd, void* buffer, size_t size) {
   }
 }
 
-template <typename BenchmarkMethods, typename Func>
-uint64_t passByPipe(Func&& clientFunc, uint64_t iters) {
+template <typename ClientFunc, typename ServerFunc>
+uint64_t passByPipe(ClientFunc&& clientFunc, ServerFunc&& serverFunc, uint64_t iters) {
   int clientToServer[2];
   int serverToClient[2];
+  int clientThroughputPipe[2];
   if (pipe(clientToServer) < 0) throw OsException(errno);
   if (pipe(serverToClient) < 0) throw OsException(errno);
+  // The client reports its throughput on a pipe of its own, since a server that reads ahead may
+  // already have consumed anything sent after the last request.
+  if (pipe(clientThroughputPipe) < 0) throw OsException(errno);
 
   pid_t child = fork();
   if (child == 0) {
     // Client.
     close(clientToServer[0]);
     close(serverToClient[1]);
+    close(clientThroughputPipe[0]);
 
     uint64_t throughput = clientFunc(serverToClient[0], clientToServer[1], iters);
-    writeAll(clientToServer[1], &throughput, sizeof(throughput));
+    writeAll(clientThroughputPipe[1], &throughput, sizeof(throughput));
 
     exit(0);
   } else {
     // Server.
     close(clientToServer[1]);
     close(serverToClient[0]);
+    close(clientThroughputPipe[1]);
 
-    uint64_t throughput = BenchmarkMethods::server(clientToServer[0], serverToClient[1], iters);
+    uint64_t throughput = serverFunc(clientToServer[0], serverToClient[1], iters);
 
     uint64_t clientThroughput = 0;
-    readAll(clientToServer[0], &clientThroughput, sizeof(clientThroughput));
+    readAll(clientThroughputPipe[0], &clientThroughput, sizeof(clientThroughput));
     throughput += clientThroughput;
 
     int status;
@@ -219,10 +231,14 @@ uint64_t doBenchmark(const std::string& mode, uint64_t iters) {
     return BenchmarkMethods::passByObject(iters, true);
   } else if (mode == "bytes") {
     return BenchmarkMethods::passByBytes(iters);
+  } else if (mode == "stream") {
+    return BenchmarkMethods::passByStream(iters);
   } else if (mode == "pipe") {
-    return passByPipe<BenchmarkMethods>(BenchmarkMethods::syncClient, iters);
+    return passByPipe(BenchmarkMethods::syncClient, BenchmarkMethods::server, iters);
   } else if (mode == "pipe-async") {
-    return passByPipe<BenchmarkMethods>(BenchmarkMethods::asyncClient, iters);
+    return passByPipe(BenchmarkMethods::asyncClient, BenchmarkMethods::server, iters);
+  } else if (mode == "pipe-uring") {
+    return BenchmarkMethods::passByUringPipe(iters);
   } else {
     fprintf(stderr, "Unknown mode: %s\n", mode.c_str());
     exit(1);
@@ -239,6 +255,10 @@ uint64_t doBenchmark2(const std::string& mode, const std::string& reuse, uint64_
     return doBenchmark<
         BenchmarkTypes, TestCase, typename BenchmarkTypes::SingleUseResources, Compression>(
             mode, iters);
+  } else if (reuse == "adaptive") {
+    return doBenchmark<
+        BenchmarkTypes, TestCase, typename BenchmarkTypes::AdaptiveResources, Compression>(
+            mode, iters);
   } else {
     fprintf(stderr, "Unknown reuse mode: %s\n", reuse.c_str());
     exit(1);
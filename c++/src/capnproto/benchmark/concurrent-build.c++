@@ -0,0 +1,220 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Measures the cost of building large messages with MessageBuilder::enableConcurrentBuilding(),
+// both to check that the single-threaded cost of the default mode is unchanged and to show how
+// building scales when several threads fill in the same message.  Also times the bare segment
+// allocator in both modes against a copy of the plain (non-atomic) pointer bump it replaced.
+
+#include "catrank.capnp.h"
+#include "common.h"
+#include <capnproto/message.h>
+#include <capnproto/arena.h>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+namespace capnproto {
+namespace benchmark {
+namespace capnp {
+
+static const char URL_PREFIX[] = "http://example.com/";
+
+void fillResults(List<SearchResult>::Builder list, uint begin, uint end) {
+  char url[sizeof(URL_PREFIX) + 26];
+  memcpy(url, URL_PREFIX, sizeof(URL_PREFIX) - 1);
+
+  for (uint i = begin; i < end; i++) {
+    SearchResult::Builder result = list[i];
+    result.setScore(1000 - i);
+
+    uint urlSize = i % 26;
+    for (uint j = 0; j < urlSize; j++) {
+      url[sizeof(URL_PREFIX) - 1 + j] = 'a' + (i + j) % 26;
+    }
+    url[sizeof(URL_PREFIX) - 1 + urlSize] = '\0';
+    result.setUrl(Text::Reader(url, sizeof(URL_PREFIX) - 1 + urlSize));
+
+    std::string snippet;
+    for (uint j = 0; j < 20; j++) {
+      snippet.append(WORDS[(i + j) % WORDS_COUNT]);
+    }
+    result.setSnippet(snippet);
+  }
+}
+
+uint64_t buildMessages(bool concurrent, uint threadCount, uint resultCount, uint64_t iters) {
+  uint64_t totalSize = 0;
+
+  for (; iters > 0; --iters) {
+    MallocMessageBuilder message;
+    if (concurrent) {
+      message.enableConcurrentBuilding();
+    }
+
+    auto list = message.initRoot<SearchResultList>().initResults(resultCount);
+
+    if (threadCount <= 1) {
+      fillResults(list, 0, resultCount);
+    } else {
+      std::vector<std::thread> threads;
+      for (uint t = 0; t < threadCount; t++) {
+        threads.emplace_back(fillResults, list,
+            resultCount * t / threadCount, resultCount * (t + 1) / threadCount);
+      }
+      for (auto& thread: threads) {
+        thread.join();
+      }
+    }
+
+    for (auto segment: message.getSegmentsForOutput()) {
+      totalSize += segment.size() * sizeof(word);
+    }
+  }
+
+  return totalSize;
+}
+
+// -------------------------------------------------------------------
+// Bare allocation
+
+class PlainSegment {
+  // SegmentBuilder::allocate() as it was before concurrent building was added.
+public:
+  inline explicit PlainSegment(ArrayPtr<word> ptr): ptr(ptr), pos(ptr.begin()) {}
+
+  inline word* allocate(WordCount amount) {
+    if (amount > intervalLength(pos, ptr.end())) {
+      return nullptr;
+    } else {
+      word* result = pos;
+      pos += amount;
+      return result;
+    }
+  }
+
+private:
+  ArrayPtr<word> ptr;
+  word* pos;
+};
+
+template <typename Segment>
+uintptr_t fillSegment(Segment& segment) {
+  // Allocates objects of 1 to 4 words until the segment is full.
+  uintptr_t checksum = 0;
+  for (uint i = 0;; i++) {
+    word* ptr = segment.allocate((1 + i % 4) * ::capnproto::WORDS);
+    if (ptr == nullptr) break;
+    checksum ^= reinterpret_cast<uintptr_t>(ptr);
+  }
+  return checksum;
+}
+
+static constexpr uint BUMP_SEGMENT_WORDS = 1 << 16;
+static constexpr uint BUMP_ALLOCATIONS_PER_SEGMENT = BUMP_SEGMENT_WORDS / 10 * 4;
+
+enum class BumpMode { PLAIN, DEFAULT, CONCURRENT };
+
+void reportBump(const char* name, BumpMode mode, ArrayPtr<word> buffer, uint64_t iters) {
+  uintptr_t checksum = 0;
+  uint64_t start = currentRealNanos();
+  for (uint64_t i = 0; i < iters; i++) {
+    if (mode == BumpMode::PLAIN) {
+      PlainSegment segment(buffer);
+      checksum += fillSegment(segment);
+    } else {
+      internal::SegmentBuilder segment(nullptr, SegmentId(0), buffer, nullptr,
+                                       mode == BumpMode::CONCURRENT);
+      checksum += fillSegment(segment);
+    }
+  }
+  uint64_t time = currentRealNanos() - start;
+
+  std::cout << std::setw(40) << std::left << name
+            << std::setw(12) << std::right << (checksum & 0xfff)
+            << std::setw(12) << std::right << std::fixed << std::setprecision(2)
+            << (double(time) / iters / BUMP_ALLOCATIONS_PER_SEGMENT)
+            << std::endl;
+}
+
+// -------------------------------------------------------------------
+
+void report(const char* name, bool concurrent, uint threadCount, uint resultCount,
+            uint64_t iters) {
+  uint64_t start = currentRealNanos();
+  uint64_t size = buildMessages(concurrent, threadCount, resultCount, iters);
+  uint64_t time = currentRealNanos() - start;
+
+  std::cout << std::setw(40) << std::left << name
+            << std::setw(12) << std::right << (size / iters)
+            << std::setw(12) << std::right << (time / iters)
+            << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "USAGE:  %s THREAD_COUNT RESULT_COUNT ITERATION_COUNT\n", argv[0]);
+    return 1;
+  }
+
+  uint threadCount = strtoul(argv[1], nullptr, 0);
+  uint resultCount = strtoul(argv[2], nullptr, 0);
+  uint64_t iters = strtoull(argv[3], nullptr, 0);
+
+  std::cout << std::setw(40) << std::left << "Mode"
+            << std::setw(12) << std::right << "bytes"
+            << std::setw(12) << std::right << "wall ns"
+            << std::endl;
+  std::cout << std::setfill('=') << std::setw(64) << "" << std::setfill(' ') << std::endl;
+
+  report("default, 1 thread", false, 1, resultCount, iters);
+  report("concurrent, 1 thread", true, 1, resultCount, iters);
+
+  std::string name = "concurrent, " + std::to_string(threadCount) + " threads";
+  report(name.c_str(), true, threadCount, resultCount, iters);
+
+  std::cout << std::endl;
+  std::cout << std::setw(40) << std::left << "Allocator"
+            << std::setw(12) << std::right << "checksum"
+            << std::setw(12) << std::right << "ns / alloc"
+            << std::endl;
+  std::cout << std::setfill('=') << std::setw(64) << "" << std::setfill(' ') << std::endl;
+
+  std::unique_ptr<word[]> buffer(new word[BUMP_SEGMENT_WORDS]);
+  ArrayPtr<word> bumpBuffer = arrayPtr(buffer.get(), BUMP_SEGMENT_WORDS);
+  uint64_t bumpIters = iters * 16;
+  reportBump("plain pointer (before)", BumpMode::PLAIN, bumpBuffer, bumpIters);
+  reportBump("SegmentBuilder, default", BumpMode::DEFAULT, bumpBuffer, bumpIters);
+  reportBump("SegmentBuilder, concurrent", BumpMode::CONCURRENT, bumpBuffer, bumpIters);
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnproto
+
+int main(int argc, char* argv[]) {
+  return capnproto::benchmark::capnp::main(argc, argv);
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Measures the cost of following far references when reading a message split into many small
+// segments, which is where ReaderArena's segment lookup shows up.
+
+#include "catrank.capnp.h"
+#include "common.h"
+#include <capnproto/message.h>
+#include <capnproto/serialize.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+namespace capnproto {
+namespace benchmark {
+namespace capnp {
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "USAGE:  %s RESULT_COUNT SEGMENT_WORDS ITERATION_COUNT\n", argv[0]);
+    return 1;
+  }
+
+  uint resultCount = strtoul(argv[1], nullptr, 0);
+  uint segmentWords = strtoul(argv[2], nullptr, 0);
+  uint64_t iters = strtoull(argv[3], nullptr, 0);
+
+  // Small fixed-size segments push most URLs and snippets into a different segment from the result
+  // list that points at them.
+  Array<word> flat;
+  uint segmentCount;
+  {
+    MallocMessageBuilder message(segmentWords, AllocationStrategy::FIXED_SIZE);
+    auto list = message.initRoot<SearchResultList>().initResults(resultCount);
+    for (uint i = 0; i < resultCount; i++) {
+      SearchResult::Builder result = list[i];
+      result.setScore(i);
+      result.setUrl("http://example.com/");
+      result.setSnippet(WORDS[i % WORDS_COUNT]);
+    }
+    segmentCount = message.getSegmentsForOutput().size();
+    flat = messageToFlatArray(message);
+  }
+
+  uint64_t start = currentRealNanos();
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < iters; i++) {
+    // A new reader each time, so the cost of populating the segment table is included.
+    FlatArrayMessageReader reader(flat.asPtr());
+    for (SearchResult::Reader result: reader.getRoot<SearchResultList>().getResults()) {
+      total += result.getUrl().size() + result.getSnippet().size();
+    }
+  }
+  uint64_t time = currentRealNanos() - start;
+
+  if (total == 0) {
+    fprintf(stderr, "Message was empty?\n");
+    return 1;
+  }
+
+  // Most, but not all, text fields are reached through a far reference, depending on how many fit
+  // in one segment.
+  uint64_t textsRead = iters * resultCount * 2;
+  std::cout << "segments:       " << segmentCount << std::endl;
+  std::cout << "texts read:     " << textsRead << std::endl;
+  std::cout << "wall ns:        " << time << std::endl;
+  std::cout << "ns per text:    " << std::fixed << std::setprecision(2)
+            << double(time) / textsRead << std::endl;
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnproto
+
+int main(int argc, char* argv[]) {
+  return capnproto::benchmark::capnp::main(argc, argv);
+}
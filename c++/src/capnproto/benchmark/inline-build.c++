@@ -0,0 +1,140 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Messages per second for tiny messages, comparing where the first segment comes from:  calloc()
+// (MallocMessageBuilder), a caller-managed scratch buffer, or the builder object itself
+// (InlineMessageBuilder).
+
+#include "catrank.capnp.h"
+#include "common.h"
+#include <capnproto/message.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+namespace capnproto {
+namespace benchmark {
+namespace capnp {
+
+static constexpr uint INLINE_WORDS = 64;
+
+template <typename MessageBuilder>
+inline size_t buildMessage(MessageBuilder& message, uint words, Text::Reader url) {
+  // A SearchResultList with no results is 2 words.  A SearchResult is 4 words, plus its URL.
+  if (words < 4) {
+    message.template initRoot<SearchResultList>();
+  } else {
+    SearchResult::Builder result = message.template initRoot<SearchResult>();
+    result.setScore(words);
+    if (words > 4) {
+      result.setUrl(url);
+    }
+  }
+  return message.getSegmentsForOutput()[0].size();
+}
+
+template <typename Func>
+void report(const char* name, uint words, uint64_t iters, Func&& buildOne) {
+  uint64_t start = currentRealNanos();
+  size_t total = 0;
+  for (uint64_t i = 0; i < iters; i++) {
+    total += buildOne();
+  }
+  uint64_t time = currentRealNanos() - start;
+
+  if (total != iters * words) {
+    fprintf(stderr, "%s built %zu words, expected %llu.\n", name, total,
+            (long long unsigned int)(iters * words));
+    exit(1);
+  }
+
+  std::cout << std::setw(24) << std::left << name
+            << std::setw(8) << std::right << words
+            << std::setw(14) << std::right << (iters * 1000000000 / time)
+            << std::setw(10) << std::right << std::fixed << std::setprecision(1)
+            << double(time) / iters
+            << std::endl;
+}
+
+template <uint WORDS>
+void reportSize(uint64_t iters) {
+  static word scratch[INLINE_WORDS] = {};
+
+  // Fills out the rest of the message, including the NUL terminator.
+  std::string url(WORDS > 4 ? (WORDS - 4) * sizeof(word) - 1 : 0, 'x');
+  Text::Reader urlReader(url.c_str(), url.size());
+
+  report("malloc", WORDS, iters, [&]() {
+    MallocMessageBuilder message;
+    return buildMessage(message, WORDS, urlReader);
+  });
+  report("malloc, sized", WORDS, iters, [&]() {
+    MallocMessageBuilder message(WORDS);
+    return buildMessage(message, WORDS, urlReader);
+  });
+  report("malloc, scratch", WORDS, iters, [&]() {
+    MallocMessageBuilder message(arrayPtr(scratch, INLINE_WORDS));
+    return buildMessage(message, WORDS, urlReader);
+  });
+  report("inline<64>", WORDS, iters, [&]() {
+    InlineMessageBuilder<INLINE_WORDS> message;
+    return buildMessage(message, WORDS, urlReader);
+  });
+  report("inline, sized", WORDS, iters, [&]() {
+    InlineMessageBuilder<WORDS> message;
+    return buildMessage(message, WORDS, urlReader);
+  });
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "USAGE:  %s ITERATION_COUNT\n", argv[0]);
+    return 1;
+  }
+
+  uint64_t iters = strtoull(argv[1], nullptr, 0);
+
+  std::cout << std::setw(24) << std::left << "Builder"
+            << std::setw(8) << std::right << "words"
+            << std::setw(14) << std::right << "messages/s"
+            << std::setw(10) << std::right << "ns/msg"
+            << std::endl;
+  std::cout << std::setfill('=') << std::setw(56) << "" << std::setfill(' ') << std::endl;
+
+  reportSize<2>(iters);
+  reportSize<4>(iters);
+  reportSize<8>(iters);
+  reportSize<16>(iters);
+  reportSize<32>(iters);
+  reportSize<64>(iters);
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnproto
+
+int main(int argc, char* argv[]) {
+  return capnproto::benchmark::capnp::main(argc, argv);
+}
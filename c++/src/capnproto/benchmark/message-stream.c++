@@ -0,0 +1,155 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Measures reading a stream of tiny messages from a pipe, one StreamFdMessageReader per message
+// versus a single MessageStreamReader, reporting throughput and read() calls per message.  The
+// writer sends pre-serialized messages in large chunks so that the reader is the bottleneck.
+
+#include "catrank.capnp.h"
+#include "common.h"
+#include <capnproto/serialize.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+namespace capnproto {
+namespace benchmark {
+namespace capnp {
+
+static uint64_t readSyscalls() {
+  // Number of read-like system calls made by this process so far, per /proc/self/io.
+  FILE* file = fopen("/proc/self/io", "r");
+  if (file == nullptr) {
+    return 0;
+  }
+  char line[128];
+  unsigned long long result = 0;
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    if (sscanf(line, "syscr: %llu", &result) == 1) {
+      break;
+    }
+  }
+  fclose(file);
+  return result;
+}
+
+static void writeMessages(int fd, ArrayPtr<const word> message, uint64_t count) {
+  // Writes `count` copies of the message in chunks of about 64k.
+  uint64_t perChunk = std::max<uint64_t>(1, 65536 / (message.size() * sizeof(word)));
+  std::vector<uint64_t> chunk(perChunk * message.size());
+  for (uint64_t i = 0; i < perChunk; i++) {
+    memcpy(&chunk[i * message.size()], message.begin(), message.size() * sizeof(word));
+  }
+
+  while (count > 0) {
+    uint64_t n = std::min(count, perChunk);
+    writeAll(fd, chunk.data(), n * message.size() * sizeof(word));
+    count -= n;
+  }
+}
+
+template <typename ReadFunc>
+void measure(const char* name, ArrayPtr<const word> message, uint64_t count, ReadFunc&& readFunc) {
+  int fds[2];
+  if (pipe(fds) < 0) throw OsException(errno);
+
+  pid_t child = fork();
+  if (child == 0) {
+    close(fds[0]);
+    writeMessages(fds[1], message, count);
+    exit(0);
+  }
+  close(fds[1]);
+
+  uint64_t startReads = readSyscalls();
+  uint64_t start = currentRealNanos();
+  uint64_t total = readFunc(fds[0], count);
+  uint64_t time = currentRealNanos() - start;
+  uint64_t reads = readSyscalls() - startReads;
+
+  close(fds[0]);
+  int status;
+  if (waitpid(child, &status, 0) != child) {
+    throw OsException(errno);
+  }
+  if (total != count * 7) {
+    throw std::logic_error("Wrong result.");
+  }
+
+  std::cout << std::setw(20) << std::left << name
+            << std::setw(15) << std::right << std::fixed << std::setprecision(0)
+            << count * 1e9 / time
+            << std::setw(15) << std::right << std::setprecision(3)
+            << double(reads) / count << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "USAGE:  %s MESSAGE_COUNT\n", argv[0]);
+    return 1;
+  }
+
+  uint64_t count = strtoull(argv[1], nullptr, 0);
+
+  MallocMessageBuilder builder;
+  {
+    SearchResult::Builder result = builder.initRoot<SearchResult>();
+    result.setScore(1);
+    result.setUrl("http://");
+  }
+  Array<word> message = messageToFlatArray(builder);
+
+  std::cout << "message bytes:  " << message.size() * sizeof(word) << std::endl;
+  std::cout << std::setw(20) << std::left << "mode"
+            << std::setw(15) << std::right << "messages/s"
+            << std::setw(15) << std::right << "reads/message" << std::endl;
+
+  measure("StreamFdMessage", message.asPtr(), count, [](int fd, uint64_t count) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < count; i++) {
+      StreamFdMessageReader reader(fd);
+      total += reader.getRoot<SearchResult>().getUrl().size();
+    }
+    return total;
+  });
+
+  measure("MessageStream", message.asPtr(), count, [](int fd, uint64_t count) {
+    uint64_t total = 0;
+    MessageStreamReader stream(fd);
+    while (stream.next()) {
+      total += stream.getMessage().getRoot<SearchResult>().getUrl().size();
+    }
+    return total;
+  });
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnproto
+
+int main(int argc, char* argv[]) {
+  return capnproto::benchmark::capnp::main(argc, argv);
+}
@@ -0,0 +1,126 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Compares MallocMessageBuilder against MmapMessageBuilder when building very large messages.
+// Each message is built once per builder, since at these sizes page faults and zeroing dominate.
+
+#include "catrank.capnp.h"
+#include "common.h"
+#include <capnproto/message.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+namespace capnproto {
+namespace benchmark {
+namespace capnp {
+
+static constexpr uint BYTES_PER_RESULT_ESTIMATE = 176;
+
+template <typename BuilderFactory>
+void report(const char* name, uint64_t targetBytes, BuilderFactory&& newBuilder) {
+  std::string snippet;
+  for (uint j = 0; j < 24; j++) {
+    snippet.append(WORDS[j % WORDS_COUNT]);
+  }
+
+  uint resultCount = targetBytes / BYTES_PER_RESULT_ESTIMATE;
+  uint64_t start = currentRealNanos();
+  uint64_t size = 0;
+  uint segmentCount = 0;
+
+  {
+    auto message = newBuilder();
+    auto list = message->template initRoot<SearchResultList>().initResults(resultCount);
+    for (uint i = 0; i < resultCount; i++) {
+      SearchResult::Builder result = list[i];
+      result.setScore(i);
+      result.setUrl("http://example.com/");
+      result.setSnippet(snippet);
+    }
+
+    for (auto segment: message->getSegmentsForOutput()) {
+      size += segment.size() * sizeof(word);
+      ++segmentCount;
+    }
+  }
+
+  uint64_t time = currentRealNanos() - start;
+
+  std::cout << std::setw(24) << std::left << name
+            << std::setw(14) << std::right << size
+            << std::setw(10) << std::right << segmentCount
+            << std::setw(14) << std::right << (time / 1000)
+            << std::setw(12) << std::right << ((time << 20) / size)
+            << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "USAGE:  %s MIN_MEGABYTES MAX_MEGABYTES\n", argv[0]);
+    return 1;
+  }
+
+  uint64_t minBytes = strtoull(argv[1], nullptr, 0) << 20;
+  uint64_t maxBytes = strtoull(argv[2], nullptr, 0) << 20;
+
+  std::cout << std::setw(24) << std::left << "Builder"
+            << std::setw(14) << std::right << "bytes"
+            << std::setw(10) << std::right << "segments"
+            << std::setw(14) << std::right << "wall us"
+            << std::setw(12) << std::right << "ns/MiB"
+            << std::endl;
+  std::cout << std::setfill('=') << std::setw(74) << "" << std::setfill(' ') << std::endl;
+
+  for (uint64_t bytes = minBytes; bytes <= maxBytes; bytes *= 2) {
+    // Reserve twice the target so that the estimate being off never spills into a second segment.
+    size_t reserveWords = std::min<size_t>(bytes * 2 / sizeof(word),
+                                           MmapMessageBuilder::MAX_SEGMENT_WORDS);
+
+    report("malloc", bytes, []() {
+      return std::unique_ptr<MessageBuilder>(new MallocMessageBuilder());
+    });
+    report("mmap", bytes, [=]() {
+      return std::unique_ptr<MessageBuilder>(
+          new MmapMessageBuilder(reserveWords, MmapMessageBuilder::HugePages::NONE));
+    });
+    report("mmap, transparent huge", bytes, [=]() {
+      return std::unique_ptr<MessageBuilder>(
+          new MmapMessageBuilder(reserveWords, MmapMessageBuilder::HugePages::TRANSPARENT));
+    });
+    report("mmap, explicit huge", bytes, [=]() {
+      return std::unique_ptr<MessageBuilder>(
+          new MmapMessageBuilder(reserveWords, MmapMessageBuilder::HugePages::EXPLICIT));
+    });
+  }
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnproto
+
+int main(int argc, char* argv[]) {
+  return capnproto::benchmark::capnp::main(argc, argv);
+}
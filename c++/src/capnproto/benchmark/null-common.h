@@ -155,6 +155,16 @@ struct BenchmarkMethods {
     fprintf(stderr, "Null benchmark doesn't do I/O.\n");
     exit(1);
   }
+
+  static uint64_t passByStream(uint64_t iters) {
+    fprintf(stderr, "Null benchmark doesn't do I/O.\n");
+    exit(1);
+  }
+
+  static uint64_t passByUringPipe(uint64_t iters) {
+    fprintf(stderr, "Null benchmark doesn't do I/O.\n");
+    exit(1);
+  }
 };
 
 struct BenchmarkTypes {
@@ -166,6 +176,7 @@ struct BenchmarkTypes {
 
   typedef ReusableObjects ReusableResources;
   typedef SingleUseObjects SingleUseResources;
+  typedef SingleUseObjects AdaptiveResources;  // Nothing to adapt.
 
   template <typename TestCase, typename ReuseStrategy, typename Compression>
   struct BenchmarkMethods: public null::BenchmarkMethods<TestCase, ReuseStrategy, Compression> {};
@@ -0,0 +1,128 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Measures iteration over a list of structs whose text fields are scattered across a message much
+// larger than the last-level cache, as with a big mmap()ed dataset, with and without
+// List<T>::Reader::prefetching().
+
+#include "catrank.capnp.h"
+#include "common.h"
+#include <capnproto/message.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+namespace capnproto {
+namespace benchmark {
+namespace capnp {
+
+template <typename Results>
+uint64_t readAll(Results&& results) {
+  // Touches the first byte of each text so that every reference is actually followed.
+  uint64_t total = 0;
+  for (SearchResult::Reader result: results) {
+    Text::Reader url = result.getUrl();
+    Text::Reader snippet = result.getSnippet();
+    total += url.size() + url[0] + snippet[0] + (result.getScore() > 0);
+  }
+  return total;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "USAGE:  %s RESULT_COUNT PASS_COUNT\n"
+        "Each result takes about 80 bytes; pick RESULT_COUNT so the message is several times the\n"
+        "size of the last-level cache.\n", argv[0]);
+    return 1;
+  }
+
+  uint resultCount = strtoul(argv[1], nullptr, 0);
+  uint64_t passes = strtoull(argv[2], nullptr, 0);
+
+  MallocMessageBuilder message;
+  {
+    auto list = message.initRoot<SearchResultList>().initResults(resultCount);
+
+    // Fill the results in random order so that each one's text lands far from its neighbors',
+    // and following the references is not a sequential scan.
+    std::vector<uint> order(resultCount);
+    for (uint i = 0; i < resultCount; i++) {
+      order[i] = i;
+    }
+    for (uint i = resultCount; i > 1; i--) {
+      std::swap(order[i - 1], order[fastRand(i)]);
+    }
+    for (uint i: order) {
+      SearchResult::Builder result = list[i];
+      result.setScore(i);
+      result.setUrl("http://example.com/");
+      result.setSnippet(WORDS[i % WORDS_COUNT]);
+    }
+  }
+
+  ArrayPtr<const ArrayPtr<const word>> segments = message.getSegmentsForOutput();
+  uint64_t messageBytes = 0;
+  for (auto segment: segments) {
+    messageBytes += segment.size() * sizeof(word);
+  }
+
+  // Reading the same message over and over would otherwise run into the traversal limit.
+  ReaderOptions options;
+  options.traversalLimitInWords = ~uint64_t(0) >> 1;
+  SegmentArrayMessageReader reader(segments, options);
+  auto results = reader.getRoot<SearchResultList>().getResults();
+
+  std::cout << "message MB:     " << messageBytes / 1000000 << std::endl;
+  std::cout << std::setw(20) << std::left << "mode"
+            << std::setw(15) << std::right << "ns per result" << std::endl;
+
+  uint64_t expected = readAll(results);
+  for (int distance: { -1, 1, 4, 8, 16, 32, 64 }) {
+    uint64_t start = currentRealNanos();
+    for (uint64_t i = 0; i < passes; i++) {
+      uint64_t total = distance < 0 ? readAll(results) : readAll(results.prefetching(distance));
+      if (total != expected) {
+        fprintf(stderr, "Prefetching changed the result?\n");
+        return 1;
+      }
+    }
+    uint64_t time = currentRealNanos() - start;
+
+    std::string name = distance < 0 ? "plain" : "prefetching(" + std::to_string(distance) + ")";
+    std::cout << std::setw(20) << std::left << name
+              << std::setw(15) << std::right << std::fixed << std::setprecision(2)
+              << double(time) / (passes * resultCount) << std::endl;
+  }
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnproto
+
+int main(int argc, char* argv[]) {
+  return capnproto::benchmark::capnp::main(argc, argv);
+}
@@ -339,6 +339,41 @@ struct BenchmarkMethods {
 
     return throughput;
   }
+
+  static uint64_t passByStream(uint64_t iters) {
+    // Server side of a stream of requests:  parse and handle `iters` messages, cycling through a
+    // batch serialized up front.  Compression is ignored; see passByBytes().
+    static constexpr uint BATCH_SIZE = 64;
+
+    std::string batch[BATCH_SIZE];
+    uint64_t batchBytes = 0;
+    for (auto& bytes: batch) {
+      typename TestCase::Request request;
+      TestCase::setupRequest(&request);
+      request.SerializePartialToString(&bytes);
+      batchBytes += bytes.size();
+    }
+
+    REUSABLE(Request) reusableRequest;
+    REUSABLE(Response) reusableResponse;
+
+    for (uint64_t i = 0; i < iters; i++) {
+      SINGLE_USE(Request) request(reusableRequest);
+      request.ParsePartialFromString(batch[i % BATCH_SIZE]);
+
+      SINGLE_USE(Response) response(reusableResponse);
+      TestCase::handleRequest(request, &response);
+      ReuseStrategy::doneWith(request);
+      ReuseStrategy::doneWith(response);
+    }
+
+    return batchBytes * iters / BATCH_SIZE;
+  }
+
+  static uint64_t passByUringPipe(uint64_t iters) {
+    fprintf(stderr, "The io_uring pipe mode is only implemented for Cap'n Proto.\n");
+    exit(1);
+  }
 };
 
 struct BenchmarkTypes {
@@ -350,6 +385,7 @@ struct BenchmarkTypes {
 
   typedef protobuf::ReusableMessages ReusableResources;
   typedef protobuf::SingleUseMessages SingleUseResources;
+  typedef protobuf::SingleUseMessages AdaptiveResources;  // Nothing to adapt.
 
   template <typename TestCase, typename ReuseStrategy, typename Compression>
   struct BenchmarkMethods
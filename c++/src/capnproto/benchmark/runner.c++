@@ -113,7 +113,9 @@ enum class Mode {
   OBJECT_SIZE,
   BYTES,
   PIPE_SYNC,
-  PIPE_ASYNC
+  PIPE_ASYNC,
+  PIPE_URING,
+  STREAM
 };
 
 enum class Reuse {
@@ -164,6 +166,12 @@ TestResult runTest(Product product, TestCase testCase, Mode mode, Reuse reuse,
     case Mode::PIPE_ASYNC:
       argv[1] = strdup("pipe-async");
       break;
+    case Mode::PIPE_URING:
+      argv[1] = strdup("pipe-uring");
+      break;
+    case Mode::STREAM:
+      argv[1] = strdup("stream");
+      break;
   }
 
   switch (reuse) {
@@ -365,6 +373,10 @@ int main(int argc, char* argv[]) {
       mode = Mode::PIPE_ASYNC;
     } else if (arg == "inmem") {
       mode = Mode::BYTES;
+    } else if (arg == "uring") {
+      mode = Mode::PIPE_URING;
+    } else if (arg == "stream") {
+      mode = Mode::STREAM;
     } else if (arg == "eval") {
       testCase = TestCase::EVAL;
     } else if (arg == "carsales") {
@@ -424,6 +436,16 @@ int main(int argc, char* argv[]) {
       cout << "  * with client and server in separate processes" << endl;
       cout << "  * client sends as many simultaneous requests as it can" << endl;
       break;
+    case Mode::PIPE_URING:
+      cout << "* pipe I/O through io_uring, double-buffered" << endl;
+      cout << "  * with client and server in separate processes" << endl;
+      cout << "  * client sends as many simultaneous requests as it can" << endl;
+      cout << "  * server batches responses until it runs out of requests" << endl;
+      break;
+    case Mode::STREAM:
+      cout << "* in-memory stream of requests" << endl;
+      cout << "  * server side only, measuring per-message overhead" << endl;
+      break;
   }
   switch (compression) {
     case Compression::NONE:
@@ -442,6 +464,54 @@ int main(int argc, char* argv[]) {
 
   reportTableHeader();
 
+  if (mode == Mode::STREAM) {
+    // Small messages show the fixed cost of starting to read each message, which is what reusing
+    // a reader with reset() avoids.  Try with "eval".
+    TestResult protobufNoReuse = runTest(
+        Product::PROTOBUF, testCase, mode, Reuse::NO, compression, iters);
+    reportResults("Protobuf new message per request", iters, protobufNoReuse);
+    TestResult protobufReuse = runTest(
+        Product::PROTOBUF, testCase, mode, Reuse::YES, compression, iters);
+    reportResults("Protobuf reused message", iters, protobufReuse);
+
+    TestResult capnpNoReuse = runTest(
+        Product::CAPNPROTO, testCase, mode, Reuse::NO, compression, iters);
+    reportResults("Cap'n Proto new reader per message", iters, capnpNoReuse);
+    TestResult capnpReuse = runTest(
+        Product::CAPNPROTO, testCase, mode, Reuse::YES, compression, iters);
+    reportResults("Cap'n Proto reset() reader", iters, capnpReuse);
+    TestResult capnpPackedNoReuse = runTest(
+        Product::CAPNPROTO, testCase, mode, Reuse::NO, Compression::PACKED, iters);
+    reportResults("Cap'n Proto packed, new reader", iters, capnpPackedNoReuse);
+    TestResult capnpPackedReuse = runTest(
+        Product::CAPNPROTO, testCase, mode, Reuse::YES, Compression::PACKED, iters);
+    reportResults("Cap'n Proto packed, reset() reader", iters, capnpPackedReuse);
+
+    return 0;
+  }
+
+  if (mode == Mode::PIPE_URING) {
+    // Compare against the plain pipe modes.  Try with "eval", whose messages are small enough that
+    // system calls dominate.
+    TestResult capnpSync = runTest(
+        Product::CAPNPROTO, testCase, Mode::PIPE_SYNC, Reuse::YES, compression, iters);
+    reportResults("Cap'n Proto pipe, sync client", iters, capnpSync);
+    TestResult capnpAsync = runTest(
+        Product::CAPNPROTO, testCase, Mode::PIPE_ASYNC, Reuse::YES, compression, iters);
+    reportResults("Cap'n Proto pipe, async client", iters, capnpAsync);
+    TestResult capnpUring = runTest(
+        Product::CAPNPROTO, testCase, mode, Reuse::YES, compression, iters);
+    reportResults("Cap'n Proto io_uring", iters, capnpUring);
+    TestResult capnpPackedAsync = runTest(
+        Product::CAPNPROTO, testCase, Mode::PIPE_ASYNC, Reuse::YES, Compression::PACKED, iters);
+    reportResults("Cap'n Proto packed pipe, async", iters, capnpPackedAsync);
+    TestResult capnpPackedUring = runTest(
+        Product::CAPNPROTO, testCase, mode, Reuse::YES, Compression::PACKED, iters);
+    reportResults("Cap'n Proto packed io_uring", iters, capnpPackedUring);
+
+    return 0;
+  }
+
   TestResult nullCase = runTest(
       Product::NULLCASE, testCase, Mode::OBJECT_SIZE, Reuse::YES, compression, iters);
   reportResults("Theoretical best pass-by-object", iters, nullCase);
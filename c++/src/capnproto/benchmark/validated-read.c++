@@ -0,0 +1,135 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Measures getter throughput on a message that is read over and over, as with a cached or mmap()ed
+// message, with and without MessageReader::validate().
+
+#include "catrank.capnp.h"
+#include "common.h"
+#include <capnproto/message.h>
+#include <capnproto/serialize.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+namespace capnproto {
+namespace benchmark {
+namespace capnp {
+
+enum class Checking {
+  CHECKED,
+  VALIDATED,
+  ASSUMED_VALID
+};
+
+uint64_t readAll(FlatArrayMessageReader& reader, uint64_t passes) {
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < passes; i++) {
+    for (SearchResult::Reader result: reader.getRoot<SearchResultList>().getResults()) {
+      total += result.getUrl().size() + result.getSnippet().size() + (result.getScore() > 0);
+    }
+  }
+  return total;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "USAGE:  %s RESULT_COUNT SEGMENT_WORDS PASS_COUNT\n", argv[0]);
+    return 1;
+  }
+
+  uint resultCount = strtoul(argv[1], nullptr, 0);
+  uint segmentWords = strtoul(argv[2], nullptr, 0);
+  uint64_t passes = strtoull(argv[3], nullptr, 0);
+
+  Array<word> flat;
+  uint segmentCount;
+  {
+    MallocMessageBuilder message(segmentWords, AllocationStrategy::FIXED_SIZE);
+    auto list = message.initRoot<SearchResultList>().initResults(resultCount);
+    for (uint i = 0; i < resultCount; i++) {
+      SearchResult::Builder result = list[i];
+      result.setScore(i);
+      result.setUrl("http://example.com/");
+      result.setSnippet(WORDS[i % WORDS_COUNT]);
+    }
+    segmentCount = message.getSegmentsForOutput().size();
+    flat = messageToFlatArray(message);
+  }
+
+  // Reading the same message over and over would otherwise run into the traversal limit.
+  ReaderOptions options;
+  options.traversalLimitInWords = ~uint64_t(0) >> 1;
+
+  std::cout << "segments:       " << segmentCount << std::endl;
+  std::cout << std::setw(20) << std::left << "mode"
+            << std::setw(15) << std::right << "setup ns"
+            << std::setw(15) << std::right << "ns per field" << std::endl;
+
+  const char* names[] = { "checked", "validate()", "assumeValid()" };
+  for (Checking checking: { Checking::CHECKED, Checking::VALIDATED, Checking::ASSUMED_VALID }) {
+    FlatArrayMessageReader reader(flat.asPtr(), options);
+
+    uint64_t start = currentRealNanos();
+    switch (checking) {
+      case Checking::CHECKED:
+        break;
+      case Checking::VALIDATED:
+        if (!reader.validate()) {
+          fprintf(stderr, "Message failed validation?\n");
+          return 1;
+        }
+        break;
+      case Checking::ASSUMED_VALID:
+        reader.assumeValid();
+        break;
+    }
+    uint64_t setupTime = currentRealNanos() - start;
+
+    start = currentRealNanos();
+    uint64_t total = readAll(reader, passes);
+    uint64_t time = currentRealNanos() - start;
+
+    if (total == 0) {
+      fprintf(stderr, "Message was empty?\n");
+      return 1;
+    }
+
+    // Three fields per result, plus getting the result itself.
+    uint64_t fieldsRead = passes * resultCount * 4;
+    std::cout << std::setw(20) << std::left << names[static_cast<int>(checking)]
+              << std::setw(15) << std::right << setupTime
+              << std::setw(15) << std::right << std::fixed << std::setprecision(2)
+              << double(time) / fieldsRead << std::endl;
+  }
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnproto
+
+int main(int argc, char* argv[]) {
+  return capnproto::benchmark::capnp::main(argc, argv);
+}
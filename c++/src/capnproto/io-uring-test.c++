@@ -0,0 +1,211 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "io-uring.h"
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace capnproto {
+namespace {
+
+inline uint8_t patternByte(size_t i) {
+  return i * 7 + i / 251;
+}
+
+void writePattern(UringOutputStream& output, size_t size) {
+  // Writes `size` bytes in a mix of small copies, copies that straddle the two halves, writes
+  // bigger than half the buffer, and writes straight into getWriteBuffer().
+  static const size_t CHUNKS[] = { 1, 7, 4096, 70000, 13, 30000, 200000, 0 };
+
+  uint8_t scratch[200000];
+  size_t pos = 0;
+  uint step = 0;
+  while (pos < size) {
+    size_t n = std::min(CHUNKS[step++ % (sizeof(CHUNKS) / sizeof(CHUNKS[0]))], size - pos);
+    if (n == 0) {
+      ArrayPtr<byte> buffer = output.getWriteBuffer();
+      n = std::min(buffer.size(), size - pos);
+      uint8_t* bytes = reinterpret_cast<uint8_t*>(buffer.begin());
+      for (size_t i = 0; i < n; i++) {
+        bytes[i] = patternByte(pos + i);
+      }
+      output.write(bytes, n);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        scratch[i] = patternByte(pos + i);
+      }
+      output.write(scratch, n);
+    }
+    pos += n;
+  }
+}
+
+void expectPattern(UringInputStream& input, size_t size) {
+  uint8_t scratch[50000];
+  size_t pos = 0;
+  uint step = 0;
+  while (pos < size) {
+    switch (step++ % 3) {
+      case 0: {
+        size_t n = input.read(scratch, std::min<size_t>(5, size - pos), sizeof(scratch));
+        n = std::min(n, size - pos);
+        for (size_t i = 0; i < n; i++) {
+          ASSERT_EQ(patternByte(pos + i), scratch[i]) << "at " << (pos + i);
+        }
+        pos += n;
+        break;
+      }
+      case 1: {
+        size_t n = std::min<size_t>(3000, size - pos);
+        input.skip(n);
+        pos += n;
+        break;
+      }
+      case 2: {
+        ArrayPtr<const byte> buffer = input.getReadBuffer();
+        size_t n = std::min(buffer.size(), size - pos);
+        ASSERT_GT(n, 0u);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(buffer.begin());
+        for (size_t i = 0; i < n; i++) {
+          ASSERT_EQ(patternByte(pos + i), bytes[i]) << "at " << (pos + i);
+        }
+        input.skip(n);
+        pos += n;
+        break;
+      }
+    }
+  }
+}
+
+TEST(UringStreams, Pipe) {
+  const size_t SIZE = 3 << 20;
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+
+  pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    close(fds[0]);
+    {
+      UringOutputStream output(fds[1]);
+      writePattern(output, SIZE);
+    }
+    close(fds[1]);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  {
+    UringInputStream input(fds[0]);
+    expectPattern(input, SIZE);
+
+    EXPECT_EQ(0u, input.getReadBuffer().size());
+    EXPECT_TRUE(input.isDataReady());
+    char c;
+    EXPECT_ANY_THROW(input.read(&c, 1, 1));
+  }
+  close(fds[0]);
+
+  int status;
+  ASSERT_EQ(child, waitpid(child, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+TEST(UringStreams, SmallBuffers) {
+  // Fits in the pipe's own buffer, so no second process is needed.
+  const size_t SIZE = 40000;
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+
+  word outputBuffer[8];
+  word inputBuffer[4];
+  {
+    UringOutputStream output(
+        fds[1], arrayPtr(reinterpret_cast<byte*>(outputBuffer), sizeof(outputBuffer)));
+    writePattern(output, SIZE);
+  }
+  close(fds[1]);
+
+  {
+    UringInputStream input(
+        fds[0], arrayPtr(reinterpret_cast<byte*>(inputBuffer), sizeof(inputBuffer)));
+    expectPattern(input, SIZE);
+    EXPECT_EQ(0u, input.getReadBuffer().size());
+  }
+  close(fds[0]);
+}
+
+TEST(UringStreams, IsDataReady) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+
+  {
+    UringInputStream input(fds[0]);
+    EXPECT_FALSE(input.isDataReady());
+
+    ASSERT_EQ(3, ::write(fds[1], "foo", 3));
+
+    if (input.isUsingUring()) {
+      // The completion shows up asynchronously.
+      for (uint i = 0; i < 1000 && !input.isDataReady(); i++) {
+        usleep(1000);
+      }
+      EXPECT_TRUE(input.isDataReady());
+    }
+
+    ArrayPtr<const byte> buffer = input.getReadBuffer();
+    ASSERT_EQ(3u, buffer.size());
+    EXPECT_EQ('f', *reinterpret_cast<const char*>(buffer.begin()));
+    input.skip(3);
+    EXPECT_FALSE(input.isDataReady());
+
+    // Destroyed with a read still pending on an idle pipe; must not hang.
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(UringStreams, FlushOnDestruction) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+
+  {
+    UringOutputStream output(fds[1]);
+    output.write("bar", 3);
+  }
+
+  char buffer[4];
+  ASSERT_EQ(3, ::read(fds[0], buffer, sizeof(buffer)));
+  EXPECT_EQ(0, memcmp(buffer, "bar", 3));
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+}  // namespace
+}  // namespace capnproto
@@ -0,0 +1,558 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "io-uring.h"
+#include <algorithm>
+#include <exception>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#if __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace capnproto {
+namespace internal {
+
+#if __linux__ && defined(__NR_io_uring_setup)
+
+IoUring::IoUring(uint entries)
+    : fd(-1), entries(entries), sqRing(nullptr), sqRingSize(0), cqRing(nullptr), cqRingSize(0),
+      sqes(nullptr), sqesSize(0) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int result = syscall(__NR_io_uring_setup, entries, &params);
+  if (result < 0) {
+    // ENOSYS, EPERM, etc.  The caller falls back to plain system calls.
+    return;
+  }
+  fd = result;
+
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    // Before Linux 5.6 there was no IORING_OP_READ/WRITE, and no way to use the current file
+    // position.  Not worth supporting.
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  this->entries = params.sq_entries;
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  bool singleMapping = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMapping) {
+    sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+  }
+
+  void* mapping = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+  if (mapping != MAP_FAILED) {
+    sqRing = mapping;
+    if (singleMapping) {
+      cqRing = sqRing;
+    } else {
+      mapping = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_CQ_RING);
+      cqRing = mapping == MAP_FAILED ? nullptr : mapping;
+    }
+  }
+  if (cqRing != nullptr) {
+    mapping = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    sqes = mapping == MAP_FAILED ? nullptr : mapping;
+  }
+
+  if (sqes == nullptr) {
+    // Out of address space?  Fall back.
+    release();
+    return;
+  }
+
+  byte* sq = reinterpret_cast<byte*>(sqRing);
+  sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+  sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+  sqMask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+  sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+
+  byte* cq = reinterpret_cast<byte*>(cqRing);
+  cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+  cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+  cqMask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+  cqes = cq + params.cq_off.cqes;
+}
+
+IoUring::~IoUring() {
+  release();
+}
+
+void IoUring::release() {
+  if (sqes != nullptr) {
+    munmap(sqes, sqesSize);
+    sqes = nullptr;
+  }
+  if (cqRing != nullptr && cqRing != sqRing) {
+    munmap(cqRing, cqRingSize);
+  }
+  cqRing = nullptr;
+  if (sqRing != nullptr) {
+    munmap(sqRing, sqRingSize);
+    sqRing = nullptr;
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+bool IoUring::registerBuffer(ArrayPtr<byte> buffer) {
+  struct iovec iov;
+  iov.iov_base = buffer.begin();
+  iov.iov_len = buffer.size();
+  return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+}
+
+void IoUring::prepare(
+    Op op, int fd, const void* address, size_t size, uint64_t userData, bool fixed) {
+  // Only this thread writes the tail; the kernel writes the head.
+  uint32_t tail = *sqTail;
+  CAPNPROTO_ASSERT(tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) < entries,
+      "io_uring submission queue is full.");
+
+  uint32_t index = tail & sqMask;
+  struct io_uring_sqe* sqe = reinterpret_cast<struct io_uring_sqe*>(sqes) + index;
+  memset(sqe, 0, sizeof(*sqe));
+
+  switch (op) {
+    case Op::READ:
+      sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      break;
+    case Op::WRITE:
+      sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+      break;
+    case Op::CANCEL:
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      break;
+  }
+
+  if (op == Op::CANCEL) {
+    sqe->fd = -1;
+    sqe->addr = size;
+  } else {
+    CAPNPROTO_ASSERT(size <= 0x7fffffffu, "io_uring transfer too big.");
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(address);
+    sqe->len = size;
+    // -1 means "at the current file position", which is also right for pipes and sockets.
+    sqe->off = ~uint64_t(0);
+    sqe->buf_index = 0;
+  }
+  sqe->user_data = userData;
+
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void IoUring::enter(uint minComplete) {
+  for (;;) {
+    uint32_t toSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (toSubmit == 0 && minComplete == 0) {
+      return;
+    }
+
+    int result = syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+                         minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (result >= 0) {
+      return;
+    }
+
+    int error = errno;
+    if (error != EINTR && error != EAGAIN) {
+      throwOsException("io_uring_enter", error);
+    }
+  }
+}
+
+void IoUring::submit() {
+  enter(0);
+}
+
+void IoUring::wait(uint64_t& userData, int32_t& result) {
+  for (;;) {
+    bool unsubmitted = *sqTail != __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (!unsubmitted && poll(userData, result)) {
+      return;
+    }
+    // Submits and waits in one call.  Returns right away if a completion is already waiting.
+    enter(1);
+  }
+}
+
+bool IoUring::poll(uint64_t& userData, int32_t& result) {
+  // Only this thread writes the head; the kernel writes the tail.
+  uint32_t head = *cqHead;
+  if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  const struct io_uring_cqe* cqe =
+      reinterpret_cast<const struct io_uring_cqe*>(cqes) + (head & cqMask);
+  userData = cqe->user_data;
+  result = cqe->res;
+  __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+#else  // __linux__ && defined(__NR_io_uring_setup)
+
+IoUring::IoUring(uint entries)
+    : fd(-1), entries(entries), sqRing(nullptr), sqRingSize(0), cqRing(nullptr), cqRingSize(0),
+      sqes(nullptr), sqesSize(0) {}
+IoUring::~IoUring() {}
+
+void IoUring::release() {}
+bool IoUring::registerBuffer(ArrayPtr<byte>) { return false; }
+void IoUring::prepare(Op, int, const void*, size_t, uint64_t, bool) {
+  CAPNPROTO_ASSERT(false, "io_uring not available.");
+}
+void IoUring::enter(uint) {}
+void IoUring::submit() {}
+void IoUring::wait(uint64_t&, int32_t&) {
+  CAPNPROTO_ASSERT(false, "io_uring not available.");
+}
+bool IoUring::poll(uint64_t&, int32_t&) { return false; }
+
+#endif  // __linux__ && defined(__NR_io_uring_setup), #else
+
+}  // namespace internal
+
+// =======================================================================================
+
+namespace {
+
+constexpr size_t DEFAULT_BUFFER_SIZE = 128 * 1024;
+constexpr uint RING_ENTRIES = 4;
+
+constexpr uint64_t READ_ID = 1;
+constexpr uint64_t WRITE_ID = 2;
+constexpr uint64_t CANCEL_ID = 3;
+
+}  // namespace
+
+UringInputStream::UringInputStream(int fd, ArrayPtr<byte> buffer)
+    : fd(fd), ring(RING_ENTRIES), fixed(false),
+      ownedBuffer(buffer == nullptr ? newArray<byte>(DEFAULT_BUFFER_SIZE) : nullptr),
+      active(1), readInFlight(false), readCompleted(false), readResult(0), eof(false) {
+  ArrayPtr<byte> all = buffer == nullptr ? ownedBuffer : buffer;
+  halves[0] = all.slice(0, all.size() / 2);
+  halves[1] = all.slice(all.size() / 2, all.size());
+
+  if (ring.isAvailable()) {
+    fixed = ring.registerBuffer(all);
+    startRead(0);
+  }
+}
+
+UringInputStream::~UringInputStream() {
+  if (readInFlight && !readCompleted) {
+    // The kernel must be done with the buffer before it's freed.  On a pipe or socket the read
+    // may never complete by itself, so cancel it.
+    try {
+      ring.prepare(internal::IoUring::Op::CANCEL, -1, nullptr, READ_ID, CANCEL_ID, false);
+      for (;;) {
+        uint64_t id;
+        int32_t result;
+        ring.wait(id, result);
+        if (id == READ_ID) {
+          break;
+        }
+      }
+    } catch (...) {
+      // TODO:  Report secondary faults.
+    }
+  }
+}
+
+void UringInputStream::startRead(uint half) {
+  ring.prepare(internal::IoUring::Op::READ, fd, halves[half].begin(), halves[half].size(),
+               READ_ID, fixed);
+  ring.submit();
+  readInFlight = true;
+  readCompleted = false;
+}
+
+bool UringInputStream::isDataReady() {
+  if (available.size() > 0 || eof || readCompleted) {
+    return true;
+  }
+  if (!ring.isAvailable() || !readInFlight) {
+    return false;
+  }
+
+  uint64_t id;
+  int32_t result;
+  while (ring.poll(id, result)) {
+    if (id == READ_ID) {
+      readCompleted = true;
+      readResult = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+void UringInputStream::refill() {
+  if (eof) {
+    return;
+  }
+
+  uint next = 1 - active;
+  ssize_t n;
+
+  if (ring.isAvailable()) {
+    for (;;) {
+      while (!readCompleted) {
+        uint64_t id;
+        int32_t result;
+        ring.wait(id, result);
+        if (id == READ_ID) {
+          readCompleted = true;
+          readResult = result;
+        }
+      }
+      readInFlight = false;
+
+      n = readResult;
+      if (n == -EINTR || n == -EAGAIN) {
+        startRead(next);
+        continue;
+      } else if (n < 0) {
+        internal::throwOsException("read", -n);
+      }
+      break;
+    }
+  } else {
+    for (;;) {
+      n = ::read(fd, halves[next].begin(), halves[next].size());
+      if (n >= 0) {
+        break;
+      }
+      int error = errno;
+      if (error != EINTR) {
+        internal::throwOsException("read", error);
+      }
+    }
+  }
+
+  if (n == 0) {
+    eof = true;
+    return;
+  }
+
+  active = next;
+  available = halves[active].slice(0, n);
+
+  if (ring.isAvailable()) {
+    // Read ahead into the half that was just used up.
+    startRead(1 - active);
+  }
+}
+
+ArrayPtr<const byte> UringInputStream::getReadBuffer() {
+  if (available.size() == 0) {
+    refill();
+  }
+  return available;
+}
+
+size_t UringInputStream::read(void* buffer, size_t minBytes, size_t maxBytes) {
+  byte* dst = reinterpret_cast<byte*>(buffer);
+  size_t total = 0;
+
+  while (total < minBytes) {
+    if (available.size() == 0) {
+      refill();
+      if (available.size() == 0) {
+        internal::throwPrematureEof();
+      }
+    }
+
+    size_t n = std::min(available.size(), maxBytes - total);
+    memcpy(dst + total, available.begin(), n);
+    available = available.slice(n, available.size());
+    total += n;
+  }
+
+  return total;
+}
+
+void UringInputStream::skip(size_t bytes) {
+  while (bytes > 0) {
+    if (available.size() == 0) {
+      refill();
+      if (available.size() == 0) {
+        internal::throwPrematureEof();
+      }
+    }
+
+    size_t n = std::min(available.size(), bytes);
+    available = available.slice(n, available.size());
+    bytes -= n;
+  }
+}
+
+// -------------------------------------------------------------------
+
+UringOutputStream::UringOutputStream(int fd, ArrayPtr<byte> buffer)
+    : fd(fd), ring(RING_ENTRIES), fixed(false),
+      ownedBuffer(buffer == nullptr ? newArray<byte>(DEFAULT_BUFFER_SIZE) : nullptr),
+      active(0), inFlightPos(nullptr), inFlightSize(0) {
+  ArrayPtr<byte> all = buffer == nullptr ? ownedBuffer : buffer;
+  halves[0] = all.slice(0, all.size() / 2);
+  halves[1] = all.slice(all.size() / 2, all.size());
+  fillPos = halves[0].begin();
+
+  if (ring.isAvailable()) {
+    fixed = ring.registerBuffer(all);
+  }
+}
+
+UringOutputStream::~UringOutputStream() {
+  if (fillPos > halves[active].begin() || inFlightSize > 0) {
+    if (std::uncaught_exception()) {
+      try {
+        flush();
+      } catch (...) {
+        // TODO:  Report secondary faults.
+      }
+    } else {
+      flush();
+    }
+  }
+}
+
+void UringOutputStream::flush() {
+  submitActive();
+  finishWrite();
+}
+
+ArrayPtr<byte> UringOutputStream::getWriteBuffer() {
+  return arrayPtr(fillPos, halves[active].end());
+}
+
+void UringOutputStream::write(const void* src, size_t size) {
+  ArrayPtr<byte> half = halves[active];
+
+  if (src == fillPos) {
+    // The caller wrote directly into our buffer.
+    CAPNPROTO_ASSERT(size <= size_t(half.end() - fillPos), "Wrote past end of write buffer.");
+    fillPos += size;
+  } else {
+    size_t space = half.end() - fillPos;
+
+    if (size <= space) {
+      memcpy(fillPos, src, size);
+      fillPos += size;
+    } else if (size <= half.size()) {
+      // Top off this half, send it, and put the rest in the other half.
+      memcpy(fillPos, src, space);
+      fillPos += space;
+      submitActive();
+
+      size -= space;
+      memcpy(fillPos, reinterpret_cast<const byte*>(src) + space, size);
+      fillPos += size;
+    } else {
+      // Too big to be worth copying.  Write it directly, after everything before it.
+      flush();
+      FdOutputStream(fd).write(src, size);
+      return;
+    }
+  }
+
+  if (fillPos == halves[active].end()) {
+    submitActive();
+  }
+}
+
+void UringOutputStream::submitActive() {
+  byte* begin = halves[active].begin();
+  if (fillPos == begin) {
+    return;
+  }
+
+  // The other half must be free before we switch to it.
+  finishWrite();
+
+  if (ring.isAvailable()) {
+    startWrite(begin, fillPos - begin);
+  } else {
+    FdOutputStream(fd).write(begin, fillPos - begin);
+  }
+
+  active = 1 - active;
+  fillPos = halves[active].begin();
+}
+
+void UringOutputStream::startWrite(const byte* pos, size_t size) {
+  ring.prepare(internal::IoUring::Op::WRITE, fd, pos, size, WRITE_ID, fixed);
+  ring.submit();
+  inFlightPos = pos;
+  inFlightSize = size;
+}
+
+void UringOutputStream::finishWrite() {
+  while (inFlightSize > 0) {
+    uint64_t id;
+    int32_t result;
+    ring.wait(id, result);
+    if (id != WRITE_ID) {
+      continue;
+    }
+
+    if (result < 0) {
+      if (result == -EINTR || result == -EAGAIN) {
+        startWrite(inFlightPos, inFlightSize);
+        continue;
+      }
+      inFlightSize = 0;
+      internal::throwOsException("write", -result);
+    }
+
+    CAPNPROTO_ASSERT(result > 0, "write() returned zero.");
+    if (size_t(result) < inFlightSize) {
+      // Partial write.  Send the rest.
+      startWrite(inFlightPos + result, inFlightSize - result);
+    } else {
+      inFlightSize = 0;
+    }
+  }
+}
+
+}  // namespace capnproto
@@ -0,0 +1,193 @@
+// Copyright (c) 2013, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Streams that do their I/O through Linux's io_uring interface.  Each stream double-buffers:
+// while the application works on one half of its buffer, the kernel fills (or drains) the other
+// half, so I/O overlaps with processing and each system call both submits the next transfer and
+// reaps the previous one.  The buffer is registered with the kernel when possible so that it
+// doesn't have to be mapped for every transfer.
+//
+// If io_uring is unavailable (old kernel, or disabled by policy or seccomp), the streams fall back
+// to plain read() and write() on the same buffers, behaving like BufferedInputStreamWrapper and
+// BufferedOutputStreamWrapper around FdInputStream and FdOutputStream.
+
+#ifndef CAPNPROTO_IO_URING_H_
+#define CAPNPROTO_IO_URING_H_
+
+#include "io.h"
+#include <inttypes.h>
+
+namespace capnproto {
+
+namespace internal {
+
+class IoUring {
+  // A minimal io_uring submission/completion queue pair, set up with raw system calls.
+
+public:
+  explicit IoUring(uint entries);
+  // If the kernel refuses, isAvailable() returns false and nothing else may be called.
+
+  CAPNPROTO_DISALLOW_COPY(IoUring);
+  ~IoUring();
+
+  inline bool isAvailable() const { return fd >= 0; }
+
+  bool registerBuffer(ArrayPtr<byte> buffer);
+  // Registers `buffer` as fixed buffer 0.  Returns false if the kernel refuses, e.g. because it
+  // would exceed RLIMIT_MEMLOCK.
+
+  enum class Op { READ, WRITE, CANCEL };
+
+  void prepare(Op op, int fd, const void* address, size_t size, uint64_t userData, bool fixed);
+  // Queue an operation.  If `fixed`, the address must be within the registered buffer.  For
+  // CANCEL, `address` is ignored and `size` is the userData of the operation to cancel.  The
+  // queue has room for `entries` operations not yet submitted.
+
+  void submit();
+  // Submit all queued operations without waiting.
+
+  void wait(uint64_t& userData, int32_t& result);
+  // Submit all queued operations, then wait for a completion.  `result` is what the system call
+  // would have returned, or minus the errno.
+
+  bool poll(uint64_t& userData, int32_t& result);
+  // Like wait(), but returns false instead of waiting if no completion is ready.
+
+private:
+  int fd;
+  uint entries;
+
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  void* sqes;
+  size_t sqesSize;
+
+  uint32_t* sqHead;
+  uint32_t* sqTail;
+  uint32_t sqMask;
+  uint32_t* sqArray;
+  uint32_t* cqHead;
+  uint32_t* cqTail;
+  uint32_t cqMask;
+  void* cqes;
+
+  void release();
+  void enter(uint minComplete);
+};
+
+}  // namespace internal
+
+class UringInputStream: public BufferedInputStream {
+  // A BufferedInputStream that always has a read in flight into the half of its buffer not being
+  // consumed.  Like BufferedInputStreamWrapper, it reads ahead, so the descriptor's position is
+  // unpredictable once the stream is destroyed unless all input was consumed.
+
+public:
+  explicit UringInputStream(int fd, ArrayPtr<byte> buffer = nullptr);
+  // Does not take ownership of the descriptor.  If `buffer` is non-null it is used (and
+  // registered) instead of allocating 128 KiB.
+
+  CAPNPROTO_DISALLOW_COPY(UringInputStream);
+  ~UringInputStream();
+  // Cancels the read in flight, if any.
+
+  inline bool isUsingUring() const { return ring.isAvailable(); }
+
+  bool isDataReady();
+  // Returns true if getReadBuffer() would return without blocking.  A server can flush its
+  // output when this returns false, rather than after every reply.
+
+  // implements BufferedInputStream ----------------------------------
+  ArrayPtr<const byte> getReadBuffer() override;
+  size_t read(void* buffer, size_t minBytes, size_t maxBytes) override;
+  void skip(size_t bytes) override;
+
+private:
+  int fd;
+  internal::IoUring ring;
+  bool fixed;
+  Array<byte> ownedBuffer;
+  ArrayPtr<byte> halves[2];
+  uint active;
+  ArrayPtr<byte> available;
+  // Unconsumed part of halves[active].
+
+  bool readInFlight;
+  bool readCompleted;
+  int32_t readResult;
+  // The read into halves[1 - active], once reaped by isDataReady().
+
+  bool eof;
+
+  void startRead(uint half);
+  void refill();
+};
+
+class UringOutputStream: public BufferedOutputStream {
+  // A BufferedOutputStream that hands each full half of its buffer to the kernel and carries on
+  // filling the other half.  Writing messages to it with writeMessage() batches them:  they only
+  // go out a half-buffer at a time, or when flush() is called.  A producer that goes idle, or
+  // that is about to wait for a reply, must call flush().
+
+public:
+  explicit UringOutputStream(int fd, ArrayPtr<byte> buffer = nullptr);
+  // Does not take ownership of the descriptor.  If `buffer` is non-null it is used (and
+  // registered) instead of allocating 128 KiB.
+
+  CAPNPROTO_DISALLOW_COPY(UringOutputStream);
+  ~UringOutputStream();
+  // Flushes.
+
+  inline bool isUsingUring() const { return ring.isAvailable(); }
+
+  void flush();
+  // Write out everything buffered and wait for it to complete.
+
+  // implements BufferedOutputStream ---------------------------------
+  ArrayPtr<byte> getWriteBuffer() override;
+  void write(const void* buffer, size_t size) override;
+
+private:
+  int fd;
+  internal::IoUring ring;
+  bool fixed;
+  Array<byte> ownedBuffer;
+  ArrayPtr<byte> halves[2];
+  uint active;
+  byte* fillPos;
+
+  const byte* inFlightPos;
+  size_t inFlightSize;
+  // The write in flight, from halves[1 - active], if inFlightSize > 0.
+
+  void submitActive();
+  void startWrite(const byte* pos, size_t size);
+  void finishWrite();
+};
+
+}  // namespace capnproto
+
+#endif  // CAPNPROTO_IO_URING_H_
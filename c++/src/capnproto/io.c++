@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <limits.h>
 #include <string>
 #include <string.h>
 
@@ -254,6 +255,18 @@ private:
   std::string message;
 };
 
+namespace internal {
+
+void throwOsException(const char* function, int error) {
+  throw OsException(function, error);
+}
+
+void throwPrematureEof() {
+  throw PrematureEofException();
+}
+
+}  // namespace internal
+
 AutoCloseFd::~AutoCloseFd() {
   if (fd >= 0 && close(fd) < 0) {
     if (std::uncaught_exception()) {
@@ -331,16 +344,23 @@ void FdOutputStream::write(ArrayPtr<const ArrayPtr<const byte>> pieces) {
   }
 
   while (current < iov.end()) {
-    ssize_t n = ::writev(fd, current, iov.end() - current);
+    // writev() accepts at most IOV_MAX pieces per call.
+    int count = std::min<ptrdiff_t>(iov.end() - current, IOV_MAX);
+    ssize_t n = ::writev(fd, current, count);
 
     if (n <= 0) {
-      if (n <= 0) {
-        CAPNPROTO_ASSERT(n < 0, "write() returned zero.");
-        throw OsException("writev", errno);
+      CAPNPROTO_ASSERT(n < 0, "writev() returned zero.");
+      int error = errno;
+      if (error == EINTR) {
+        continue;
+      } else {
+        throw OsException("writev", error);
       }
     }
 
-    while (static_cast<size_t>(n) >= current->iov_len) {
+    // Skip the pieces that were written completely.  The write may have been partial, in which
+    // case the loop goes around again for the rest.
+    while (current < iov.end() && static_cast<size_t>(n) >= current->iov_len) {
       n -= current->iov_len;
       ++current;
     }
@@ -275,6 +275,15 @@ private:
   AutoCloseFd autoclose;
 };
 
+namespace internal {
+
+[[noreturn]] void throwOsException(const char* function, int error);
+[[noreturn]] void throwPrematureEof();
+// Throws the same exception the classes above throw when a system call fails.  For use by other
+// fd-based code, e.g. in serialize.h.
+
+}  // namespace internal
+
 }  // namespace capnproto
 
 #endif  // CAPNPROTO_IO_H_
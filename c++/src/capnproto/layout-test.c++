@@ -22,9 +22,12 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "layout.h"
+#include "list.h"
 #include "message.h"
 #include "arena.h"
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
 
 namespace capnproto {
   template <typename T, typename U>
@@ -83,7 +86,7 @@ TEST(WireFormat, SimpleRawDataStruct) {
   EXPECT_TRUE (reader.getDataField<bool>(64 * ELEMENTS, true ));
 }
 
-static const AlignedData<6> STRUCT_DEFAULT = {{0,0,0,0,2,0,4,0,  0}};
+static const AlignedData<7> STRUCT_DEFAULT = {{0,0,0,0,2,0,4,0,  0}};
 
 static const AlignedData<2> SUBSTRUCT_DEFAULT = {{0,0,0,0,1,0,0,0,  0,0,0,0,0,0,0,0}};
 static const AlignedData<3> STRUCTLIST_ELEMENT_DEFAULT =
@@ -334,19 +337,930 @@ TEST(WireFormat, StructRoundTrip_MultipleSegmentsWithMultipleAllocations) {
   ASSERT_EQ(6u, segments.size());
 
   // Check that each segment has the expected size.  Recall that each object will be prefixed by an
-  // extra word if its parent is in a different segment.
+  // extra word if its parent is in a different segment.  Objects are placed in whichever existing
+  // segment has the most space left, so later small objects fill in the tail of segment 1.
   EXPECT_EQ( 8u, segments[0].size());  // root ref + struct + sub
-  EXPECT_EQ( 3u, segments[1].size());  // 3-element int32 list
+  EXPECT_EQ( 7u, segments[1].size());  // 3-element int32 list + list list sublist 3,4
   EXPECT_EQ(10u, segments[2].size());  // struct list
   EXPECT_EQ( 8u, segments[3].size());  // struct list substructs
   EXPECT_EQ( 8u, segments[4].size());  // list list + sublist 1,2
-  EXPECT_EQ( 7u, segments[5].size());  // list list sublist 3,4,5
+  EXPECT_EQ( 3u, segments[5].size());  // list list sublist 5
 
   checkStruct(builder);
   checkStruct(builder.asReader());
   checkStruct(StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 4));
 }
 
+TEST(WireFormat, Compact) {
+  MallocMessageBuilder message(0, AllocationStrategy::FIXED_SIZE);
+  BuilderArena arena(&message, false, false, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+
+  StructBuilder builder = StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+  setupStruct(builder);
+
+  // Replace the int32 list.  The old one is zeroed and its segment reused for the new one.
+  {
+    ListBuilder list = builder.initListField(1 * REFERENCES, FieldSize::FOUR_BYTES, 3 * ELEMENTS);
+    list.setDataElement<int32_t>(0 * ELEMENTS, 200);
+    list.setDataElement<int32_t>(1 * ELEMENTS, 201);
+    list.setDataElement<int32_t>(2 * ELEMENTS, 202);
+  }
+  ASSERT_EQ(15u, arena.getSegmentsForOutput().size());
+
+  arena.compact();
+
+  // Same 34 words as StructRoundTrip_OneSegment:  no landing pads.
+  ArrayPtr<const ArrayPtr<const word>> segments = arena.getSegmentsForOutput();
+  ASSERT_EQ(1u, segments.size());
+  EXPECT_EQ(34u, segments[0].size());
+
+  segment = arena.getSegment(SegmentId(0));
+  builder = StructBuilder::getRoot(segment, segment->getPtrUnchecked(0 * WORDS),
+                                   STRUCT_DEFAULT.words);
+  checkStruct(builder);
+  checkStruct(StructReader::readRootTrusted(segment->getStartPtr(), nullptr));
+  checkStruct(StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 4));
+
+  // Growing the message again reuses the memory of the old segments.
+  builder.initListField(1 * REFERENCES, FieldSize::FOUR_BYTES, 3 * ELEMENTS);
+  segments = arena.getSegmentsForOutput();
+  ASSERT_EQ(2u, segments.size());
+  EXPECT_EQ(3u, segments[1].size());
+}
+
+TEST(WireFormat, OverwriteReclaimsSpace) {
+  MallocMessageBuilder message;
+  BuilderArena arena(&message, false, false, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+
+  StructBuilder builder = StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+  setupStruct(builder);
+  ASSERT_EQ(34u, arena.getSegmentsForOutput()[0].size());
+
+  // The list list was allocated last, so replacing it un-allocates all 11 of its words first.
+  {
+    ListBuilder list = builder.initListField(3 * REFERENCES, FieldSize::REFERENCE, 5 * ELEMENTS);
+    for (uint i = 0; i < 5; i++) {
+      ListBuilder element = list.initListElement(
+          i * REFERENCES, FieldSize::TWO_BYTES, (i + 1) * ELEMENTS);
+      for (uint j = 0; j <= i; j++) {
+        element.setDataElement<uint16_t>(j * ELEMENTS, 500 + j);
+      }
+    }
+  }
+  EXPECT_EQ(34u, arena.getSegmentsForOutput()[0].size());
+  checkStruct(builder);
+
+  // The int32 list (words 8-9) is in the middle of the segment.  Replacing it leaves a zeroed hole.
+  {
+    ListBuilder list = builder.initListField(1 * REFERENCES, FieldSize::FOUR_BYTES, 3 * ELEMENTS);
+    list.setDataElement<int32_t>(0 * ELEMENTS, 200);
+    list.setDataElement<int32_t>(1 * ELEMENTS, 201);
+    list.setDataElement<int32_t>(2 * ELEMENTS, 202);
+  }
+  EXPECT_EQ(36u, arena.getSegmentsForOutput()[0].size());
+  EXPECT_EQ(0u, *reinterpret_cast<uint64_t*>(segment->getPtrUnchecked(8 * WORDS)));
+  EXPECT_EQ(0u, *reinterpret_cast<uint64_t*>(segment->getPtrUnchecked(9 * WORDS)));
+  checkStruct(builder);
+  checkStruct(StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 4));
+}
+
+TEST(WireFormat, OverwriteDeepChain) {
+  // Zeroing doesn't recurse, so a chain far deeper than the call stack could hold can be
+  // overwritten, and all of it is un-allocated.
+  static const AlignedData<1> LINK_DEFAULT = {{0,0,0,0,0,0,1,0}};
+
+  MallocMessageBuilder message(1u << 19);
+  BuilderArena arena(&message, false, false, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+
+  StructBuilder root = StructBuilder::initRoot(segment, rootLocation, LINK_DEFAULT.words);
+  StructBuilder link = root;
+  for (uint i = 0; i < (1u << 18); i++) {
+    link = link.initStructField(0 * REFERENCES, LINK_DEFAULT.words);
+  }
+  ASSERT_EQ(1u, arena.getSegmentsForOutput().size());
+  EXPECT_EQ(2u + (1u << 18), arena.getSegmentsForOutput()[0].size());
+
+  root.initStructField(0 * REFERENCES, LINK_DEFAULT.words);
+  EXPECT_EQ(3u, arena.getSegmentsForOutput()[0].size());
+}
+
+TEST(WireFormat, ReuseFreedSpace) {
+  // setupStruct() exactly fills a 34-word segment.
+  MallocMessageBuilder message(34, AllocationStrategy::FIXED_SIZE);
+  BuilderArena arena(&message, false, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+
+  StructBuilder builder = StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+  setupStruct(builder);
+  ASSERT_EQ(0 * WORDS, segment->available());
+
+  // Replacing the int32 list with one of the same size fills the hole left by the old one rather
+  // than spilling into a new segment.
+  {
+    ListBuilder list = builder.initListField(1 * REFERENCES, FieldSize::FOUR_BYTES, 3 * ELEMENTS);
+    list.setDataElement<int32_t>(0 * ELEMENTS, 200);
+    list.setDataElement<int32_t>(1 * ELEMENTS, 201);
+    list.setDataElement<int32_t>(2 * ELEMENTS, 202);
+  }
+  ASSERT_EQ(1u, arena.getSegmentsForOutput().size());
+  EXPECT_EQ(202, *reinterpret_cast<int32_t*>(segment->getPtrUnchecked(9 * WORDS)));
+  checkStruct(StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 4));
+
+  // A bigger replacement still has to go elsewhere.
+  builder.initListField(1 * REFERENCES, FieldSize::FOUR_BYTES, 5 * ELEMENTS);
+  EXPECT_EQ(2u, arena.getSegmentsForOutput().size());
+}
+
+#if CAPNPROTO_ALLOCATION_STATS
+TEST(WireFormat, AllocationStats) {
+  MallocMessageBuilder message(0, AllocationStrategy::FIXED_SIZE);
+  BuilderArena arena(&message, false, false, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+
+  // getRoot() on an empty message copies the default value.
+  StructBuilder builder = StructBuilder::getRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+  setupStruct(builder);
+
+  // Same layout as StructRoundTrip_OneSegmentPerAllocation:  every object but the root reference
+  // (which we allocated directly) lands in its own segment behind a landing pad.
+  AllocationStats stats = arena.getAllocationStats();
+  EXPECT_EQ(47u, stats.wordsAllocated);
+  EXPECT_EQ(48u, stats.wordsReserved);
+  EXPECT_EQ(15u, stats.segmentsAllocated);
+  EXPECT_EQ(14u, stats.farReferences);
+  EXPECT_EQ(1u, stats.defaultValueCopies);
+  EXPECT_EQ(0u, stats.wordsZeroed);
+
+  // Replacing the int32 list zeroes it and its landing pad, then reuses its now-empty segment.
+  builder.initListField(1 * REFERENCES, FieldSize::FOUR_BYTES, 3 * ELEMENTS);
+  stats = arena.getAllocationStats();
+  EXPECT_EQ(50u, stats.wordsAllocated);
+  EXPECT_EQ(15u, stats.segmentsAllocated);
+  EXPECT_EQ(15u, stats.farReferences);
+  EXPECT_EQ(3u, stats.wordsZeroed);
+}
+#endif  // CAPNPROTO_ALLOCATION_STATS
+
+TEST(WireFormat, Validate) {
+  MallocMessageBuilder message(0, AllocationStrategy::FIXED_SIZE);
+  BuilderArena builderArena(&message);
+  SegmentBuilder* segment = builderArena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  setupStruct(StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words));
+  ArrayPtr<const ArrayPtr<const word>> segments = builderArena.getSegmentsForOutput();
+  ASSERT_EQ(15u, segments.size());
+
+  {
+    // The message is 48 words, so it can only be read once within this limit unless validated.
+    ReaderOptions options;
+    options.traversalLimitInWords = 60;
+    SegmentArrayMessageReader reader(segments, options);
+    ReaderArena arena(&reader);
+    EXPECT_TRUE(arena.validate());
+
+    SegmentReader* root = arena.tryGetSegment(SegmentId(0));
+    for (int i = 0; i < 3; i++) {
+      checkStruct(StructReader::readRoot(root->getStartPtr(), nullptr, root, 4));
+    }
+  }
+
+  {
+    // One level short.
+    ReaderOptions options;
+    options.nestingLimit = 3;
+    options.errorReporter = getIgnoringErrorReporter();
+    SegmentArrayMessageReader reader(segments, options);
+    ReaderArena arena(&reader);
+    EXPECT_FALSE(arena.validate());
+  }
+}
+
+TEST(WireFormat, ValidateRejectsOverlap) {
+  AlignedData<5> data = {{
+    // Root struct ref, offset = 0, dataSize = 0, referenceCount = 2
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00,
+    // Struct ref, offset = 1, dataSize = 1, referenceCount = 0
+    0x04, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    // Struct ref, offset = 1, dataSize = 1, referenceCount = 0
+    0x04, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    // Content for the first struct.
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+    // Content for the second struct.
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef
+  }};
+  ReaderOptions options;
+  options.errorReporter = getIgnoringErrorReporter();
+
+  {
+    ArrayPtr<const word> segment = arrayPtr(data.words, 5);
+    SegmentArrayMessageReader reader(arrayPtr(&segment, 1), options);
+    ReaderArena arena(&reader);
+    EXPECT_TRUE(arena.validate());
+  }
+
+  {
+    // Point the second reference at the first struct.
+    data.bytes[16] = 0x00;
+    ArrayPtr<const word> segment = arrayPtr(data.words, 5);
+    SegmentArrayMessageReader reader(arrayPtr(&segment, 1), options);
+    ReaderArena arena(&reader);
+    EXPECT_FALSE(arena.validate());
+  }
+
+  {
+    // Point the second reference back at the root struct, making a cycle.
+    data.bytes[16] = 0xf8;
+    data.bytes[17] = 0xff;
+    data.bytes[18] = 0xff;
+    data.bytes[19] = 0xff;
+    data.bytes[20] = 0x00;
+    data.bytes[22] = 0x02;
+    ArrayPtr<const word> segment = arrayPtr(data.words, 5);
+    SegmentArrayMessageReader reader(arrayPtr(&segment, 1), options);
+    ReaderArena arena(&reader);
+    EXPECT_FALSE(arena.validate());
+  }
+
+  {
+    // Restore the second reference, but cut off the struct it points to.
+    data.bytes[16] = 0x04;
+    data.bytes[17] = 0x00;
+    data.bytes[18] = 0x00;
+    data.bytes[19] = 0x00;
+    data.bytes[20] = 0x01;
+    data.bytes[22] = 0x00;
+    ArrayPtr<const word> segment = arrayPtr(data.words, 4);
+    SegmentArrayMessageReader reader(arrayPtr(&segment, 1), options);
+    ReaderArena arena(&reader);
+    EXPECT_FALSE(arena.validate());
+  }
+}
+
+static const AlignedData<1> WRAPPER_DEFAULT = {{0,0,0,0,0,0,2,0}};
+
+TEST(WireFormat, CopyFromReader) {
+  MallocMessageBuilder srcMessage(0, AllocationStrategy::FIXED_SIZE);
+  BuilderArena srcArena(&srcMessage);
+  SegmentBuilder* srcSegment = srcArena.getSegmentWithAvailable(1 * WORDS);
+  word* srcRootLocation = srcSegment->allocate(1 * WORDS);
+  setupStruct(StructBuilder::initRoot(srcSegment, srcRootLocation, STRUCT_DEFAULT.words));
+  ArrayPtr<const ArrayPtr<const word>> srcSegments = srcArena.getSegmentsForOutput();
+  ASSERT_EQ(15u, srcSegments.size());
+
+  SegmentArrayMessageReader reader(srcSegments);
+  ReaderArena readerArena(&reader);
+  SegmentReader* readerSegment = readerArena.tryGetSegment(SegmentId(0));
+  StructReader src = StructReader::readRoot(
+      readerSegment->getStartPtr(), nullptr, readerSegment, 64);
+
+  MallocMessageBuilder message;
+  BuilderArena arena(&message, false, false, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  StructBuilder wrapper = StructBuilder::initRoot(segment, rootLocation, WRAPPER_DEFAULT.words);
+
+  wrapper.setStructField(0 * REFERENCES, src);
+  wrapper.setListField(1 * REFERENCES, FieldSize::INLINE_COMPOSITE,
+      src.getListField(2 * REFERENCES, FieldSize::INLINE_COMPOSITE, nullptr));
+
+  // The source's 14 far references are gone:  1 root reference + 2 wrapper + 33 copied struct
+  // + 13 copied struct list (including substructs).
+  ArrayPtr<const ArrayPtr<const word>> segments = arena.getSegmentsForOutput();
+  ASSERT_EQ(1u, segments.size());
+  EXPECT_EQ(49u, segments[0].size());
+
+  checkStruct(wrapper.getStructField(0 * REFERENCES, STRUCT_DEFAULT.words));
+  StructReader copy = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64);
+  checkStruct(copy.getStructField(0 * REFERENCES, STRUCT_DEFAULT.words));
+
+  ListReader list = copy.getListField(1 * REFERENCES, FieldSize::INLINE_COMPOSITE, nullptr);
+  ASSERT_EQ(4 * ELEMENTS, list.size());
+  for (int i = 0; i < 4; i++) {
+    StructReader element = list.getStructElement(i * ELEMENTS, STRUCTLIST_ELEMENT_DEFAULT.words);
+    EXPECT_EQ(300 + i, element.getDataField<int32_t>(0 * ELEMENTS, 1616));
+    EXPECT_EQ(400 + i,
+        element.getStructField(0 * REFERENCES, STRUCTLIST_ELEMENT_SUBSTRUCT_DEFAULT.words)
+            .getDataField<int32_t>(0 * ELEMENTS, 1616));
+  }
+
+  // Overwriting the last copy reuses its space.
+  wrapper.setListField(1 * REFERENCES, FieldSize::INLINE_COMPOSITE,
+      src.getListField(2 * REFERENCES, FieldSize::INLINE_COMPOSITE, nullptr));
+  EXPECT_EQ(49u, arena.getSegmentsForOutput()[0].size());
+}
+
+TEST(WireFormat, SelfAssignment) {
+  // Setting a field from a reader of its own value must copy the value before zeroing the old one.
+  MallocMessageBuilder message;
+  BuilderArena arena(&message, false, false, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  StructBuilder builder = StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+
+  builder.setTextField(0 * REFERENCES, "hello world");
+  builder.setDataField(1 * REFERENCES, Data::Reader("some\0data", 9));
+  {
+    StructBuilder subStruct = builder.initStructField(2 * REFERENCES, STRUCT_DEFAULT.words);
+    subStruct.setDataField<uint64_t>(0 * ELEMENTS, 123);
+    subStruct.setTextField(0 * REFERENCES, "nested");
+  }
+  {
+    ListBuilder list = builder.initListField(3 * REFERENCES, FieldSize::FOUR_BYTES, 3 * ELEMENTS);
+    list.setDataElement<int32_t>(0 * ELEMENTS, 200);
+    list.setDataElement<int32_t>(1 * ELEMENTS, 201);
+    list.setDataElement<int32_t>(2 * ELEMENTS, 202);
+  }
+
+  StructReader reader = builder.asReader();
+  builder.setTextField(0 * REFERENCES, reader.getTextField(0 * REFERENCES, nullptr, 0 * BYTES));
+  builder.setDataField(1 * REFERENCES, reader.getDataField(1 * REFERENCES, nullptr, 0 * BYTES));
+  builder.setStructField(2 * REFERENCES,
+      reader.getStructField(2 * REFERENCES, STRUCT_DEFAULT.words));
+  builder.setListField(3 * REFERENCES, FieldSize::FOUR_BYTES,
+      reader.getListField(3 * REFERENCES, FieldSize::FOUR_BYTES, nullptr));
+
+  reader = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 4);
+  Text::Reader text = reader.getTextField(0 * REFERENCES, nullptr, 0 * BYTES);
+  EXPECT_EQ("hello world", std::string(text.data(), text.size()));
+  Data::Reader data = reader.getDataField(1 * REFERENCES, nullptr, 0 * BYTES);
+  EXPECT_EQ(std::string("some\0data", 9), std::string(data.data(), data.size()));
+  StructReader subStruct = reader.getStructField(2 * REFERENCES, STRUCT_DEFAULT.words);
+  EXPECT_EQ(123u, subStruct.getDataField<uint64_t>(0 * ELEMENTS, 0));
+  text = subStruct.getTextField(0 * REFERENCES, nullptr, 0 * BYTES);
+  EXPECT_EQ("nested", std::string(text.data(), text.size()));
+  ListReader list = reader.getListField(3 * REFERENCES, FieldSize::FOUR_BYTES, nullptr);
+  ASSERT_EQ(3 * ELEMENTS, list.size());
+  EXPECT_EQ(200, list.getDataElement<int32_t>(0 * ELEMENTS));
+  EXPECT_EQ(201, list.getDataElement<int32_t>(1 * ELEMENTS));
+  EXPECT_EQ(202, list.getDataElement<int32_t>(2 * ELEMENTS));
+
+  // A value that is only part of the old one works too.
+  text = reader.getTextField(0 * REFERENCES, nullptr, 0 * BYTES);
+  builder.setTextField(0 * REFERENCES, Text::Reader(text.data() + 6, 5));
+  text = reader.getTextField(0 * REFERENCES, nullptr, 0 * BYTES);
+  EXPECT_EQ("world", std::string(text.data(), text.size()));
+}
+
+TEST(WireFormat, CopyFromOverwrittenField) {
+  MallocMessageBuilder message;
+  BuilderArena arena(&message, false, false, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  StructBuilder builder = StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+
+  {
+    StructBuilder child = builder.initStructField(0 * REFERENCES, STRUCT_DEFAULT.words);
+    child.setDataField<uint64_t>(0 * ELEMENTS, 111);
+    StructBuilder grandchild = child.initStructField(0 * REFERENCES, STRUCT_DEFAULT.words);
+    grandchild.setDataField<uint64_t>(0 * ELEMENTS, 222);
+    grandchild.setTextField(1 * REFERENCES, "grandchild");
+  }
+
+  // Replace the child with the grandchild, which is only reachable through the child.
+  StructReader reader = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64);
+  builder.setStructField(0 * REFERENCES,
+      reader.getStructField(0 * REFERENCES, STRUCT_DEFAULT.words)
+            .getStructField(0 * REFERENCES, STRUCT_DEFAULT.words));
+
+  reader = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64);
+  StructReader child = reader.getStructField(0 * REFERENCES, STRUCT_DEFAULT.words);
+  EXPECT_EQ(222u, child.getDataField<uint64_t>(0 * ELEMENTS, 0));
+  Text::Reader text = child.getTextField(1 * REFERENCES, nullptr, 0 * BYTES);
+  EXPECT_EQ("grandchild", std::string(text.data(), text.size()));
+
+  // Copying the root into its own field copies the field's old value along with it.
+  builder.setStructField(0 * REFERENCES, reader);
+  reader = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64);
+  child = reader.getStructField(0 * REFERENCES, STRUCT_DEFAULT.words)
+                .getStructField(0 * REFERENCES, STRUCT_DEFAULT.words);
+  EXPECT_EQ(222u, child.getDataField<uint64_t>(0 * ELEMENTS, 0));
+  text = child.getTextField(1 * REFERENCES, nullptr, 0 * BYTES);
+  EXPECT_EQ("grandchild", std::string(text.data(), text.size()));
+}
+
+TEST(WireFormat, TotalSize) {
+  MallocMessageBuilder srcMessage(0, AllocationStrategy::FIXED_SIZE);
+  BuilderArena srcArena(&srcMessage);
+  SegmentBuilder* srcSegment = srcArena.getSegmentWithAvailable(1 * WORDS);
+  word* srcRootLocation = srcSegment->allocate(1 * WORDS);
+  setupStruct(StructBuilder::initRoot(srcSegment, srcRootLocation, STRUCT_DEFAULT.words));
+
+  SegmentArrayMessageReader reader(srcArena.getSegmentsForOutput());
+  ReaderArena readerArena(&reader);
+  SegmentReader* readerSegment = readerArena.tryGetSegment(SegmentId(0));
+  StructReader src = StructReader::readRoot(
+      readerSegment->getStartPtr(), nullptr, readerSegment, 64);
+
+  // Same word counts as StructRoundTrip_OneSegment, minus the root reference.
+  MessageSize size = src.totalSize();
+  EXPECT_EQ(33u, size.wordCount);
+  EXPECT_EQ(13u, size.referenceCount);
+
+  size = src.getListField(2 * REFERENCES, FieldSize::INLINE_COMPOSITE, nullptr).totalSize(
+      FieldSize::INLINE_COMPOSITE);
+  EXPECT_EQ(13u, size.wordCount);
+  EXPECT_EQ(4u, size.referenceCount);
+
+  size = src.getListField(3 * REFERENCES, FieldSize::REFERENCE, nullptr).totalSize(
+      FieldSize::REFERENCE);
+  EXPECT_EQ(11u, size.wordCount);
+  EXPECT_EQ(5u, size.referenceCount);
+
+  // A first segment of exactly that size (plus the root reference) holds the whole copy.
+  MallocMessageBuilder message(src.totalSize().wordCount + 1, AllocationStrategy::FIXED_SIZE);
+  BuilderArena arena(&message);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  StructBuilder::setRoot(segment, rootLocation, src);
+
+  ArrayPtr<const ArrayPtr<const word>> segments = arena.getSegmentsForOutput();
+  ASSERT_EQ(1u, segments.size());
+  EXPECT_EQ(34u, segments[0].size());
+  checkStruct(StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64));
+}
+
+TEST(WireFormat, Prefetch) {
+  MallocMessageBuilder message;
+  BuilderArena arena(&message);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  setupStruct(StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words));
+
+  StructReader reader = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64);
+
+  // Prefetching is only a hint, so all we can check is that it's safe everywhere, including past
+  // the end of lists and on default values.
+  reader.prefetch();
+  reader.prefetchTargets();
+  StructReader().prefetch();
+  StructReader().prefetchTargets();
+
+  ListReader structList = reader.getListField(
+      2 * REFERENCES, FieldSize::INLINE_COMPOSITE, nullptr);
+  for (uint i = 0; i < 6; i++) {
+    structList.prefetchElement(i * ELEMENTS);
+    structList.prefetchStructElementTargets(i * ELEMENTS);
+  }
+  ListReader().prefetchElement(0 * ELEMENTS);
+  ListReader().prefetchStructElementTargets(0 * ELEMENTS);
+  ListReader().prefetchReferenceTarget(0 * REFERENCES);
+
+  // Iterating with prefetching visits the same elements as iterating without, whatever the
+  // distance.
+  List<List<uint16_t>>::Reader listList(
+      reader.getListField(3 * REFERENCES, FieldSize::REFERENCE, nullptr));
+  for (uint distance: {0u, 1u, 2u, 100u}) {
+    uint i = 0;
+    for (List<uint16_t>::Reader element: listList.prefetching(distance)) {
+      ASSERT_EQ(i + 1, element.size());
+      for (uint j = 0; j <= i; j++) {
+        EXPECT_EQ(500u + j, element[j]);
+      }
+      i++;
+    }
+    EXPECT_EQ(5u, i);
+  }
+}
+
+TEST(WireFormat, PrimitiveListArrays) {
+  MallocMessageBuilder message;
+  BuilderArena arena(&message);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  StructBuilder builder = StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+  setupStruct(builder);
+
+  StructReader reader = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64);
+
+  {
+    List<int32_t>::Reader list(reader.getListField(1 * REFERENCES, FieldSize::FOUR_BYTES, nullptr));
+    ArrayPtr<const int32_t> array = list.asArray();
+    ASSERT_EQ(3u, array.size());
+    EXPECT_EQ(200, array[0]);
+    EXPECT_EQ(201, array[1]);
+    EXPECT_EQ(202, array[2]);
+  }
+
+  {
+    // A struct list read as a primitive list isn't contiguous, so there's no array, but copyTo()
+    // still works.
+    List<int32_t>::Reader list(reader.getListField(2 * REFERENCES, FieldSize::FOUR_BYTES, nullptr));
+    ASSERT_EQ(4u, list.size());
+    EXPECT_EQ(0u, list.asArray().size());
+    int32_t copy[4];
+    list.copyTo(arrayPtr(copy, 4));
+    for (int i = 0; i < 4; i++) {
+      EXPECT_EQ(300 + i, copy[i]);
+    }
+  }
+
+  {
+    int64_t values[5] = { 1, -2, 3, -4, 1ll << 40 };
+    List<int64_t>::Builder list(
+        builder.initListField(1 * REFERENCES, FieldSize::EIGHT_BYTES, 5 * ELEMENTS));
+    list.copyFrom(arrayPtr(values, 5));
+    for (int i = 0; i < 5; i++) {
+      EXPECT_EQ(values[i], list[i]);
+    }
+
+    list.asArray()[1] = 123;
+    EXPECT_EQ(123, list[1]);
+
+    // So is anything else with data() and size().
+    std::vector<int64_t> vector(list.asArray().begin(), list.asArray().end());
+    List<int64_t>::Builder other(
+        builder.initListField(3 * REFERENCES, FieldSize::EIGHT_BYTES, 5 * ELEMENTS));
+    other.copyFrom(vector);
+    int64_t copy[5];
+    List<int64_t>::Reader(builder.asReader().getListField(
+        3 * REFERENCES, FieldSize::EIGHT_BYTES, nullptr)).copyTo(arrayPtr(copy, 5));
+    EXPECT_EQ(1, copy[0]);
+    EXPECT_EQ(123, copy[1]);
+    EXPECT_EQ(1ll << 40, copy[4]);
+  }
+
+  {
+    // Copying from a source of the wrong size is an error in debug builds.  Otherwise only the
+    // elements that fit are copied, and nothing past the end of the list is touched.
+    int64_t values[5] = { 1, 2, 3, 4, 5 };
+    std::vector<int64_t> vector(values, values + 5);
+    List<int64_t>::Builder list(
+        builder.initListField(1 * REFERENCES, FieldSize::EIGHT_BYTES, 3 * ELEMENTS));
+    List<int64_t>::Builder next(
+        builder.initListField(3 * REFERENCES, FieldSize::EIGHT_BYTES, 1 * ELEMENTS));
+    List<int64_t>::Reader listReader(builder.asReader().getListField(
+        1 * REFERENCES, FieldSize::EIGHT_BYTES, nullptr));
+    int64_t copy[5] = { 0, 0, 0, 0, 0 };
+#ifdef NDEBUG
+    list.copyFrom(arrayPtr(values, 5));
+    list.copyFrom(vector);
+    EXPECT_EQ(3, list[2]);
+    listReader.copyTo(arrayPtr(copy, 5));
+    EXPECT_EQ(3, copy[2]);
+#else
+    EXPECT_ANY_THROW(list.copyFrom(arrayPtr(values, 5)));
+    EXPECT_ANY_THROW(list.copyFrom(vector));
+    EXPECT_ANY_THROW(listReader.copyTo(arrayPtr(copy, 5)));
+#endif
+    EXPECT_EQ(0, next[0]);
+    EXPECT_EQ(0, copy[3]);
+  }
+
+  {
+    List<bool>::Builder list(builder.initListField(1 * REFERENCES, FieldSize::BIT, 3 * ELEMENTS));
+    list.copyFrom({true, false, true});
+    EXPECT_TRUE(list[0]);
+    EXPECT_FALSE(list[1]);
+    EXPECT_TRUE(list[2]);
+  }
+}
+
+TEST(WireFormat, BoolListKernels) {
+  MallocMessageBuilder message;
+  BuilderArena arena(&message);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  StructBuilder builder = StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+  setupStruct(builder);
+
+  std::vector<bool> bits(200);
+  for (uint i = 0; i < bits.size(); i++) {
+    bits[i] = i % 3 == 0;
+  }
+  List<bool>::Builder list(builder.initListField(1 * REFERENCES, FieldSize::BIT, 200 * ELEMENTS));
+  list.copyFrom(bits);
+  for (uint i = 0; i < bits.size(); i++) {
+    EXPECT_EQ(bits[i], list[i]);
+  }
+
+  EXPECT_EQ(67u, list.countSet());
+  EXPECT_EQ(0u, list.findFirstSet());
+  EXPECT_EQ(3u, list.findFirstSet(1));
+  EXPECT_EQ(129u, list.findFirstSet(127));
+  EXPECT_EQ(200u, list.findFirstSet(199));
+  EXPECT_EQ(1u, list.findFirstUnset());
+  EXPECT_EQ(199u, list.findFirstUnset(199));
+  EXPECT_EQ(200u, list.findFirstUnset(200));
+
+  // The mask is shorter than the list; missing elements count as false.
+  List<bool>::Builder mask(builder.initListField(3 * REFERENCES, FieldSize::BIT, 70 * ELEMENTS));
+  for (uint i = 0; i < 70; i++) {
+    mask.set(i, i % 2 == 0);
+  }
+  StructReader reader = builder.asReader();
+  List<bool>::Reader maskReader(reader.getListField(3 * REFERENCES, FieldSize::BIT, nullptr));
+
+  list.orWith(maskReader);
+  for (uint i = 0; i < bits.size(); i++) {
+    EXPECT_EQ(bits[i] || (i < 70 && i % 2 == 0), list[i]) << i;
+  }
+  EXPECT_EQ(1u, list.findFirstUnset());
+  EXPECT_EQ(70u, list.findFirstUnset(69));
+
+  list.andWith(maskReader);
+  for (uint i = 0; i < bits.size(); i++) {
+    EXPECT_EQ(i < 70 && i % 2 == 0, list[i]) << i;
+  }
+  EXPECT_EQ(35u, list.countSet());
+  EXPECT_EQ(68u, list.findFirstSet(67));
+  EXPECT_EQ(200u, list.findFirstSet(69));
+
+  // A struct list read as a bool list has gaps between the elements, so it's handled an element
+  // at a time.  Its elements' first bits are those of 300, 301, 302, and 303.
+  List<bool>::Reader upgraded(reader.getListField(2 * REFERENCES, FieldSize::BIT, nullptr));
+  ASSERT_EQ(4u, upgraded.size());
+  EXPECT_EQ(2u, upgraded.countSet());
+  EXPECT_EQ(1u, upgraded.findFirstSet());
+  EXPECT_EQ(2u, upgraded.findFirstUnset(1));
+  EXPECT_EQ(4u, upgraded.findFirstSet(4));
+
+  list.copyFrom(bits);
+  list.orWith(upgraded);
+  for (uint i = 0; i < bits.size(); i++) {
+    EXPECT_EQ(bits[i] || i == 1 || i == 3, list[i]) << i;
+  }
+  list.andWith(upgraded);
+  EXPECT_EQ(2u, list.countSet());
+  EXPECT_EQ(3u, list.findFirstSet(2));
+}
+
+TEST(WireFormat, ExternalData) {
+  AlignedData<3> blob = {{
+    'e', 'x', 't', 'e', 'r', 'n', 'a', 'l',
+    ' ', 'b', 'l', 'o', 'b', ' ', 'd', 'a',
+    't', 'a', '!', '!',   0,   0,   0,   0
+  }};
+  uint8_t original[sizeof(blob.bytes)];
+  memcpy(original, blob.bytes, sizeof(blob.bytes));
+
+  MallocMessageBuilder message;
+  BuilderArena arena(&message);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  StructBuilder wrapper = StructBuilder::initRoot(segment, rootLocation, WRAPPER_DEFAULT.words);
+
+  wrapper.setExternalDataField(0 * REFERENCES, arrayPtr(blob.words, 3), 20 * BYTES);
+  wrapper.setExternalDataField(1 * REFERENCES, arrayPtr(blob.words, 3), 13 * BYTES);
+
+  // Each blob is its own segment, pointing right at the caller's memory.  Segment 0 has the root
+  // reference, the wrapper, and a two-word landing pad for each blob.
+  ArrayPtr<const ArrayPtr<const word>> segments = arena.getSegmentsForOutput();
+  ASSERT_EQ(3u, segments.size());
+  EXPECT_EQ(7u, segments[0].size());
+  EXPECT_EQ(blob.words, segments[1].begin());
+  EXPECT_EQ(3u, segments[1].size());
+  EXPECT_EQ(blob.words, segments[2].begin());
+
+  {
+    SegmentArrayMessageReader reader(segments);
+    EXPECT_TRUE(reader.validate());
+    ReaderArena readerArena(&reader);
+    SegmentReader* readerSegment = readerArena.tryGetSegment(SegmentId(0));
+    StructReader root = StructReader::readRoot(
+        readerSegment->getStartPtr(), nullptr, readerSegment, 64);
+    EXPECT_EQ(Data::Reader("external blob data!!"),
+              root.getDataField(0 * REFERENCES, nullptr, 0 * BYTES));
+    EXPECT_EQ(Data::Reader("external blob"),
+              root.getDataField(1 * REFERENCES, nullptr, 0 * BYTES));
+  }
+
+  // The builder won't write to the caller's memory.
+  EXPECT_ANY_THROW(wrapper.getDataField(0 * REFERENCES, nullptr, 0 * BYTES));
+  wrapper.setDataField(0 * REFERENCES, Data::Reader("copied"));
+  EXPECT_EQ(0, memcmp(original, blob.bytes, sizeof(blob.bytes)));
+  EXPECT_EQ(Data::Reader("copied"),
+            wrapper.asReader().getDataField(0 * REFERENCES, nullptr, 0 * BYTES));
+  EXPECT_EQ(Data::Reader("external blob"),
+            wrapper.asReader().getDataField(1 * REFERENCES, nullptr, 0 * BYTES));
+
+  // compact() copies the data into segment 0 and leaves the caller's memory alone.
+  arena.compact();
+  EXPECT_EQ(0, memcmp(original, blob.bytes, sizeof(blob.bytes)));
+  segments = arena.getSegmentsForOutput();
+  ASSERT_EQ(1u, segments.size());
+  segment = arena.getSegment(SegmentId(0));
+  StructReader root = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64);
+  EXPECT_EQ(Data::Reader("copied"), root.getDataField(0 * REFERENCES, nullptr, 0 * BYTES));
+  EXPECT_EQ(Data::Reader("external blob"), root.getDataField(1 * REFERENCES, nullptr, 0 * BYTES));
+}
+
+TEST(WireFormat, OverwriteExternalData) {
+  // Overwriting a reference to external data stops the data from being sent, whether or not
+  // overwritten objects are zeroed.
+  AlignedData<2> blob = {{'e', 'x', 't', 'e', 'r', 'n', 'a', 'l'}};
+
+  for (bool zeroOverwritten: {false, true}) {
+    MallocMessageBuilder message;
+    BuilderArena arena(&message, false, false, zeroOverwritten);
+    SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+    word* rootLocation = segment->allocate(1 * WORDS);
+    StructBuilder wrapper = StructBuilder::initRoot(segment, rootLocation, WRAPPER_DEFAULT.words);
+
+    wrapper.setExternalDataField(0 * REFERENCES, arrayPtr(blob.words, 2), 8 * BYTES);
+    wrapper.setExternalDataField(1 * REFERENCES, arrayPtr(blob.words, 2), 8 * BYTES);
+    ASSERT_EQ(3u, arena.getSegmentsForOutput().size());
+
+    // A released segment in the middle stays, but empty, since segment 2 is still referenced.
+    wrapper.setDataField(0 * REFERENCES, Data::Reader("copied"));
+    ArrayPtr<const ArrayPtr<const word>> segments = arena.getSegmentsForOutput();
+    ASSERT_EQ(3u, segments.size());
+    EXPECT_EQ(0u, segments[1].size());
+    EXPECT_EQ(2u, segments[2].size());
+
+    // Once the released segments are at the end, they're left off.
+    wrapper.setDataField(1 * REFERENCES, Data::Reader("copied too"));
+    segments = arena.getSegmentsForOutput();
+    ASSERT_EQ(1u, segments.size());
+
+    SegmentArrayMessageReader reader(segments);
+    EXPECT_TRUE(reader.validate());
+  }
+}
+
+TEST(WireFormat, CopyFromReaderPrunesInvalid) {
+  AlignedData<5> data = {{
+    // Root struct ref, offset = 0, dataSize = 0, referenceCount = 2
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00,
+    // Struct ref, offset = 1, dataSize = 1, referenceCount = 0
+    0x04, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    // Struct ref back to the root struct, making a cycle.
+    0xf8, 0xff, 0xff, 0xff, 0x00, 0x00, 0x02, 0x00,
+    // Content for the first struct.
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+    // Padding.
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+  }};
+  ReaderOptions options;
+  options.errorReporter = getIgnoringErrorReporter();
+  ArrayPtr<const word> readerSegments[1] = { arrayPtr(data.words, 5) };
+  SegmentArrayMessageReader reader(arrayPtr(readerSegments, 1), options);
+  ReaderArena readerArena(&reader);
+  SegmentReader* readerSegment = readerArena.tryGetSegment(SegmentId(0));
+  StructReader src = StructReader::readRoot(
+      readerSegment->getStartPtr(), nullptr, readerSegment, 4);
+
+  MallocMessageBuilder message;
+  BuilderArena arena(&message);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+  StructBuilder wrapper = StructBuilder::initRoot(segment, rootLocation, WRAPPER_DEFAULT.words);
+  wrapper.setStructField(0 * REFERENCES, src);
+
+  // The cycle is followed only as far as a reader could follow it, then cut.
+  StructReader copy = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 64)
+      .getStructField(0 * REFERENCES, WRAPPER_DEFAULT.words);
+  int depth = 0;
+  while (true) {
+    EXPECT_EQ(0xefcdab8967452301ull,
+              copy.getStructField(0 * REFERENCES, SUBSTRUCT_DEFAULT.words)
+                  .getDataField<uint64_t>(0 * ELEMENTS, 0));
+    StructReader next = copy.getStructField(1 * REFERENCES, WRAPPER_DEFAULT.words);
+    if (next.getStructField(0 * REFERENCES, SUBSTRUCT_DEFAULT.words)
+            .getDataField<uint64_t>(0 * ELEMENTS, 0) == 0) {
+      break;
+    }
+    copy = next;
+    ++depth;
+    ASSERT_LT(depth, 10);
+  }
+  EXPECT_EQ(2, depth);
+}
+
+TEST(WireFormat, Canonicalize) {
+  MallocMessageBuilder flatMessage;
+  BuilderArena flatArena(&flatMessage);
+  SegmentBuilder* flatSegment = flatArena.getSegmentWithAvailable(1 * WORDS);
+  word* flatRootLocation = flatSegment->allocate(1 * WORDS);
+  setupStruct(StructBuilder::initRoot(flatSegment, flatRootLocation, STRUCT_DEFAULT.words));
+  ArrayPtr<const ArrayPtr<const word>> flatSegments = flatArena.getSegmentsForOutput();
+  ASSERT_EQ(1u, flatSegments.size());
+
+  MallocMessageBuilder splitMessage(0, AllocationStrategy::FIXED_SIZE);
+  BuilderArena splitArena(&splitMessage);
+  SegmentBuilder* splitSegment = splitArena.getSegmentWithAvailable(1 * WORDS);
+  word* splitRootLocation = splitSegment->allocate(1 * WORDS);
+  setupStruct(StructBuilder::initRoot(splitSegment, splitRootLocation, STRUCT_DEFAULT.words));
+  ArrayPtr<const ArrayPtr<const word>> splitSegments = splitArena.getSegmentsForOutput();
+  ASSERT_EQ(15u, splitSegments.size());
+
+  SegmentArrayMessageReader flat(flatSegments);
+  SegmentArrayMessageReader flatAgain(flatSegments);
+  SegmentArrayMessageReader split(splitSegments);
+
+  // setupStruct() has nothing to trim and builds objects in preorder, so a single-segment build
+  // is already canonical.
+  Array<word> canonical = split.canonicalize();
+  ASSERT_EQ(flatSegments[0].size(), canonical.size());
+  EXPECT_EQ(0, memcmp(flatSegments[0].begin(), canonical.begin(),
+                      canonical.size() * sizeof(word)));
+  checkStruct(StructReader::readRootTrusted(canonical.begin(), nullptr));
+
+  EXPECT_EQ(hashCanonicalMessage(arrayPtr(canonical.begin(), canonical.size())),
+            flat.canonicalHash());
+  EXPECT_EQ(flat.canonicalHash(), split.canonicalHash());
+  EXPECT_TRUE(flat.canonicallyEquals(flatAgain));
+  EXPECT_TRUE(flat.canonicallyEquals(split));
+  EXPECT_TRUE(split.canonicallyEquals(flat));
+
+  // Change one element.
+  StructBuilder::getRoot(splitSegment, splitRootLocation, STRUCT_DEFAULT.words)
+      .getListField(1 * REFERENCES, nullptr).setDataElement<int32_t>(2 * ELEMENTS, 203);
+  SegmentArrayMessageReader changed(splitArena.getSegmentsForOutput());
+  EXPECT_FALSE(flat.canonicallyEquals(changed));
+  EXPECT_NE(flat.canonicalHash(), changed.canonicalHash());
+}
+
+TEST(WireFormat, CanonicalizeTrims) {
+  AlignedData<9> data = {{
+    // Root struct ref, offset = 0, dataSize = 2, referenceCount = 2
+    0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x02, 0x00,
+    // Data:  one non-zero word, then a zero word.
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // List ref, offset = 2, element size = BYTE, 3 elements
+    0x09, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x40,
+    // Null reference.
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // Unreachable garbage.
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    // The list, with garbage in its padding.
+    'a', 'b', 'c', 0xff, 0xff, 0xff, 0xff, 0xff,
+    // Padding.
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+  }};
+  AlignedData<4> expected = {{
+    // Root struct ref, offset = 0, dataSize = 1, referenceCount = 1
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // List ref, offset = 0, element size = BYTE, 3 elements
+    0x01, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x40,
+    'a', 'b', 'c', 0x00, 0x00, 0x00, 0x00, 0x00
+  }};
+
+  ArrayPtr<const word> segment = arrayPtr(data.words, 9);
+  SegmentArrayMessageReader reader(arrayPtr(&segment, 1));
+  Array<word> canonical = reader.canonicalize();
+  ASSERT_EQ(4u, canonical.size());
+  EXPECT_EQ(0, memcmp(expected.bytes, canonical.begin(), sizeof(expected)));
+}
+
+TEST(WireFormat, ConcurrentBuilding) {
+  // Use tiny segments so that threads are constantly racing to add new ones.
+  MallocMessageBuilder message(16, AllocationStrategy::FIXED_SIZE);
+  BuilderArena arena(&message, true);
+  SegmentBuilder* segment = arena.getSegmentWithAvailable(1 * WORDS);
+  word* rootLocation = segment->allocate(1 * WORDS);
+
+  StructBuilder root = StructBuilder::initRoot(segment, rootLocation, STRUCT_DEFAULT.words);
+  ListBuilder lists = root.initListField(3 * REFERENCES, FieldSize::REFERENCE, 64 * ELEMENTS);
+
+  std::vector<std::thread> threads;
+  for (uint t = 0; t < 4; t++) {
+    threads.emplace_back([=]() {
+      for (uint i = t; i < 64; i += 4) {
+        ListBuilder element = lists.initListElement(
+            i * REFERENCES, FieldSize::FOUR_BYTES, (i + 1) * ELEMENTS);
+        for (uint j = 0; j <= i; j++) {
+          element.setDataElement<uint32_t>(j * ELEMENTS, i * 1000 + j);
+        }
+      }
+    });
+  }
+  for (auto& thread: threads) {
+    thread.join();
+  }
+
+  // Enough segments that the lock-free segment table had to grow.
+  EXPECT_GT(arena.getSegmentsForOutput().size(), 16u);
+
+  // Builders follow far references with getSegment(), which reads the table without locking.
+  ListBuilder builderList = root.getListField(3 * REFERENCES, nullptr);
+  for (uint i = 0; i < 64; i++) {
+    EXPECT_EQ(i * 1000 + i, builderList.getListElement(i * REFERENCES)
+        .getDataElement<uint32_t>(i * ELEMENTS));
+  }
+
+  StructReader reader = StructReader::readRoot(segment->getStartPtr(), nullptr, segment, 4);
+  ListReader list = reader.getListField(3 * REFERENCES, FieldSize::REFERENCE, nullptr);
+  ASSERT_EQ(64 * ELEMENTS, list.size());
+  for (uint i = 0; i < 64; i++) {
+    ListReader element = list.getListElement(i * REFERENCES, FieldSize::FOUR_BYTES);
+    ASSERT_EQ((i + 1) * ELEMENTS, element.size());
+    for (uint j = 0; j <= i; j++) {
+      EXPECT_EQ(i * 1000 + j, element.getDataElement<uint32_t>(j * ELEMENTS));
+    }
+  }
+}
+
 }  // namespace
 }  // namespace internal
 }  // namespace capnproto
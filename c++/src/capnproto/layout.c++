@@ -25,6 +25,8 @@
 #include "arena.h"
 #include <string.h>
 #include <limits>
+#include <vector>
+#include <algorithm>
 
 namespace capnproto {
 namespace internal {
@@ -203,15 +205,34 @@ struct WireHelpers {
   static CAPNPROTO_ALWAYS_INLINE(word* allocate(
       WireReference*& ref, SegmentBuilder*& segment, WordCount amount,
       WireReference::Kind kind)) {
+    if (CAPNPROTO_EXPECT_FALSE(!ref->isNull())) {
+      // We're overwriting an existing object.  If the arena zeroes overwritten objects, give its
+      // space back first, so that if it was the last thing allocated we can simply reuse it.
+      zeroObject(segment, ref);
+    }
+
     word* ptr = segment->allocate(amount);
 
+    if (ptr == nullptr) {
+      // If the arena is tracking space freed by overwritten objects, try to fill a hole in this
+      // segment before moving on to another one.
+      ptr = segment->getArena()->allocateFreedSpace(segment, amount);
+    }
+
     if (ptr == nullptr) {
       // Need to allocate in a new segment.  We'll need to allocate an extra reference worth of
       // space to act as the landing pad for a far reference.
 
       WordCount amountPlusRef = amount + REFERENCE_SIZE_IN_WORDS;
-      segment = segment->getArena()->getSegmentWithAvailable(amountPlusRef);
-      ptr = segment->allocate(amountPlusRef);
+      do {
+        segment = segment->getArena()->getSegmentWithAvailable(amountPlusRef);
+        ptr = segment->allocate(amountPlusRef);
+        // allocate() can only fail here if the message is being built concurrently and some other
+        // thread got to the space first.
+      } while (CAPNPROTO_EXPECT_FALSE(ptr == nullptr));
+
+      segment->getArena()->countAllocation(amountPlusRef);
+      segment->getArena()->countFarReference();
 
       // Set up the original reference to be a far reference to the new segment.
       ref->setKindAndPositionInSegment(WireReference::FAR, segment->getOffsetTo(ptr));
@@ -224,6 +245,7 @@ struct WireHelpers {
       // Allocated space follows new reference.
       return ptr + REFERENCE_SIZE_IN_WORDS;
     } else {
+      segment->getArena()->countAllocation(amount);
       ref->setKindAndTarget(kind, ptr);
       return ptr;
     }
@@ -292,41 +314,585 @@ struct WireHelpers {
 
   // -----------------------------------------------------------------
 
+  // Deep copy:  copies an object, and everything it references, from a reader -- which may belong
+  // to another message, or be a trusted default value -- into a builder.  This doesn't recurse.
+  // planCopy() walks the source breadth-first, checking each reference the same way the readers
+  // would, and lists every object to copy along with where its copy will go.  copyObjects() then
+  // allocates a single block big enough for all of them, so that only the root can possibly
+  // need a far reference, and copies each object with one memcpy() before pointing the copied
+  // references at the copied children.
+
+  struct CopiedObject {
+    SegmentReader* segment;  // Segment containing the source, or null if the source is trusted.
+
+    const word* src;
+    // First word to copy:  the struct, or the list's elements.  Null if the reference to this
+    // object was invalid, in which case the copied reference is zeroed instead.
+
+    WordCount dstOffset;
+    // Where the copy goes, relative to the start of the block.  For an INLINE_COMPOSITE list,
+    // this is where the tag goes; the elements follow.
+
+    WordCount refOffset;
+    // Where the reference to the copy goes, relative to the start of the block.  Unused for the
+    // root, whose reference is the one passed to copyObjects().
+
+    WordCount size;  // Words to copy from `src`.
+
+    WireReference::Kind kind;
+    FieldSize elementSize;
+    ElementCount elementCount;
+    WordCount16 dataSize;              // Size of the struct, or of each element of a struct list.
+    WireReferenceCount16 refCount;
+
+    int nestingLimit;
+    // The nestingLimit a reader would have for this object.
+  };
+
+  static CAPNPROTO_ALWAYS_INLINE(bool copiedObjectHasReferences(const CopiedObject& object)) {
+    if (object.kind == WireReference::STRUCT) {
+      return object.refCount > 0 * REFERENCES;
+    } else if (object.elementSize == FieldSize::REFERENCE) {
+      return object.elementCount > 0 * ELEMENTS;
+    } else if (object.elementSize == FieldSize::INLINE_COMPOSITE) {
+      return object.refCount > 0 * REFERENCES && object.elementCount > 0 * ELEMENTS;
+    } else {
+      return false;
+    }
+  }
+
+  static CAPNPROTO_ALWAYS_INLINE(WordCount copiedObjectTotalSize(const CopiedObject& object)) {
+    if (object.kind == WireReference::LIST && object.elementSize == FieldSize::INLINE_COMPOSITE) {
+      return object.size + REFERENCE_SIZE_IN_WORDS;
+    } else {
+      return object.size;
+    }
+  }
+
+  static bool resolveCopySource(SegmentReader* segment, const WireReference* ref,
+                                int nestingLimit, CopiedObject& object) {
+    // Fills in `object` (except for the offsets) to describe the target of `ref`, which must not
+    // be null.  Returns false, after reporting the problem, if a reader would have refused to
+    // follow `ref`.
+
+    const word* ptr;
+    if (segment == nullptr) {
+      // Trusted messages don't contain far pointers.
+      ptr = ref->target();
+    } else {
+      if (CAPNPROTO_EXPECT_FALSE(nestingLimit <= 0)) {
+        segment->getArena()->reportInvalidData(
+            "Message is too deeply-nested or contains cycles.  See capnproto::ReadOptions.");
+        return false;
+      }
+
+      ptr = followFars(ref, segment);
+      if (CAPNPROTO_EXPECT_FALSE(ptr == nullptr)) {
+        segment->getArena()->reportInvalidData(
+            "Message contains invalid far reference.");
+        return false;
+      }
+    }
+
+    object.segment = segment;
+    object.kind = ref->kind();
+    object.nestingLimit = nestingLimit - 1;
+
+    switch (ref->kind()) {
+      case WireReference::STRUCT:
+        object.src = ptr;
+        object.size = ref->structRef.wordSize();
+        object.elementSize = FieldSize::INLINE_COMPOSITE;
+        object.elementCount = 0 * ELEMENTS;
+        object.dataSize = ref->structRef.dataSize.get();
+        object.refCount = ref->structRef.refCount.get();
+
+        if (segment != nullptr &&
+            CAPNPROTO_EXPECT_FALSE(!segment->containsInterval(ptr, ptr + object.size))) {
+          segment->getArena()->reportInvalidData(
+              "Message contained out-of-bounds struct reference.");
+          return false;
+        }
+        return true;
+
+      case WireReference::LIST:
+        break;
+
+      default:
+        CAPNPROTO_ASSERT(segment != nullptr, "Copy source message contained unexpected kind.");
+        segment->getArena()->reportInvalidData(
+            "Message contains reference of unknown kind.");
+        return false;
+    }
+
+    object.elementSize = ref->listRef.elementSize();
+
+    if (object.elementSize == FieldSize::INLINE_COMPOSITE) {
+      WordCount wordCount = ref->listRef.inlineCompositeWordCount();
+      const WireReference* tag = reinterpret_cast<const WireReference*>(ptr);
+
+      if (segment == nullptr) {
+        CAPNPROTO_ASSERT(tag->kind() == WireReference::STRUCT,
+            "INLINE_COMPOSITE of lists is not yet supported.");
+      } else {
+        if (CAPNPROTO_EXPECT_FALSE(!segment->containsInterval(
+            ptr, ptr + REFERENCE_SIZE_IN_WORDS + wordCount))) {
+          segment->getArena()->reportInvalidData(
+              "Message contains out-of-bounds list reference.");
+          return false;
+        }
+
+        if (CAPNPROTO_EXPECT_FALSE(tag->kind() != WireReference::STRUCT)) {
+          segment->getArena()->reportInvalidData(
+              "INLINE_COMPOSITE lists of non-STRUCT type are not supported.");
+          return false;
+        }
+
+        if (CAPNPROTO_EXPECT_FALSE(tag->inlineCompositeListElementCount() *
+              (tag->structRef.wordSize() / ELEMENTS) > wordCount)) {
+          segment->getArena()->reportInvalidData(
+              "INLINE_COMPOSITE list's elements overrun its word count.");
+          return false;
+        }
+      }
+
+      // Padding past the last element, if any, is not copied.
+      object.src = ptr + REFERENCE_SIZE_IN_WORDS;
+      object.elementCount = tag->inlineCompositeListElementCount();
+      object.dataSize = tag->structRef.dataSize.get();
+      object.refCount = tag->structRef.refCount.get();
+      object.size = object.elementCount * (tag->structRef.wordSize() / ELEMENTS);
+    } else {
+      object.src = ptr;
+      object.elementCount = ref->listRef.elementCount();
+      object.dataSize = 0 * WORDS;
+      object.refCount = 0 * REFERENCES;
+      object.size = roundUpToWords(
+          ElementCount64(object.elementCount) * bitsPerElement(object.elementSize));
+
+      if (segment != nullptr &&
+          CAPNPROTO_EXPECT_FALSE(!segment->containsInterval(ptr, ptr + object.size))) {
+        segment->getArena()->reportInvalidData(
+            "Message contained out-of-bounds list reference.");
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  static WordCount planCopy(std::vector<CopiedObject>& objects) {
+    // `objects` starts out holding just the root, with dstOffset zero.  Appends every object
+    // reachable from it, and returns the total number of words needed to copy them all.
+
+    WordCount total = copiedObjectTotalSize(objects[0]);
+
+    // `objects` grows as we go, so it serves as the queue.
+    for (size_t i = 0; i < objects.size(); i++) {
+      if (objects[i].src == nullptr || !copiedObjectHasReferences(objects[i])) {
+        continue;
+      }
+
+      // Copy what we need, since appending to `objects` may move it.
+      SegmentReader* segment = objects[i].segment;
+      const word* src = objects[i].src;
+      WordCount dstOffset = objects[i].dstOffset;
+      int nestingLimit = objects[i].nestingLimit;
+
+      WireReferenceCount refsPerElement;
+      uint elementCount;
+      WordCount elementStride;
+
+      if (objects[i].kind == WireReference::STRUCT) {
+        src += objects[i].dataSize;
+        dstOffset += objects[i].dataSize;
+        refsPerElement = objects[i].refCount;
+        elementCount = 1;
+        elementStride = 0 * WORDS;
+      } else if (objects[i].elementSize == FieldSize::REFERENCE) {
+        refsPerElement = objects[i].elementCount * (1 * REFERENCES / ELEMENTS);
+        elementCount = 1;
+        elementStride = 0 * WORDS;
+      } else {
+        // INLINE_COMPOSITE.  Getting an element uses up a level of nesting, before its references
+        // use up another.
+        src += objects[i].dataSize;
+        dstOffset += REFERENCE_SIZE_IN_WORDS + objects[i].dataSize;
+        refsPerElement = objects[i].refCount;
+        elementCount = objects[i].elementCount / ELEMENTS;
+        elementStride = objects[i].dataSize + objects[i].refCount * WORDS_PER_REFERENCE;
+        --nestingLimit;
+      }
+
+      for (uint j = 0; j < elementCount; j++) {
+        const WireReference* refs = reinterpret_cast<const WireReference*>(src);
+        for (uint k = 0; k < refsPerElement / REFERENCES; k++) {
+          if (refs[k].isNull()) {
+            // Copied as-is.
+            continue;
+          }
+
+          CopiedObject child;
+          if (resolveCopySource(segment, refs + k, nestingLimit, child)) {
+            child.dstOffset = total;
+            total += copiedObjectTotalSize(child);
+          } else {
+            child.src = nullptr;
+          }
+          child.refOffset = dstOffset + k * REFERENCES * WORDS_PER_REFERENCE;
+          objects.push_back(child);
+        }
+
+        src += elementStride;
+        dstOffset += elementStride;
+      }
+    }
+
+    return total;
+  }
+
   static CAPNPROTO_ALWAYS_INLINE(
-      void copyStruct(SegmentBuilder* segment, word* dst, const word* src,
-                      WordCount dataSize, WireReferenceCount referenceCount)) {
+      void setCopiedReference(WireReference* ref, const CopiedObject& object)) {
+    // Sets the kind-specific part of a reference to a copied object.
+    if (object.kind == WireReference::STRUCT) {
+      ref->structRef.set(object.dataSize, object.refCount);
+    } else if (object.elementSize == FieldSize::INLINE_COMPOSITE) {
+      ref->listRef.setInlineComposite(object.size);
+    } else {
+      ref->listRef.set(object.elementSize, object.elementCount);
+    }
+  }
+
+  static CAPNPROTO_ALWAYS_INLINE(void copyObject(word* dst, const CopiedObject& object)) {
+    if (object.kind == WireReference::LIST && object.elementSize == FieldSize::INLINE_COMPOSITE) {
+      WireReference* tag = reinterpret_cast<WireReference*>(dst);
+      tag->setKindAndInlineCompositeListElementCount(WireReference::STRUCT, object.elementCount);
+      tag->structRef.set(object.dataSize, object.refCount);
+      dst += REFERENCE_SIZE_IN_WORDS;
+    }
+
+    if (object.size > 0 * WORDS) {
+      memcpy(dst, object.src, object.size * BYTES_PER_WORD / BYTES);
+    }
+  }
+
+  static word* copyObjects(WireReference*& ref, SegmentBuilder*& segment,
+                           const CopiedObject& root) {
+    // Copies `root` and everything it references to `ref`, returning a pointer to the copy.
+    // `ref` and `segment` are updated as by allocate().  If `root` comes from the same message,
+    // the object `ref` pointed at before is zeroed only once the copy is complete, so `root` may
+    // be that object or anything reachable from it.
+
+    bool sameMessage = root.segment != nullptr &&
+        root.segment->getArena() == static_cast<Arena*>(segment->getArena());
+
+    if (!copiedObjectHasReferences(root)) {
+      // Only one object to copy.
+      DetachedObject old = detachObject(segment, ref, sameMessage);
+      word* ptr = allocate(ref, segment, copiedObjectTotalSize(root), root.kind);
+      setCopiedReference(ref, root);
+      copyObject(ptr, root);
+      zeroObject(old);
+      return ptr;
+    }
+
+    std::vector<CopiedObject> objects;
+    objects.push_back(root);
+    objects[0].dstOffset = 0 * WORDS;
+    WordCount total = planCopy(objects);
+
+    // Detach only after planning, so that if `root` contains `ref`, the copy still gets what `ref`
+    // pointed at.
+    DetachedObject old = detachObject(segment, ref, sameMessage);
+    word* block = allocate(ref, segment, total, root.kind);
+    setCopiedReference(ref, root);
+    copyObject(block, root);
+
+    // Each object's parent precedes it, so the reference we're about to overwrite has already
+    // been copied.
+    for (size_t i = 1; i < objects.size(); i++) {
+      const CopiedObject& object = objects[i];
+      WireReference* childRef = reinterpret_cast<WireReference*>(block + object.refOffset);
+      if (object.src == nullptr) {
+        memset(childRef, 0, sizeof(WireReference));
+      } else {
+        word* dst = block + object.dstOffset;
+        childRef->setKindAndTarget(object.kind, dst);
+        setCopiedReference(childRef, object);
+        copyObject(dst, object);
+      }
+    }
+
+    zeroObject(old);
+    return block;
+  }
+
+  static word* copyMessage(
+      SegmentBuilder*& segment, WireReference*& dst, const WireReference* src) {
+    // Copies a trusted message, e.g. a default value.
+    if (src->isNull()) {
+      memset(dst, 0, sizeof(WireReference));
+      return nullptr;
+    }
+
+    CopiedObject root;
+    resolveCopySource(nullptr, src, std::numeric_limits<int>::max(), root);
+    return copyObjects(dst, segment, root);
+  }
+
+  static CopiedObject structReaderObject(const StructReader& value) {
+    CAPNPROTO_ASSERT(value.bit0Offset == 0 * BITS &&
+        reinterpret_cast<uintptr_t>(value.data) % sizeof(word) == 0,
+        "Can't copy or measure a struct that was read as an element of a non-struct list.");
+
+    CopiedObject object;
+    object.segment = value.segment;
+    object.src = reinterpret_cast<const word*>(value.data);
+    object.dstOffset = 0 * WORDS;
+    object.kind = WireReference::STRUCT;
+    object.elementSize = FieldSize::INLINE_COMPOSITE;
+    object.elementCount = 0 * ELEMENTS;
+    object.dataSize = WordCount(value.dataSize);
+    object.refCount = WireReferenceCount(value.referenceCount);
+    object.size = object.dataSize + object.refCount * WORDS_PER_REFERENCE;
+    object.nestingLimit = value.nestingLimit;
+    return object;
+  }
+
+  static CopiedObject listReaderObject(FieldSize elementSize, const ListReader& value) {
+    CopiedObject object;
+    object.segment = value.segment;
+    object.src = reinterpret_cast<const word*>(value.ptr);
+    object.dstOffset = 0 * WORDS;
+    object.kind = WireReference::LIST;
+    object.elementCount = value.elementCount;
+    object.nestingLimit = value.nestingLimit;
+
+    uint stepBits = value.stepBits * (1 * ELEMENTS) / BITS;
+    bool isStructList = elementSize == FieldSize::INLINE_COMPOSITE ||
+        value.structDataSize > 0 * WORDS || value.structReferenceCount > 0 * REFERENCES;
+
+    if (isStructList && stepBits % 64 == 0) {
+      // A struct list, though perhaps read as a list of its elements' first field.
+      if (elementSize == FieldSize::REFERENCE) {
+        object.src -= value.structDataSize;
+      }
+      object.elementSize = FieldSize::INLINE_COMPOSITE;
+      object.dataSize = value.structDataSize;
+      object.refCount = value.structReferenceCount;
+      object.size = value.elementCount * (stepBits / 64 * WORDS / ELEMENTS);
+    } else {
+      if (isStructList) {
+        // A list of sub-word primitives read as a struct list.  Copy it as what it really is.
+        switch (stepBits) {
+          case 0: elementSize = FieldSize::VOID; break;
+          case 1: elementSize = FieldSize::BIT; break;
+          case 8: elementSize = FieldSize::BYTE; break;
+          case 16: elementSize = FieldSize::TWO_BYTES; break;
+          default: elementSize = FieldSize::FOUR_BYTES; break;
+        }
+      }
+      object.elementSize = elementSize;
+      object.dataSize = 0 * WORDS;
+      object.refCount = 0 * REFERENCES;
+      object.size = roundUpToWords(ElementCount64(value.elementCount) * value.stepBits);
+    }
+
+    return object;
+  }
+
+  static void setStructReference(
+      WireReference* ref, SegmentBuilder* segment, const StructReader& value) {
+    copyObjects(ref, segment, structReaderObject(value));
+  }
+
+  static void setListReference(WireReference* ref, SegmentBuilder* segment,
+                               FieldSize elementSize, const ListReader& value) {
+    copyObjects(ref, segment, listReaderObject(elementSize, value));
+  }
+
+  // -----------------------------------------------------------------
+  // Total size:  the same walk as planCopy(), but depth-first, and only adding up sizes.
+
+  struct PendingSizeReferences {
+    SegmentReader* segment;
+    const WireReference* refs;
+    uint count;
+    int nestingLimit;
+  };
+
+  static void pushSizeReferences(std::vector<PendingSizeReferences>& pending,
+                                 const CopiedObject& object) {
+    if (!copiedObjectHasReferences(object)) {
+      return;
+    }
+
+    if (object.kind == WireReference::STRUCT) {
+      pending.push_back(PendingSizeReferences {
+          object.segment, reinterpret_cast<const WireReference*>(object.src + object.dataSize),
+          object.refCount / REFERENCES, object.nestingLimit });
+    } else if (object.elementSize == FieldSize::REFERENCE) {
+      pending.push_back(PendingSizeReferences {
+          object.segment, reinterpret_cast<const WireReference*>(object.src),
+          object.elementCount / ELEMENTS, object.nestingLimit });
+    } else {
+      // INLINE_COMPOSITE.  Getting an element uses up a level of nesting.
+      WordCount stride = object.dataSize + object.refCount * WORDS_PER_REFERENCE;
+      const word* element = object.src + object.dataSize;
+      for (uint i = 0; i < object.elementCount / ELEMENTS; i++) {
+        pending.push_back(PendingSizeReferences {
+            object.segment, reinterpret_cast<const WireReference*>(element),
+            object.refCount / REFERENCES, object.nestingLimit - 1 });
+        element += stride;
+      }
+    }
+  }
+
+  static void prefetchTargets(const WireReference* refs, WireReferenceCount count) {
+    // Only the first cache line of each target is prefetched.  That covers a small struct, a
+    // list's tag, or the start of a blob; the hardware prefetcher takes over if more is read.
+    for (uint i = 0; i < count / REFERENCES; i++) {
+      if (!refs[i].isNull() && refs[i].kind() != WireReference::FAR) {
+        CAPNPROTO_PREFETCH(refs[i].target());
+      }
+    }
+  }
+
+  static MessageSize totalSize(const CopiedObject& root) {
+    MessageSize result = { copiedObjectTotalSize(root) / WORDS, 0 };
+
+    std::vector<PendingSizeReferences> pending;
+    pushSizeReferences(pending, root);
+
+    while (!pending.empty()) {
+      PendingSizeReferences refs = pending.back();
+      pending.pop_back();
+
+      for (uint i = 0; i < refs.count; i++) {
+        CopiedObject object;
+        if (refs.refs[i].isNull() ||
+            !resolveCopySource(refs.segment, refs.refs + i, refs.nestingLimit, object)) {
+          continue;
+        }
+        ++result.referenceCount;
+        result.wordCount += copiedObjectTotalSize(object) / WORDS;
+        pushSizeReferences(pending, object);
+      }
+    }
+
+    return result;
+  }
+
+  // -----------------------------------------------------------------
+  // Compaction:  like copyMessage(), but the source is a builder which may contain far references
+  // and dead space.
+
+  static WordCount structRefsLiveSize(
+      SegmentBuilder* segment, WireReference* refs, WireReferenceCount referenceCount) {
+    WordCount result = 0 * WORDS;
+    for (uint i = 0; i < referenceCount / REFERENCES; i++) {
+      result += liveSize(segment, refs + i);
+    }
+    return result;
+  }
+
+  // Not always-inline because it's recursive.
+  static WordCount liveSize(SegmentBuilder* segment, WireReference* ref) {
+    if (ref->isNull()) {
+      return 0 * WORDS;
+    }
+
+    word* ptr = followFars(ref, segment);
+
+    switch (ref->kind()) {
+      case WireReference::STRUCT:
+        return ref->structRef.wordSize() + structRefsLiveSize(
+            segment, reinterpret_cast<WireReference*>(ptr + ref->structRef.dataSize.get()),
+            ref->structRef.refCount.get());
+
+      case WireReference::LIST:
+        switch (ref->listRef.elementSize()) {
+          case FieldSize::VOID:
+          case FieldSize::BIT:
+          case FieldSize::BYTE:
+          case FieldSize::TWO_BYTES:
+          case FieldSize::FOUR_BYTES:
+          case FieldSize::EIGHT_BYTES:
+            return roundUpToWords(
+                ElementCount64(ref->listRef.elementCount()) *
+                bitsPerElement(ref->listRef.elementSize()));
+
+          case FieldSize::REFERENCE: {
+            WireReferenceCount count =
+                ref->listRef.elementCount() * (1 * REFERENCES / ELEMENTS);
+            return count * WORDS_PER_REFERENCE + structRefsLiveSize(
+                segment, reinterpret_cast<WireReference*>(ptr), count);
+          }
+
+          case FieldSize::INLINE_COMPOSITE: {
+            WireReference* tag = reinterpret_cast<WireReference*>(ptr);
+            CAPNPROTO_ASSERT(tag->kind() == WireReference::STRUCT,
+                "INLINE_COMPOSITE of lists is not yet supported.");
+
+            WordCount result =
+                REFERENCE_SIZE_IN_WORDS + ref->listRef.inlineCompositeWordCount();
+            word* element = ptr + REFERENCE_SIZE_IN_WORDS;
+            uint n = tag->inlineCompositeListElementCount() / ELEMENTS;
+            for (uint i = 0; i < n; i++) {
+              result += structRefsLiveSize(segment,
+                  reinterpret_cast<WireReference*>(element + tag->structRef.dataSize.get()),
+                  tag->structRef.refCount.get());
+              element += tag->structRef.wordSize();
+            }
+            return result;
+          }
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    CAPNPROTO_ASSERT(false, "Message being compacted contained unexpected kind.");
+    return 0 * WORDS;
+  }
+
+  static void copyStructCompacted(
+      SegmentBuilder* dstSegment, word* dst, SegmentBuilder* srcSegment, word* src,
+      WordCount dataSize, WireReferenceCount referenceCount) {
     memcpy(dst, src, dataSize * BYTES_PER_WORD / BYTES);
 
-    const WireReference* srcRefs = reinterpret_cast<const WireReference*>(src + dataSize);
+    WireReference* srcRefs = reinterpret_cast<WireReference*>(src + dataSize);
     WireReference* dstRefs = reinterpret_cast<WireReference*>(dst + dataSize);
 
     for (uint i = 0; i < referenceCount / REFERENCES; i++) {
-      SegmentBuilder* subSegment = segment;
-      WireReference* dstRef = dstRefs + i;
-      copyMessage(subSegment, dstRef, srcRefs + i);
+      copyCompacted(dstSegment, dstRefs + i, srcSegment, srcRefs + i);
     }
   }
 
   // Not always-inline because it's recursive.
-  static word* copyMessage(
-      SegmentBuilder*& segment, WireReference*& dst, const WireReference* src) {
-    switch (src->kind()) {
-      case WireReference::STRUCT: {
-        if (src->isNull()) {
-          memset(dst, 0, sizeof(WireReference));
-          return nullptr;
-        } else {
-          const word* srcPtr = src->target();
-          word* dstPtr = allocate(dst, segment, src->structRef.wordSize(), WireReference::STRUCT);
+  static void copyCompacted(SegmentBuilder* dstSegment, WireReference* dst,
+                            SegmentBuilder* srcSegment, WireReference* src) {
+    // The destination segment must have been sized with liveSize(), so allocate() never needs
+    // to create a far reference.
+
+    if (src->isNull()) {
+      memset(dst, 0, sizeof(WireReference));
+      return;
+    }
 
-          copyStruct(segment, dstPtr, srcPtr, src->structRef.dataSize.get(),
-                     src->structRef.refCount.get());
+    word* srcPtr = followFars(src, srcSegment);
 
-          dst->structRef.set(src->structRef.dataSize.get(), src->structRef.refCount.get());
-          return dstPtr;
-        }
+    switch (src->kind()) {
+      case WireReference::STRUCT: {
+        word* dstPtr = allocate(dst, dstSegment, src->structRef.wordSize(), WireReference::STRUCT);
+        dst->structRef.set(src->structRef.dataSize.get(), src->structRef.refCount.get());
+        copyStructCompacted(dstSegment, dstPtr, srcSegment, srcPtr,
+                            src->structRef.dataSize.get(), src->structRef.refCount.get());
+        return;
       }
-      case WireReference::LIST: {
+
+      case WireReference::LIST:
         switch (src->listRef.elementSize()) {
           case FieldSize::VOID:
           case FieldSize::BIT:
@@ -337,67 +903,337 @@ struct WireHelpers {
             WordCount wordCount = roundUpToWords(
                 ElementCount64(src->listRef.elementCount()) *
                 bitsPerElement(src->listRef.elementSize()));
-            const word* srcPtr = src->target();
-            word* dstPtr = allocate(dst, segment, wordCount, WireReference::LIST);
+            word* dstPtr = allocate(dst, dstSegment, wordCount, WireReference::LIST);
             memcpy(dstPtr, srcPtr, wordCount * BYTES_PER_WORD / BYTES);
-
             dst->listRef.set(src->listRef.elementSize(), src->listRef.elementCount());
-            return dstPtr;
+            return;
           }
 
           case FieldSize::REFERENCE: {
-            const WireReference* srcRefs = reinterpret_cast<const WireReference*>(src->target());
+            WireReference* srcRefs = reinterpret_cast<WireReference*>(srcPtr);
             WireReference* dstRefs = reinterpret_cast<WireReference*>(
-                allocate(dst, segment, src->listRef.elementCount() *
+                allocate(dst, dstSegment, src->listRef.elementCount() *
                     (1 * REFERENCES / ELEMENTS) * WORDS_PER_REFERENCE,
                     WireReference::LIST));
+            dst->listRef.set(FieldSize::REFERENCE, src->listRef.elementCount());
 
             uint n = src->listRef.elementCount() / ELEMENTS;
             for (uint i = 0; i < n; i++) {
-              SegmentBuilder* subSegment = segment;
-              WireReference* dstRef = dstRefs + i;
-              copyMessage(subSegment, dstRef, srcRefs + i);
+              copyCompacted(dstSegment, dstRefs + i, srcSegment, srcRefs + i);
             }
-
-            dst->listRef.set(FieldSize::REFERENCE, src->listRef.elementCount());
-            return reinterpret_cast<word*>(dstRefs);
+            return;
           }
 
           case FieldSize::INLINE_COMPOSITE: {
-            const word* srcPtr = src->target();
-            word* dstPtr = allocate(dst, segment,
+            WireReference* srcTag = reinterpret_cast<WireReference*>(srcPtr);
+            CAPNPROTO_ASSERT(srcTag->kind() == WireReference::STRUCT,
+                "INLINE_COMPOSITE of lists is not yet supported.");
+
+            word* dstPtr = allocate(dst, dstSegment,
                 src->listRef.inlineCompositeWordCount() + REFERENCE_SIZE_IN_WORDS,
                 WireReference::LIST);
-
             dst->listRef.setInlineComposite(src->listRef.inlineCompositeWordCount());
+            memcpy(dstPtr, srcTag, sizeof(WireReference));
+
+            word* srcElement = srcPtr + REFERENCE_SIZE_IN_WORDS;
+            word* dstElement = dstPtr + REFERENCE_SIZE_IN_WORDS;
+            uint n = srcTag->inlineCompositeListElementCount() / ELEMENTS;
+            for (uint i = 0; i < n; i++) {
+              copyStructCompacted(dstSegment, dstElement, srcSegment, srcElement,
+                  srcTag->structRef.dataSize.get(), srcTag->structRef.refCount.get());
+              srcElement += srcTag->structRef.wordSize();
+              dstElement += srcTag->structRef.wordSize();
+            }
+            return;
+          }
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    CAPNPROTO_ASSERT(false, "Message being compacted contained unexpected kind.");
+  }
+
+  // -----------------------------------------------------------------
+  // Zeroing:  when a reference is overwritten, the object it pointed to becomes unreachable.  We
+  // zero it (so that it doesn't leak into the output and the space is ready for reuse) and hand
+  // the space back to the arena.  Children are released before their parents, and in reverse
+  // order, so that an object built at the end of its segment can be un-allocated entirely.  Like
+  // the other walks, this keeps its own stack rather than recursing, so that a deep or long chain
+  // of objects can't overflow the call stack.
+
+  struct PendingZero {
+    // An object to be zeroed once all of its children have been.  Its references are visited
+    // from the last one back to the first.
+
+    SegmentBuilder* segment;
+    word* start;           // First word to zero, including any landing pad before the object.
+    WordCount size;        // Number of words to zero, starting at `start`.
+    WireReference* refs;   // References of the element currently being visited.
+    uint refsLeft;         // Number of references in `refs` not visited yet.
+    uint refCount;         // References per element.
+    uint elementsLeft;     // Number of elements before the current one not visited yet.
+    WordCount stride;      // Distance between elements.
+  };
+
+  static PendingZero pendingZero(SegmentBuilder* segment, const WireReference* ref, word* ptr,
+                                 WordCount prefixSize) {
+    // Describes the object `ref` describes, located at `ptr` and preceded by `prefixSize` words
+    // that go along with it.  `ref` may itself lie within the prefix.
+
+    PendingZero result;
+    result.segment = segment;
+    result.start = ptr - prefixSize;
+    result.refs = nullptr;
+    result.refsLeft = 0;
+    result.refCount = 0;
+    result.elementsLeft = 0;
+    result.stride = 0 * WORDS;
+
+    WordCount size;
+    switch (ref->kind()) {
+      case WireReference::STRUCT:
+        size = ref->structRef.wordSize();
+        result.refs = reinterpret_cast<WireReference*>(ptr + ref->structRef.dataSize.get());
+        result.refsLeft = ref->structRef.refCount.get() / REFERENCES;
+        break;
+
+      case WireReference::LIST:
+        switch (ref->listRef.elementSize()) {
+          case FieldSize::VOID:
+          case FieldSize::BIT:
+          case FieldSize::BYTE:
+          case FieldSize::TWO_BYTES:
+          case FieldSize::FOUR_BYTES:
+          case FieldSize::EIGHT_BYTES:
+            size = roundUpToWords(
+                ElementCount64(ref->listRef.elementCount()) *
+                bitsPerElement(ref->listRef.elementSize()));
+            break;
+
+          case FieldSize::REFERENCE: {
+            WireReferenceCount count =
+                ref->listRef.elementCount() * (1 * REFERENCES / ELEMENTS);
+            size = count * WORDS_PER_REFERENCE;
+            result.refs = reinterpret_cast<WireReference*>(ptr);
+            result.refsLeft = count / REFERENCES;
+            break;
+          }
+
+          case FieldSize::INLINE_COMPOSITE: {
+            WireReference* tag = reinterpret_cast<WireReference*>(ptr);
+            CAPNPROTO_ASSERT(tag->kind() == WireReference::STRUCT,
+                "INLINE_COMPOSITE of lists is not yet supported.");
+
+            size = REFERENCE_SIZE_IN_WORDS + ref->listRef.inlineCompositeWordCount();
+            uint n = tag->inlineCompositeListElementCount() / ELEMENTS;
+            uint refCount = tag->structRef.refCount.get() / REFERENCES;
+            if (n > 0 && refCount > 0) {
+              // Start at the last element.
+              result.stride = tag->structRef.wordSize();
+              result.refs = reinterpret_cast<WireReference*>(
+                  ptr + REFERENCE_SIZE_IN_WORDS + (n - 1) * result.stride +
+                  tag->structRef.dataSize.get());
+              result.refsLeft = refCount;
+              result.refCount = refCount;
+              result.elementsLeft = n - 1;
+            }
+            break;
+          }
+
+          default:
+            CAPNPROTO_ASSERT(false, "Overwritten object has unknown element size.");
+            size = 0 * WORDS;
+            break;
+        }
+        break;
+
+      default:
+        CAPNPROTO_ASSERT(false, "Overwritten object has unexpected kind.");
+        size = 0 * WORDS;
+        break;
+    }
+
+    result.size = prefixSize + size;
+    return result;
+  }
+
+  static void releaseZeroed(const PendingZero& object) {
+    memset(object.start, 0, object.size * BYTES_PER_WORD / BYTES);
+    object.segment->getArena()->countZeroed(object.size);
+    object.segment->getArena()->releaseSpace(object.segment, object.start, object.size);
+  }
+
+  static void pushZero(std::vector<PendingZero>& pending,
+                       SegmentBuilder* segment, const WireReference* ref, word* target) {
+    // Queues the object `ref` points at, given its `target` (ignored for far references).
+
+    if (ref->kind() == WireReference::FAR) {
+      SegmentBuilder* padSegment = segment->getArena()->getSegment(ref->farRef.segmentId.get());
+      WireReference* pad = reinterpret_cast<WireReference*>(
+          padSegment->getPtrUnchecked(ref->positionInSegment()));
+      if (pad->landingPadIsFollowedByAnotherReference()) {
+        // Target is in yet another segment.  Builders only produce this for external data,
+        // which belongs to the caller, so it isn't zeroed; its segment is just emptied.  The
+        // two-word pad goes after it.
+        WireReference* far2 = pad + 1;
+        SegmentBuilder* targetSegment =
+            segment->getArena()->getSegment(far2->farRef.segmentId.get());
+
+        pending.push_back(PendingZero {
+            padSegment, reinterpret_cast<word*>(pad), 2 * REFERENCE_SIZE_IN_WORDS,
+            nullptr, 0, 0, 0, 0 * WORDS });
+
+        if (targetSegment->isExternal()) {
+          targetSegment->releaseExternal();
+        } else {
+          pending.push_back(pendingZero(targetSegment, pad,
+              targetSegment->getPtrUnchecked(far2->positionInSegment()), 0 * WORDS));
+        }
+      } else {
+        // The landing pad immediately precedes the target and was allocated with it.
+        pending.push_back(pendingZero(
+            padSegment, pad, reinterpret_cast<word*>(pad + 1), REFERENCE_SIZE_IN_WORDS));
+      }
+    } else {
+      pending.push_back(pendingZero(segment, ref, target, 0 * WORDS));
+    }
+  }
+
+  static void zeroObject(SegmentBuilder* segment, WireReference* ref) {
+    // Nulls out `ref`, first zeroing what it points at if the arena asks for that.
+
+    if (ref->isNull()) {
+      return;
+    }
+
+    if (segment->getArena()->zeroesOverwrittenObjects()) {
+      zeroObject(segment, ref, ref->kind() == WireReference::FAR ? nullptr : ref->target());
+    } else if (ref->kind() == WireReference::FAR) {
+      releaseExternalTarget(segment, ref);
+    }
+    memset(ref, 0, sizeof(WireReference));
+  }
+
+  static void releaseExternalTarget(SegmentBuilder* segment, const WireReference* ref) {
+    // Even when overwritten objects are simply abandoned, external data isn't:  dropping it is
+    // free, and it may well be the bulk of the message.  Only a reference that points directly at
+    // the data is noticed, though, not one inside an abandoned struct or list.
+
+    SegmentBuilder* padSegment = segment->getArena()->getSegment(ref->farRef.segmentId.get());
+    WireReference* pad = reinterpret_cast<WireReference*>(
+        padSegment->getPtrUnchecked(ref->positionInSegment()));
+    if (pad->landingPadIsFollowedByAnotherReference()) {
+      SegmentBuilder* targetSegment =
+          segment->getArena()->getSegment((pad + 1)->farRef.segmentId.get());
+      if (targetSegment->isExternal()) {
+        targetSegment->releaseExternal();
+      }
+    }
+  }
+
+  static void zeroObject(SegmentBuilder* segment, const WireReference* ref, word* target) {
+    // Zero and release the object `ref` points at, given its `target` (ignored for far
+    // references).  Doesn't touch `ref` itself, which may be a copy of the original.
+
+    if (ref->kind() != WireReference::FAR) {
+      PendingZero object = pendingZero(segment, ref, target, 0 * WORDS);
+      if (object.refsLeft == 0) {
+        // No children, which covers all text and data.  Skip the stack.
+        releaseZeroed(object);
+        return;
+      }
+    }
+
+    std::vector<PendingZero> pending;
+    pushZero(pending, segment, ref, target);
+
+    while (!pending.empty()) {
+      PendingZero& top = pending.back();
+
+      if (top.refsLeft == 0) {
+        if (top.elementsLeft == 0) {
+          PendingZero done = top;
+          pending.pop_back();
+          releaseZeroed(done);
+        } else {
+          --top.elementsLeft;
+          top.refs = reinterpret_cast<WireReference*>(
+              reinterpret_cast<word*>(top.refs) - top.stride);
+          top.refsLeft = top.refCount;
+        }
+        continue;
+      }
+
+      WireReference* child = top.refs + --top.refsLeft;
+      if (!child->isNull()) {
+        // May reallocate `pending`, so `top` mustn't be used after this.
+        pushZero(pending, top.segment, child,
+                 child->kind() == WireReference::FAR ? nullptr : child->target());
+        memset(child, 0, sizeof(WireReference));
+      }
+    }
+  }
+
+  struct DetachedObject {
+    // An object whose reference has been nulled out but which hasn't been zeroed yet.  Setters
+    // that copy a reader which may point into the object they are replacing zero it only after
+    // the copy is done.
+
+    SegmentBuilder* segment;
+    uint64_t ref;  // Copy of the reference, or zero if there's nothing to zero.
+    word* target;
+  };
 
-            const WireReference* srcTag = reinterpret_cast<const WireReference*>(srcPtr);
-            memcpy(dstPtr, srcTag, sizeof(WireReference));
+  static CAPNPROTO_ALWAYS_INLINE(DetachedObject detachObject(
+      SegmentBuilder* segment, WireReference* ref, bool stillNeeded)) {
+    // Nulls out `ref`.  If `stillNeeded`, the object it pointed at is left intact, to be zeroed
+    // later by passing the result to zeroObject().  Otherwise it is zeroed right away, so that
+    // the allocation that follows can take back its space.  Either way, nothing is zeroed unless
+    // the arena zeroes overwritten objects.
+
+    DetachedObject result;
+    result.segment = segment;
+    if (CAPNPROTO_EXPECT_FALSE(stillNeeded) && !ref->isNull() &&
+        segment->getArena()->zeroesOverwrittenObjects()) {
+      memcpy(&result.ref, ref, sizeof(WireReference));
+      result.target = ref->kind() == WireReference::FAR ? nullptr : ref->target();
+      memset(ref, 0, sizeof(WireReference));
+    } else {
+      zeroObject(segment, ref);
+      result.ref = 0;
+      result.target = nullptr;
+    }
+    return result;
+  }
 
-            const word* srcElement = srcPtr + REFERENCE_SIZE_IN_WORDS;
-            word* dstElement = dstPtr + REFERENCE_SIZE_IN_WORDS;
+  static bool overlapsObject(WireReference* ref, SegmentBuilder* segment,
+                             const void* begin, const void* end) {
+    // Returns whether the bytes [begin, end) might lie within the object `ref` points at.
 
-            CAPNPROTO_ASSERT(srcTag->kind() == WireReference::STRUCT,
-                "INLINE_COMPOSITE of lists is not yet supported.");
+    if (ref->isNull()) {
+      return false;
+    }
 
-            uint n = srcTag->inlineCompositeListElementCount() / ELEMENTS;
-            for (uint i = 0; i < n; i++) {
-              copyStruct(segment, dstElement, srcElement,
-                  srcTag->structRef.dataSize.get(), srcTag->structRef.refCount.get());
-              srcElement += srcTag->structRef.wordSize();
-              dstElement += srcTag->structRef.wordSize();
-            }
-            return dstPtr;
-          }
-        }
-        break;
-      }
-      default:
-        CAPNPROTO_ASSERT(false, "Copy source message contained unexpected kind.");
-        break;
+    const char* ptr = reinterpret_cast<const char*>(followFars(ref, segment));
+    if (ref->kind() != WireReference::LIST || ref->listRef.elementSize() != FieldSize::BYTE) {
+      // Not a blob, so it may have children.  Assume the worst.
+      return true;
     }
 
-    return nullptr;
+    uintptr_t objectBegin = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t objectEnd = objectBegin + ref->listRef.elementCount() / ELEMENTS;
+    return reinterpret_cast<uintptr_t>(begin) < objectEnd &&
+           objectBegin < reinterpret_cast<uintptr_t>(end);
+  }
+
+  static CAPNPROTO_ALWAYS_INLINE(void zeroObject(const DetachedObject& object)) {
+    if (CAPNPROTO_EXPECT_FALSE(object.ref != 0)) {
+      zeroObject(object.segment, reinterpret_cast<const WireReference*>(&object.ref),
+                 object.target);
+    }
   }
 
   // -----------------------------------------------------------------
@@ -428,6 +1264,7 @@ struct WireHelpers {
     word* ptr;
 
     if (ref->isNull()) {
+      segment->getArena()->countDefaultValueCopy();
       ptr = copyMessage(segment, ref, defaultRef);
     } else {
       ptr = followFars(ref, segment);
@@ -513,6 +1350,7 @@ struct WireHelpers {
       if (defaultValue == nullptr) {
         return ListBuilder(segment, nullptr, 0 * ELEMENTS);
       }
+      segment->getArena()->countDefaultValueCopy();
       ptr = copyMessage(segment, ref, defaultRef);
     } else {
       ptr = followFars(ref, segment);
@@ -552,13 +1390,19 @@ struct WireHelpers {
 
   static CAPNPROTO_ALWAYS_INLINE(void setTextReference(
       WireReference* ref, SegmentBuilder* segment, Text::Reader value)) {
+    // `value` may be the text being replaced, in which case that can't be zeroed until it has
+    // been copied.
+    DetachedObject old = detachObject(segment, ref,
+        overlapsObject(ref, segment, value.data(), value.data() + value.size()));
     initTextReference(ref, segment, value.size() * BYTES).copyFrom(value);
+    zeroObject(old);
   }
 
   static CAPNPROTO_ALWAYS_INLINE(Text::Builder getWritableTextReference(
       WireReference* ref, SegmentBuilder* segment,
       const void* defaultValue, ByteCount defaultSize)) {
     if (ref->isNull()) {
+      segment->getArena()->countDefaultValueCopy();
       Text::Builder builder = initTextReference(ref, segment, defaultSize);
       builder.copyFrom(defaultValue);
       return builder;
@@ -589,13 +1433,59 @@ struct WireHelpers {
 
   static CAPNPROTO_ALWAYS_INLINE(void setDataReference(
       WireReference* ref, SegmentBuilder* segment, Data::Reader value)) {
+    // As with setTextReference(), `value` may be the data being replaced.
+    DetachedObject old = detachObject(segment, ref,
+        overlapsObject(ref, segment, value.data(), value.data() + value.size()));
     initDataReference(ref, segment, value.size() * BYTES).copyFrom(value);
+    zeroObject(old);
+  }
+
+  static void setExternalDataReference(WireReference* ref, SegmentBuilder* segment,
+                                       ArrayPtr<const word> words, ByteCount size) {
+    CAPNPROTO_ASSERT(size <= words.size() * WORDS * BYTES_PER_WORD,
+        "setExternalDataField() size is larger than the words given.");
+
+    if (!ref->isNull()) {
+      zeroObject(segment, ref);
+    }
+
+    BuilderArena* arena = segment->getArena();
+    SegmentBuilder* dataSegment = arena->addExternalSegment(words);
+
+    // The data starts at the beginning of its segment, so there's no room for a landing pad in
+    // front of it.  Instead, put a two-word pad somewhere else:  a list reference describing the
+    // data, then a far reference to where it starts.
+    WordCount padSize = 2 * REFERENCE_SIZE_IN_WORDS;
+    word* pad = segment->allocate(padSize);
+    if (pad == nullptr) {
+      pad = arena->allocateFreedSpace(segment, padSize);
+    }
+    while (pad == nullptr) {
+      // allocate() can only fail here if the message is being built concurrently and some other
+      // thread got to the space first.
+      segment = arena->getSegmentWithAvailable(padSize);
+      pad = segment->allocate(padSize);
+    }
+    arena->countAllocation(padSize);
+    arena->countFarReference();
+
+    WireReference* tag = reinterpret_cast<WireReference*>(pad);
+    tag->setLandingPad(WireReference::LIST, true);
+    tag->listRef.set(FieldSize::BYTE, size * (1 * ELEMENTS / BYTES));
+
+    WireReference* far2 = tag + 1;
+    far2->setKindAndPositionInSegment(WireReference::FAR, 0 * WORDS);
+    far2->farRef.set(dataSegment->getSegmentId());
+
+    ref->setKindAndPositionInSegment(WireReference::FAR, segment->getOffsetTo(pad));
+    ref->farRef.set(segment->getSegmentId());
   }
 
   static CAPNPROTO_ALWAYS_INLINE(Data::Builder getWritableDataReference(
       WireReference* ref, SegmentBuilder* segment,
       const void* defaultValue, ByteCount defaultSize)) {
     if (ref->isNull()) {
+      segment->getArena()->countDefaultValueCopy();
       Data::Builder builder = initDataReference(ref, segment, defaultSize);
       builder.copyFrom(defaultValue);
       return builder;
@@ -606,6 +1496,8 @@ struct WireHelpers {
           "Called getData{Field,Element}() but existing reference is not a list.");
       CAPNPROTO_ASSERT(ref->listRef.elementSize() == FieldSize::BYTE,
           "Called getData{Field,Element}() but existing list reference is not byte-sized.");
+      CAPNPROTO_ASSERT(!segment->isExternal(),
+          "Data set with setExternalDataField() can't be modified through a builder.");
 
       return Data::Builder(reinterpret_cast<char*>(ptr), ref->listRef.elementCount() / ELEMENTS);
     }
@@ -951,6 +1843,20 @@ StructBuilder StructBuilder::getRoot(
       reinterpret_cast<WireReference*>(location), segment, defaultValue);
 }
 
+void StructBuilder::setRoot(SegmentBuilder* segment, word* location, const StructReader& value) {
+  WireHelpers::setStructReference(reinterpret_cast<WireReference*>(location), segment, value);
+}
+
+WordCount StructBuilder::compactedRootSize(SegmentBuilder* segment, word* location) {
+  return WireHelpers::liveSize(segment, reinterpret_cast<WireReference*>(location));
+}
+
+void StructBuilder::compactRoot(SegmentBuilder* srcSegment, word* srcLocation,
+                                SegmentBuilder* dstSegment, word* dstLocation) {
+  WireHelpers::copyCompacted(dstSegment, reinterpret_cast<WireReference*>(dstLocation),
+                             srcSegment, reinterpret_cast<WireReference*>(srcLocation));
+}
+
 StructBuilder StructBuilder::initStructField(
     WireReferenceCount refIndex, const word* typeDefaultValue) const {
   return WireHelpers::initStructReference(references + refIndex, segment, typeDefaultValue);
@@ -981,6 +1887,15 @@ ListBuilder StructBuilder::getListField(
       references + refIndex, segment, defaultValue);
 }
 
+void StructBuilder::setStructField(WireReferenceCount refIndex, const StructReader& value) const {
+  WireHelpers::setStructReference(references + refIndex, segment, value);
+}
+
+void StructBuilder::setListField(WireReferenceCount refIndex, FieldSize elementSize,
+                                 const ListReader& value) const {
+  WireHelpers::setListReference(references + refIndex, segment, elementSize, value);
+}
+
 Text::Builder StructBuilder::initTextField(WireReferenceCount refIndex, ByteCount size) const {
   return WireHelpers::initTextReference(references + refIndex, segment, size);
 }
@@ -999,6 +1914,10 @@ Data::Builder StructBuilder::initDataField(WireReferenceCount refIndex, ByteCoun
 void StructBuilder::setDataField(WireReferenceCount refIndex, Data::Reader value) const {
   WireHelpers::setDataReference(references + refIndex, segment, value);
 }
+void StructBuilder::setExternalDataField(WireReferenceCount refIndex, ArrayPtr<const word> words,
+                                         ByteCount size) const {
+  WireHelpers::setExternalDataReference(references + refIndex, segment, words, size);
+}
 Data::Builder StructBuilder::getDataField(
     WireReferenceCount refIndex, const void* defaultValue, ByteCount defaultSize) const {
   return WireHelpers::getWritableDataReference(
@@ -1057,6 +1976,14 @@ Data::Reader StructReader::getDataField(
   return WireHelpers::readDataReference(segment, ref, defaultValue, defaultSize);
 }
 
+MessageSize StructReader::totalSize() const {
+  return WireHelpers::totalSize(WireHelpers::structReaderObject(*this));
+}
+
+void StructReader::prefetchTargets() const {
+  WireHelpers::prefetchTargets(references, referenceCount);
+}
+
 StructBuilder ListBuilder::getStructElement(
     ElementCount index, decltype(WORDS/ELEMENTS) elementSize, WordCount structDataSize) const {
   word* structPtr = ptr + elementSize * index;
@@ -1123,6 +2050,111 @@ ListReader ListBuilder::asReader(WordCount dataSize, WireReferenceCount referenc
       dataSize, referenceCount, std::numeric_limits<int>::max());
 }
 
+namespace {
+
+// Helpers for working on bool lists a word at a time.  Element i of a packed bool list is bit
+// i % 64 of word i / 64, and the bits past the last element are zero.
+
+inline uint64_t lowBits(uint count) {
+  // The mask of the lowest `count` bits, 0 <= count < 64.
+  return (uint64_t(1) << count) - 1;
+}
+
+struct AndBits {
+  inline uint64_t operator()(uint64_t a, uint64_t b) const { return a & b; }
+};
+
+struct OrBits {
+  inline uint64_t operator()(uint64_t a, uint64_t b) const { return a | b; }
+};
+
+}  // namespace
+
+template <typename Combine>
+void ListBuilder::combineBits(const ListReader& other, Combine combine) const {
+  uint count = elementCount / ELEMENTS;
+  uint otherCount = std::min(count, other.elementCount / ELEMENTS);
+
+  if (other.stepBits * (1 * ELEMENTS) == 1 * BITS) {
+    WireValue<uint64_t>* words = reinterpret_cast<WireValue<uint64_t>*>(ptr);
+    const WireValue<uint64_t>* otherWords =
+        reinterpret_cast<const WireValue<uint64_t>*>(other.ptr);
+
+    uint i = 0;
+    for (; i < otherCount / 64; i++) {
+      words[i].set(combine(words[i].get(), otherWords[i].get()));
+    }
+    if (otherCount % 64 != 0) {
+      words[i].set(combine(words[i].get(), otherWords[i].get() & lowBits(otherCount % 64)));
+      ++i;
+    }
+    for (; i < (count + 63) / 64; i++) {
+      words[i].set(combine(words[i].get(), 0));
+    }
+  } else {
+    for (uint i = 0; i < count; i++) {
+      bool otherBit = i < otherCount && other.getDataElement<bool>(i * ELEMENTS);
+      setDataElement<bool>(i * ELEMENTS,
+          combine(getDataElement<bool>(i * ELEMENTS), otherBit) != 0);
+    }
+  }
+}
+
+void ListBuilder::andBits(const ListReader& other) const {
+  combineBits(other, AndBits());
+}
+
+void ListBuilder::orBits(const ListReader& other) const {
+  combineBits(other, OrBits());
+}
+
+ElementCount ListReader::countSetBits() const {
+  uint count = elementCount / ELEMENTS;
+  uint result = 0;
+
+  if (stepBits * (1 * ELEMENTS) == 1 * BITS) {
+    const WireValue<uint64_t>* words = reinterpret_cast<const WireValue<uint64_t>*>(ptr);
+    for (uint i = 0; i < count / 64; i++) {
+      result += __builtin_popcountll(words[i].get());
+    }
+    if (count % 64 != 0) {
+      result += __builtin_popcountll(words[count / 64].get() & lowBits(count % 64));
+    }
+  } else {
+    for (uint i = 0; i < count; i++) {
+      result += getDataElement<bool>(i * ELEMENTS);
+    }
+  }
+
+  return result * ELEMENTS;
+}
+
+ElementCount ListReader::findBit(ElementCount start, bool value) const {
+  uint count = elementCount / ELEMENTS;
+  uint i = start / ELEMENTS;
+
+  if (stepBits * (1 * ELEMENTS) == 1 * BITS) {
+    const WireValue<uint64_t>* words = reinterpret_cast<const WireValue<uint64_t>*>(ptr);
+    uint64_t flip = value ? 0 : ~uint64_t(0);
+    while (i < count) {
+      uint64_t bits = (words[i / 64].get() ^ flip) >> (i % 64);
+      if (bits != 0) {
+        // When looking for false, the zero padding past the end of the list shows up as a match.
+        return std::min(count, i + __builtin_ctzll(bits)) * ELEMENTS;
+      }
+      i = (i / 64 + 1) * 64;
+    }
+  } else {
+    for (; i < count; i++) {
+      if (getDataElement<bool>(i * ELEMENTS) == value) {
+        return i * ELEMENTS;
+      }
+    }
+  }
+
+  return elementCount;
+}
+
 StructReader ListReader::getStructElement(ElementCount index, const word* defaultValue) const {
   if (CAPNPROTO_EXPECT_FALSE((segment != nullptr) & (nestingLimit == 0))) {
     segment->getArena()->reportInvalidData(
@@ -1145,6 +2177,27 @@ ListReader ListReader::getListElement(
       nullptr, expectedElementSize, nestingLimit);
 }
 
+MessageSize ListReader::totalSize(FieldSize elementSize) const {
+  return WireHelpers::totalSize(WireHelpers::listReaderObject(elementSize, *this));
+}
+
+void ListReader::prefetchStructElementTargets(ElementCount index) const {
+  if (index < elementCount) {
+    BitCount64 indexBit = ElementCount64(index) * stepBits;
+    const byte* structPtr = reinterpret_cast<const byte*>(ptr) + indexBit / BITS_PER_BYTE;
+    WireHelpers::prefetchTargets(
+        reinterpret_cast<const WireReference*>(structPtr + structDataSize * BYTES_PER_WORD),
+        structReferenceCount);
+  }
+}
+
+void ListReader::prefetchReferenceTarget(WireReferenceCount index) const {
+  if (index * (1 * ELEMENTS / REFERENCES) < elementCount) {
+    WireHelpers::prefetchTargets(reinterpret_cast<const WireReference*>(ptr) + index,
+                                 1 * REFERENCES);
+  }
+}
+
 Text::Reader ListReader::getTextElement(WireReferenceCount index) const {
   return WireHelpers::readTextReference(segment,
       reinterpret_cast<const WireReference*>(ptr) + index, "", 0 * BYTES);
@@ -1155,5 +2208,450 @@ Data::Reader ListReader::getDataElement(WireReferenceCount index) const {
       reinterpret_cast<const WireReference*>(ptr) + index, nullptr, 0 * BYTES);
 }
 
+// =======================================================================================
+
+namespace {
+
+class MessageValidator {
+public:
+  MessageValidator(Arena* arena, uint nestingLimit): arena(arena), nestingLimit(nestingLimit) {}
+
+  bool validate(SegmentReader* rootSegment) {
+    const word* root = rootSegment->getStartPtr();
+    if (!claim(rootSegment, root, 1, "Root location out-of-bounds.")) {
+      return false;
+    }
+    push(rootSegment, root, 1, 1, 0, 0);
+
+    while (!pending.empty()) {
+      PendingReferences& top = pending.back();
+      if (top.refsLeft == 0) {
+        if (top.elementsLeft == 0) {
+          pending.pop_back();
+          continue;
+        }
+        // Move on to the next element of a struct list.
+        --top.elementsLeft;
+        top.refsLeft = top.refsPerElement;
+        top.next = reinterpret_cast<const WireReference*>(
+            reinterpret_cast<const word*>(top.next - top.refsPerElement) +
+            top.elementStride * WORDS);
+      }
+
+      // Copy what we need, since checking the reference may push onto `pending` and move `top`.
+      SegmentReader* segment = top.segment;
+      const WireReference* ref = top.next++;
+      uint depth = top.depth;
+      --top.refsLeft;
+
+      if (!check(segment, ref, depth)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+private:
+  struct PendingReferences {
+    // References that still need to be checked:  `refsLeft` more starting at `next`, then, for a
+    // struct list, `refsPerElement` more in each of the following `elementsLeft` elements, which
+    // are `elementStride` words apart.
+
+    SegmentReader* segment;
+    const WireReference* next;
+    uint refsLeft;
+    uint elementsLeft;
+    uint elementStride;
+    uint depth;
+    // How deep the references are nested, counted the way StructReader and ListReader count down
+    // their nestingLimit.
+
+    uint refsPerElement;
+  };
+
+  Arena* arena;
+  uint nestingLimit;
+  std::vector<PendingReferences> pending;
+
+  std::vector<std::vector<uint64_t>> claimed;
+  // For each segment ID, one bit per word of the segment, set once the word is known to belong to
+  // an object.
+
+  bool fail(const char* description) {
+    arena->reportInvalidData(description);
+    return false;
+  }
+
+  bool claim(SegmentReader* segment, const word* from, uint64_t size,
+             const char* outOfBoundsDescription) {
+    // Checks that `size` words starting at `from` are inside the segment and don't belong to any
+    // other object, then marks them as belonging to this one.
+
+    ArrayPtr<const word> bounds = segment->getArray();
+    if (from < bounds.begin() || from > bounds.end() ||
+        size > uint64_t(bounds.end() - from)) {
+      return fail(outOfBoundsDescription);
+    }
+
+    uint id = segment->getSegmentId().value;
+    if (id >= claimed.size()) {
+      claimed.resize(id + 1);
+    }
+    std::vector<uint64_t>& bits = claimed[id];
+    if (bits.empty()) {
+      bits.resize(bounds.size() / 64 + 1);
+    }
+
+    size_t offset = from - bounds.begin();
+    while (size > 0) {
+      uint shift = offset % 64;
+      uint count = std::min<uint64_t>(64 - shift, size);
+      uint64_t mask = (count == 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1) << shift;
+      uint64_t& chunk = bits[offset / 64];
+      if (CAPNPROTO_EXPECT_FALSE(chunk & mask)) {
+        return fail("Message contains overlapping objects.");
+      }
+      chunk |= mask;
+      offset += count;
+      size -= count;
+    }
+
+    return true;
+  }
+
+  bool checkDepth(uint depth) {
+    if (CAPNPROTO_EXPECT_FALSE(depth >= nestingLimit)) {
+      return fail("Message is too deeply-nested or contains cycles.  See capnproto::ReadOptions.");
+    }
+    return true;
+  }
+
+  void push(SegmentReader* segment, const word* refs, uint refsPerElement, uint elementCount,
+            uint elementStride, uint depth) {
+    pending.push_back(PendingReferences {
+        segment, reinterpret_cast<const WireReference*>(refs), refsPerElement,
+        elementCount - 1, elementStride, depth, refsPerElement });
+  }
+
+  bool check(SegmentReader* segment, const WireReference* ref, uint depth) {
+    if (ref->isNull()) {
+      return true;
+    }
+
+    if (!checkDepth(depth)) {
+      return false;
+    }
+
+    const word* ptr;
+    if (ref->kind() == WireReference::FAR) {
+      // Same as WireHelpers::followFars(), but the landing pads are claimed too.
+      segment = arena->tryGetSegment(ref->farRef.segmentId.get());
+      if (CAPNPROTO_EXPECT_FALSE(segment == nullptr)) {
+        return fail("Message contains invalid far reference.");
+      }
+
+      const word* pad = segment->getStartPtr() + ref->positionInSegment();
+      if (!claim(segment, pad, 1, "Message contains invalid far reference.")) {
+        return false;
+      }
+      ref = reinterpret_cast<const WireReference*>(pad);
+
+      if (ref->landingPadIsFollowedByAnotherReference()) {
+        if (!claim(segment, pad + REFERENCE_SIZE_IN_WORDS, 1,
+                   "Message contains invalid far reference.")) {
+          return false;
+        }
+        const WireReference* far2 = ref + 1;
+        if (CAPNPROTO_EXPECT_FALSE(far2->kind() != WireReference::FAR)) {
+          return fail("Message contains invalid far reference.");
+        }
+        segment = arena->tryGetSegment(far2->farRef.segmentId.get());
+        if (CAPNPROTO_EXPECT_FALSE(segment == nullptr)) {
+          return fail("Message contains invalid far reference.");
+        }
+        ptr = segment->getStartPtr() + far2->positionInSegment();
+      } else {
+        ptr = pad + REFERENCE_SIZE_IN_WORDS;
+      }
+    } else {
+      ptr = ref->target();
+    }
+
+    switch (ref->kind()) {
+      case WireReference::STRUCT: {
+        if (!claim(segment, ptr, ref->structRef.wordSize() / WORDS,
+                   "Message contained out-of-bounds struct reference.")) {
+          return false;
+        }
+        uint refCount = ref->structRef.refCount.get() / REFERENCES;
+        if (refCount > 0) {
+          push(segment, ptr + ref->structRef.dataSize.get(), refCount, 1, 0, depth + 1);
+        }
+        return true;
+      }
+
+      case WireReference::LIST:
+        break;
+
+      case WireReference::FAR:
+        return fail("Message contains invalid far reference.");
+
+      default:
+        return fail("Message contains reference of unknown kind.");
+    }
+
+    uint elementCount = ref->listRef.elementCount() / ELEMENTS;
+
+    switch (ref->listRef.elementSize()) {
+      case FieldSize::INLINE_COMPOSITE: {
+        uint64_t wordCount = ref->listRef.inlineCompositeWordCount() / WORDS;
+        if (!claim(segment, ptr, REFERENCE_SIZE_IN_WORDS / WORDS + wordCount,
+                   "Message contains out-of-bounds list reference.")) {
+          return false;
+        }
+
+        const WireReference* tag = reinterpret_cast<const WireReference*>(ptr);
+        if (CAPNPROTO_EXPECT_FALSE(tag->kind() != WireReference::STRUCT)) {
+          return fail("INLINE_COMPOSITE lists of non-STRUCT type are not supported.");
+        }
+
+        uint64_t size = tag->inlineCompositeListElementCount() / ELEMENTS;
+        uint wordsPerElement = tag->structRef.wordSize() / WORDS;
+        if (CAPNPROTO_EXPECT_FALSE(size * wordsPerElement > wordCount)) {
+          return fail("INLINE_COMPOSITE list's elements overrun its word count.");
+        }
+
+        if (size > 0) {
+          // Getting an element uses up a level of nesting, before its references use up another.
+          if (!checkDepth(depth + 1)) {
+            return false;
+          }
+          uint refCount = tag->structRef.refCount.get() / REFERENCES;
+          if (refCount > 0) {
+            push(segment, ptr + REFERENCE_SIZE_IN_WORDS + tag->structRef.dataSize.get(),
+                 refCount, size, wordsPerElement, depth + 2);
+          }
+        }
+        return true;
+      }
+
+      case FieldSize::REFERENCE:
+        if (!claim(segment, ptr, elementCount, "Message contained out-of-bounds list reference.")) {
+          return false;
+        }
+        if (elementCount > 0) {
+          push(segment, ptr, elementCount, 1, 0, depth + 1);
+        }
+        return true;
+
+      default: {
+        uint64_t bits = uint64_t(elementCount) * (bitsPerElement(ref->listRef.elementSize()) *
+            (1 * ELEMENTS) / BITS);
+        return claim(segment, ptr, (bits + 63) / 64,
+                     "Message contained out-of-bounds list reference.");
+      }
+    }
+  }
+};
+
+}  // namespace
+
+bool validateMessage(SegmentReader* rootSegment, int nestingLimit) {
+  // A non-positive limit rejects everything, as it does for the readers.
+  MessageValidator validator(rootSegment->getArena(), nestingLimit < 0 ? 0 : nestingLimit);
+  return validator.validate(rootSegment);
+}
+
+// =======================================================================================
+
+namespace {
+
+class MessageCanonicalizer {
+public:
+  explicit MessageCanonicalizer(int nestingLimit): nestingLimit(nestingLimit) {}
+
+  Array<word> canonicalize(SegmentReader* rootSegment) {
+    output.assign(1, 0);
+    pending.push_back(PendingReference {
+        rootSegment, reinterpret_cast<const WireReference*>(rootSegment->getStartPtr()),
+        0, nestingLimit });
+
+    while (!pending.empty()) {
+      PendingReference ref = pending.back();
+      pending.pop_back();
+      write(ref);
+    }
+
+    Array<word> result = newArray<word>(output.size());
+    memcpy(result.begin(), at(0), output.size() * sizeof(word));
+    return result;
+  }
+
+private:
+  struct PendingReference {
+    // A reference in the source whose target hasn't been written yet.  `dst` is the index in
+    // `output` of the (so far zeroed) word where the reference to the copy belongs.
+
+    SegmentReader* segment;
+    const WireReference* src;
+    size_t dst;
+    int nestingLimit;
+  };
+
+  int nestingLimit;
+  std::vector<uint64_t> output;  // Words, but std::vector needs a copyable type.
+  std::vector<PendingReference> pending;
+  // References are popped in the order they appear in the source, and each one's target is
+  // written (and its own references pushed) before the next is popped, so objects come out in
+  // preorder.
+
+  word* at(size_t index) {
+    return reinterpret_cast<word*>(output.data()) + index;
+  }
+
+  WireReference* refAt(size_t index) {
+    return reinterpret_cast<WireReference*>(at(index));
+  }
+
+  size_t append(WordCount amount) {
+    // Adds `amount` zeroed words to the output and returns the index of the first.
+    size_t pos = output.size();
+    output.resize(pos + amount / WORDS, 0);
+    return pos;
+  }
+
+  static WordCount trimmedDataSize(const word* data, WordCount dataSize) {
+    while (dataSize > 0 * WORDS &&
+           reinterpret_cast<const WireValue<uint64_t>*>(data + dataSize - 1 * WORDS)->get() == 0) {
+      dataSize -= 1 * WORDS;
+    }
+    return dataSize;
+  }
+
+  static WireReferenceCount trimmedRefCount(const word* refs, WireReferenceCount refCount) {
+    while (refCount > 0 * REFERENCES &&
+           reinterpret_cast<const WireReference*>(refs)[refCount / REFERENCES - 1].isNull()) {
+      refCount -= 1 * REFERENCES;
+    }
+    return refCount;
+  }
+
+  void pushRefs(SegmentReader* segment, const word* src, size_t dst, uint count,
+                int nestingLimit) {
+    // Pushed in reverse so that they pop in order.
+    const WireReference* refs = reinterpret_cast<const WireReference*>(src);
+    for (uint i = count; i > 0; i--) {
+      if (!refs[i - 1].isNull()) {
+        pending.push_back(PendingReference { segment, refs + i - 1, dst + i - 1, nestingLimit });
+      }
+    }
+  }
+
+  void write(const PendingReference& ref) {
+    if (ref.src->isNull()) {
+      return;
+    }
+
+    WireHelpers::CopiedObject object;
+    if (!WireHelpers::resolveCopySource(ref.segment, ref.src, ref.nestingLimit, object)) {
+      // Treated as null, like the readers do.
+      return;
+    }
+
+    if (object.kind == WireReference::STRUCT) {
+      WordCount dataSize = trimmedDataSize(object.src, object.dataSize);
+      WireReferenceCount refCount =
+          trimmedRefCount(object.src + object.dataSize, object.refCount);
+
+      if (dataSize == 0 * WORDS && refCount == 0 * REFERENCES) {
+        // An empty struct isn't null, so it gets an offset of -1 rather than zero.
+        refAt(ref.dst)->setKindAndTarget(WireReference::STRUCT,
+            reinterpret_cast<word*>(refAt(ref.dst)));
+        return;
+      }
+
+      size_t pos = append(dataSize + refCount * WORDS_PER_REFERENCE);
+      memcpy(at(pos), object.src, dataSize * BYTES_PER_WORD / BYTES);
+      refAt(ref.dst)->setKindAndTarget(WireReference::STRUCT, at(pos));
+      refAt(ref.dst)->structRef.set(dataSize, refCount);
+      pushRefs(object.segment, object.src + object.dataSize, pos + dataSize / WORDS,
+               refCount / REFERENCES, object.nestingLimit);
+      return;
+    }
+
+    switch (object.elementSize) {
+      case FieldSize::REFERENCE: {
+        uint count = object.elementCount / ELEMENTS;
+        size_t pos = append(count * REFERENCES * WORDS_PER_REFERENCE);
+        refAt(ref.dst)->setKindAndTarget(WireReference::LIST, at(pos));
+        refAt(ref.dst)->listRef.set(FieldSize::REFERENCE, object.elementCount);
+        pushRefs(object.segment, object.src, pos, count, object.nestingLimit);
+        return;
+      }
+
+      case FieldSize::INLINE_COMPOSITE: {
+        // Every element is trimmed to the size of the largest.
+        uint count = object.elementCount / ELEMENTS;
+        WordCount srcStride = object.dataSize + object.refCount * WORDS_PER_REFERENCE;
+        WordCount dataSize = 0 * WORDS;
+        WireReferenceCount refCount = 0 * REFERENCES;
+        const word* element = object.src;
+        for (uint i = 0; i < count; i++) {
+          dataSize = std::max(dataSize, trimmedDataSize(element, object.dataSize));
+          refCount = std::max(refCount,
+              trimmedRefCount(element + object.dataSize, object.refCount));
+          element += srcStride;
+        }
+
+        WordCount stride = dataSize + refCount * WORDS_PER_REFERENCE;
+        size_t pos = append(REFERENCE_SIZE_IN_WORDS + count * stride);
+        refAt(ref.dst)->setKindAndTarget(WireReference::LIST, at(pos));
+        refAt(ref.dst)->listRef.setInlineComposite(count * stride);
+        refAt(pos)->setKindAndInlineCompositeListElementCount(
+            WireReference::STRUCT, object.elementCount);
+        refAt(pos)->structRef.set(dataSize, refCount);
+
+        // Getting an element uses up a level of nesting, before its references use up another.
+        size_t dst = pos + REFERENCE_SIZE_IN_WORDS / WORDS + count * (stride / WORDS);
+        element = object.src + count * srcStride;
+        for (uint i = count; i > 0; i--) {
+          element -= srcStride;
+          dst -= stride / WORDS;
+          memcpy(at(dst), element, dataSize * BYTES_PER_WORD / BYTES);
+          pushRefs(object.segment, element + object.dataSize, dst + dataSize / WORDS,
+                   refCount / REFERENCES, object.nestingLimit - 1);
+        }
+        return;
+      }
+
+      default: {
+        size_t pos = append(object.size);
+        memcpy(at(pos), object.src, object.size * BYTES_PER_WORD / BYTES);
+
+        // Zero any padding after the last element.
+        uint64_t bits = uint64_t(object.elementCount / ELEMENTS) *
+            (bitsPerElement(object.elementSize) * (1 * ELEMENTS) / BITS);
+        if (bits % 64 != 0) {
+          WireValue<uint64_t>* last = reinterpret_cast<WireValue<uint64_t>*>(
+              at(pos) + object.size - 1 * WORDS);
+          last->set(last->get() & ((uint64_t(1) << (bits % 64)) - 1));
+        }
+
+        refAt(ref.dst)->setKindAndTarget(WireReference::LIST, at(pos));
+        refAt(ref.dst)->listRef.set(object.elementSize, object.elementCount);
+        return;
+      }
+    }
+  }
+};
+
+}  // namespace
+
+Array<word> canonicalizeMessage(SegmentReader* rootSegment, int nestingLimit) {
+  MessageCanonicalizer canonicalizer(nestingLimit);
+  return canonicalizer.canonicalize(rootSegment);
+}
+
 }  // namespace internal
 }  // namespace capnproto
@@ -36,6 +36,20 @@
 #include "blob.h"
 
 namespace capnproto {
+
+struct MessageSize {
+  // Size of an object and everything it references, as returned by the readers' totalSize().
+
+  uint64_t wordCount;
+  // Words needed to hold a copy, not counting the reference to it.  This is exactly how much
+  // StructBuilder::setStructField() and setListField() allocate to copy the object, so a
+  // MallocMessageBuilder whose first segment is wordCount + 1 words (the extra word holding the
+  // root reference) can hold a copy of a struct in one segment.
+
+  uint64_t referenceCount;
+  // Number of non-null references followed, not counting the reference to the object itself.
+};
+
 namespace internal {
 
 class StructBuilder;
@@ -95,6 +109,9 @@ enum class FieldSize: uint8_t {
   //    time it is not supported.
 };
 
+static constexpr uint MAX_SEGMENT_WORDS = 1u << 29;
+// Largest segment that can be addressed by a pointer:  4 GiB.
+
 typedef decltype(BITS / ELEMENTS) BitsPerElement;
 
 namespace internal {
@@ -157,6 +174,20 @@ public:
   static StructBuilder initRoot(SegmentBuilder* segment, word* location, const word* defaultValue);
   static StructBuilder getRoot(SegmentBuilder* segment, word* location, const word* defaultValue);
 
+  static void setRoot(SegmentBuilder* segment, word* location, const StructReader& value);
+  // Sets the root reference at `location` to a deep copy of `value`, as setStructField() does.
+
+  static WordCount compactedRootSize(SegmentBuilder* segment, word* location);
+  // Returns the number of words that compactRoot() will need to copy the objects reachable from
+  // the root reference at `location`, not counting the root reference itself.
+
+  static void compactRoot(SegmentBuilder* srcSegment, word* srcLocation,
+                          SegmentBuilder* dstSegment, word* dstLocation);
+  // Deep-copies the objects reachable from the root reference at `srcLocation` into `dstSegment`,
+  // writing the new root reference to `dstLocation`.  `dstSegment` must have at least
+  // compactedRootSize() words available.  Unreachable space and far-reference landing pads in the
+  // source are skipped, and the copy contains no far references.
+
   template <typename T>
   CAPNPROTO_ALWAYS_INLINE(T getDataField(ElementCount offset) const);
   // Gets the data field value of the given type at the given offset.  The offset is measured in
@@ -196,6 +227,23 @@ public:
   // already allocated, it is allocated as a deep copy of the given default value (a trusted
   // message).  If the default value is null, an empty list is used.
 
+  void setStructField(WireReferenceCount refIndex, const StructReader& value) const;
+  // Sets the struct field at the given index to a deep copy of `value`, which may belong to any
+  // message.  The copy is done without recursion and without far references inside it:  the
+  // source is first walked to find every object it references, and then all of them are copied
+  // into a single allocation.  References that a reader would refuse to follow (out-of-bounds,
+  // too deeply nested, etc.) are reported like any other invalid data and copied as null.
+  // `value` may come from this same message, even from the object being overwritten or from the
+  // struct that contains the field:  if overwritten objects are being zeroed (see
+  // MessageBuilder::enableOverwriteZeroing()), the old object is only zeroed once the copy is
+  // done.  It must come from a reader, though (a builder's asReader() doesn't know the real size
+  // of the struct).
+
+  void setListField(WireReferenceCount refIndex, FieldSize elementSize,
+                    const ListReader& value) const;
+  // Like setStructField(), but for lists.  `elementSize` is the element size `value` was read
+  // with.
+
   Text::Builder initTextField(WireReferenceCount refIndex, ByteCount size) const;
   // Initialize the text field to the given size in bytes (not including NUL terminator) and return
   // a Text::Builder which can be used to fill in the content.
@@ -213,6 +261,15 @@ public:
                              const void* defaultValue, ByteCount defaultSize) const;
   // Same as *Text*, but for data blobs.
 
+  void setExternalDataField(WireReferenceCount refIndex, ArrayPtr<const word> words,
+                            ByteCount size) const;
+  // Set the data field to the first `size` bytes of `words` without copying them:  `words` becomes
+  // a segment of its own (see BuilderArena::addExternalSegment()), reached through a double-far
+  // landing pad, and is written out straight from the caller's memory.  `words` must stay valid
+  // and unchanged while the message is in use, and can't be modified through the builder.  Any
+  // bytes between `size` and the end of the last word are written out as they are, so zero them
+  // if the message must be canonical.
+
   StructReader asReader() const;
   // Gets a StructReader pointing at the same memory.
 
@@ -263,6 +320,19 @@ public:
                             const void* defaultValue, ByteCount defaultSize) const;
   // Gets the data field, or the given default value if not initialized.
 
+  MessageSize totalSize() const;
+  // Adds up the size of this struct and everything reachable from it, without recursion.
+  // References that a getter would refuse to follow are reported and not counted.
+
+  CAPNPROTO_ALWAYS_INLINE(void prefetch() const);
+  // Hints that this struct's data and references will be read soon.  Getting a StructReader
+  // doesn't touch the struct's memory, so this can be issued well before the first field is read.
+
+  void prefetchTargets() const;
+  // Hints that the objects this struct references will be read soon.  This has to read the
+  // references themselves, so it stalls unless the struct is already in cache (e.g. because
+  // prefetch() was called a while ago).  Far references are not followed.
+
 private:
   SegmentReader* segment;  // Memory segment in which the struct resides.
 
@@ -311,6 +381,11 @@ public:
       ElementCount index, typename NoInfer<T>::Type value) const);
   // Set the element at the given index.
 
+  template <typename T>
+  CAPNPROTO_ALWAYS_INLINE(ArrayPtr<T> getDataArray() const);
+  // Get all the elements as an array of T, which can be written directly.  Not for Void or bool
+  // lists, which are not laid out as C arrays.
+
   StructBuilder getStructElement(
       ElementCount index, decltype(WORDS/ELEMENTS) elementSize, WordCount structDataSize) const;
   // Get the struct element at the given index.  elementSize is the size, in 64-bit words, of
@@ -352,6 +427,16 @@ public:
   ListReader asReader(WordCount dataSize, WireReferenceCount referenceCount) const;
   // Get a ListReader pointing at the same memory.  Use this version only for struct lists.
 
+  CAPNPROTO_ALWAYS_INLINE(void setBitWord(uint index, uint64_t bits) const);
+  // For bool lists:  sets the 64 elements starting at 64 * index all at once, element
+  // 64 * index + i to bit i of `bits`.  Bits for elements past the end of the list must be zero.
+
+  void andBits(const ListReader& other) const;
+  void orBits(const ListReader& other) const;
+  // For bool lists:  sets each element to itself AND / OR the corresponding element of `other`,
+  // a word at a time unless `other` was upgraded to a list of structs.  Elements past the end of
+  // `other` count as false.
+
 private:
   SegmentBuilder* segment;  // Memory segment in which the list resides.
   word* ptr;  // Pointer to the beginning of the list.
@@ -360,6 +445,9 @@ private:
   inline ListBuilder(SegmentBuilder* segment, word* ptr, ElementCount size)
       : segment(segment), ptr(ptr), elementCount(size) {}
 
+  template <typename Combine>
+  void combineBits(const ListReader& other, Combine combine) const;
+
   friend class StructBuilder;
   friend struct WireHelpers;
 };
@@ -378,6 +466,12 @@ public:
   CAPNPROTO_ALWAYS_INLINE(T getDataElement(ElementCount index) const);
   // Get the element of the given type at the given index.
 
+  template <typename T>
+  CAPNPROTO_ALWAYS_INLINE(ArrayPtr<const T> getDataArray() const);
+  // If the elements are packed back to back as Ts -- always the case unless the sender upgraded
+  // the list to a list of structs -- get them as an array which can be read directly.  Otherwise,
+  // returns an empty array.  Not for Void or bool lists, which are not laid out as C arrays.
+
   StructReader getStructElement(ElementCount index, const word* defaultValue) const;
   // Get the struct element at the given index.
 
@@ -390,6 +484,29 @@ public:
   Data::Reader getDataElement(WireReferenceCount index) const;
   // Get the data element.  If it is not initialized, returns an empty Data::Reader.
 
+  MessageSize totalSize(FieldSize elementSize) const;
+  // Like StructReader::totalSize().  `elementSize` is the element size the list was read with.
+
+  ElementCount countSetBits() const;
+  // For bool lists:  the number of elements that are true.  Works a word at a time unless the
+  // list was upgraded to a list of structs.
+
+  ElementCount findBit(ElementCount start, bool value) const;
+  // For bool lists:  the index of the first element at or after `start` that equals `value`, or
+  // size() if there is none.  Works a word at a time like countSetBits().
+
+  CAPNPROTO_ALWAYS_INLINE(void prefetchElement(ElementCount index) const);
+  // Hints that the element at the given index will be read soon.  Does nothing if the index is out
+  // of range, so callers can prefetch past the end of the list without checking.
+
+  void prefetchStructElementTargets(ElementCount index) const;
+  // Like StructReader::prefetchTargets() for the struct element at the given index.  Does nothing
+  // if the index is out of range.
+
+  void prefetchReferenceTarget(WireReferenceCount index) const;
+  // For a list of references (lists, text, or data), hints that the object referenced by the
+  // element at the given index will be read soon.  Does nothing if the index is out of range.
+
 private:
   SegmentReader* segment;  // Memory segment in which the list resides.
 
@@ -431,6 +548,47 @@ private:
   friend struct WireHelpers;
 };
 
+// -------------------------------------------------------------------
+
+struct ReaderAccess {
+  // Lets generated code get at the internal reader behind a List or struct Reader, e.g. to
+  // deep-copy it with StructBuilder::setStructField().
+
+  template <typename Reader>
+  static inline StructReader getStructReader(const Reader& reader) { return reader._reader; }
+
+  template <typename Reader>
+  static inline ListReader getListReader(const Reader& reader) { return reader.reader; }
+};
+
+// -------------------------------------------------------------------
+
+bool validateMessage(SegmentReader* rootSegment, int nestingLimit);
+// Walks every object reachable from the root reference at the start of rootSegment, checking that
+// each reference is well-formed and in bounds, that nothing is nested more than nestingLimit deep
+// (counted the way StructReader and ListReader count it), and that no two objects (including far
+// reference landing pads) share any words.  The walk is iterative, so deep messages can't overflow
+// the stack.  Bounds are checked directly rather than with SegmentReader::containsInterval(), so
+// the walk doesn't use up the read limit.
+//
+// Reports the first problem found to the arena and returns false, or returns true if there were
+// none.  A message that passes can be read without bounds checks:  every pointer a reader can
+// follow lands inside its segment, and since no words are shared, the total amount that can be
+// traversed without reading the same field twice is no more than the size of the message.
+
+Array<word> canonicalizeMessage(SegmentReader* rootSegment, int nestingLimit);
+// Returns the canonical form of the message whose root reference is at the start of rootSegment:
+// a single segment starting with the root reference, with every object laid out in preorder
+// (each object immediately followed by everything it references, in order), no far references,
+// trailing zero data words and null references trimmed off every struct (and every element of a
+// struct list trimmed to the size of the largest), and the padding after the last element of a
+// primitive list zeroed.  Two messages with the same content have the same canonical form no
+// matter how they were built or split into segments, and the result can be read with
+// readMessageTrusted().  References a reader would refuse to follow, including ones nested more
+// than nestingLimit deep, are reported to the arena and written as null.  Iterative, like
+// validateMessage(), but reads through containsInterval(), so it counts against the read limit
+// unless the message has been validated.
+
 // =======================================================================================
 // Internal implementation details...
 
@@ -538,10 +696,41 @@ inline void ListBuilder::setDataElement<bool>(ElementCount index, bool value) co
 template <>
 inline void ListBuilder::setDataElement<Void>(ElementCount index, Void value) const {}
 
+inline void ListBuilder::setBitWord(uint index, uint64_t bits) const {
+  reinterpret_cast<WireValue<uint64_t>*>(ptr)[index].set(bits);
+}
+
+template <typename T>
+inline ArrayPtr<T> ListBuilder::getDataArray() const {
+  return arrayPtr(reinterpret_cast<T*>(ptr), elementCount / ELEMENTS);
+}
+
 // -------------------------------------------------------------------
 
+static constexpr uintptr_t CACHE_LINE_SIZE = 64;
+
+inline void prefetchBytes(const void* begin, const void* end) {
+  // Prefetches every cache line overlapping [begin, end).
+  uintptr_t pos = reinterpret_cast<uintptr_t>(begin) & ~(CACHE_LINE_SIZE - 1);
+  for (; pos < reinterpret_cast<uintptr_t>(end); pos += CACHE_LINE_SIZE) {
+    CAPNPROTO_PREFETCH(reinterpret_cast<const void*>(pos));
+  }
+}
+
+inline void StructReader::prefetch() const {
+  prefetchBytes(data, reinterpret_cast<const word*>(references) + referenceCount / REFERENCES);
+}
+
 inline ElementCount ListReader::size() { return elementCount; }
 
+inline void ListReader::prefetchElement(ElementCount index) const {
+  if (index < elementCount) {
+    BitCount64 indexBit = ElementCount64(index) * stepBits;
+    const byte* element = reinterpret_cast<const byte*>(ptr) + indexBit / BITS_PER_BYTE;
+    prefetchBytes(element, element + (stepBits * (1 * ELEMENTS) + 7 * BITS) / BITS_PER_BYTE);
+  }
+}
+
 template <typename T>
 inline T ListReader::getDataElement(ElementCount index) const {
   return *reinterpret_cast<const T*>(
@@ -560,6 +749,15 @@ inline Void ListReader::getDataElement<Void>(ElementCount index) const {
   return Void::VOID;
 }
 
+template <typename T>
+inline ArrayPtr<const T> ListReader::getDataArray() const {
+  if (stepBits * (1 * ELEMENTS) == sizeof(T) * BYTES * BITS_PER_BYTE) {
+    return arrayPtr(reinterpret_cast<const T*>(ptr), elementCount / ELEMENTS);
+  } else {
+    return nullptr;
+  }
+}
+
 }  // namespace internal
 }  // namespace capnproto
 
@@ -26,6 +26,7 @@
 
 #include "layout.h"
 #include <initializer_list>
+#include <string.h>
 
 namespace capnproto {
 
@@ -80,6 +81,14 @@ template <> struct FieldSizeForType<Data> {
   static constexpr FieldSize value = FieldSize::REFERENCE;
 };
 
+template <typename T> struct HasNativeLayout {
+  // Whether a list of T is laid out the same way as a C array of T, so that it can be accessed
+  // directly or with memcpy().  True for everything but Void and bool.  Like WireValue, this
+  // assumes a little-endian host.
+  static constexpr bool value = FieldSizeForType<T>::value != FieldSize::VOID &&
+                                FieldSizeForType<T>::value != FieldSize::BIT;
+};
+
 template <typename T>
 class TemporaryPointer {
   // This class is a little hack which lets us define operator->() in cases where it needs to
@@ -142,6 +151,68 @@ private:
   inline IndexingIterator(Container* container, uint index): container(container), index(index) {}
 };
 
+template <typename Container, typename Element>
+class PrefetchingRange {
+  // A view of a list which, as it is iterated, prefetches elements `distance` and `2 * distance`
+  // ahead of the current one.  The element furthest ahead is pulled into cache first; once it has
+  // had time to arrive, the objects it references (its text, lists, and sub-structs) are
+  // prefetched too, so that following them later doesn't stall on a dependent cache miss.
+  // Returned by prefetching() on lists whose elements are structs or references.  Holds a copy of
+  // the list reader, so it may outlive the list reader it came from.
+
+public:
+  class Iterator {
+  public:
+    Iterator() = default;
+
+    inline Element operator*() const { return range->container[index]; }
+    inline TemporaryPointer<Element> operator->() const {
+      return TemporaryPointer<Element>(range->container[index]);
+    }
+
+    inline Iterator& operator++() { range->prefetchAhead(++index); return *this; }
+    inline Iterator operator++(int) { Iterator other = *this; ++*this; return other; }
+
+    inline bool operator==(const Iterator& other) const { return index == other.index; }
+    inline bool operator!=(const Iterator& other) const { return index != other.index; }
+
+  private:
+    PrefetchingRange* range;
+    uint index;
+
+    friend class PrefetchingRange;
+    inline Iterator(PrefetchingRange* range, uint index): range(range), index(index) {}
+  };
+
+  typedef Iterator iterator;
+
+  inline iterator begin() {
+    for (uint i = 0; i < 2 * distance; i++) {
+      container.prefetchElement(i);
+    }
+    for (uint i = 0; i <= distance; i++) {
+      container.prefetchElementTargets(i);
+    }
+    return iterator(this, 0);
+  }
+  inline iterator end() { return iterator(this, container.size()); }
+
+private:
+  Container container;
+  uint distance;
+
+  inline void prefetchAhead(uint index) {
+    container.prefetchElement(index + 2 * distance);
+    container.prefetchElementTargets(index + distance);
+  }
+
+  friend Container;
+  inline PrefetchingRange(Container container, uint distance)
+      : container(container), distance(distance) {}
+};
+
+static constexpr uint DEFAULT_PREFETCH_DISTANCE = 8;
+
 }  // namespace internal
 
 template <typename T>
@@ -152,14 +223,62 @@ struct List<T, true> {
     inline explicit Reader(internal::ListReader reader): reader(reader) {}
 
     inline uint size() { return reader.size() / ELEMENTS; }
+    inline MessageSize totalSize() {
+      return reader.totalSize(internal::FieldSizeForType<T>::value);
+    }
     inline T operator[](uint index) { return reader.template getDataElement<T>(index * ELEMENTS); }
 
     typedef internal::IndexingIterator<Reader, T> iterator;
     inline iterator begin() { return iterator(this, 0); }
     inline iterator end() { return iterator(this, size()); }
 
+    inline ArrayPtr<const T> asArray() {
+      static_assert(internal::HasNativeLayout<T>::value,
+                    "Lists of Void and bool are not laid out as arrays.");
+      return reader.template getDataArray<T>();
+    }
+    // Returns the elements as an array pointing into the message, so that they can be read without
+    // going through operator[] for each one.  If the sender upgraded this list to a list of
+    // structs, the elements are not contiguous, and an empty array is returned instead; copyTo()
+    // works either way.
+
+    void copyTo(ArrayPtr<T> output) {
+      CAPNPROTO_DEBUG_ASSERT(output.size() == size(), "copyTo() argument had different size.");
+      uint count = output.size() < size() ? output.size() : size();
+      ArrayPtr<const T> array = asArray();
+      if (array.size() >= count) {
+        memcpy(output.begin(), array.begin(), count * sizeof(T));
+      } else {
+        for (uint i = 0; i < count; i++) {
+          output[i] = (*this)[i];
+        }
+      }
+    }
+    // Copies the elements into `output`, which should be exactly size() long.  If it isn't, only
+    // the elements that fit in both are copied.
+
+    inline uint countSet() {
+      static_assert(internal::FieldSizeForType<T>::value == internal::FieldSize::BIT,
+                    "countSet() is only for List(Bool).");
+      return reader.countSetBits() / ELEMENTS;
+    }
+    inline uint findFirstSet(uint start = 0) {
+      static_assert(internal::FieldSizeForType<T>::value == internal::FieldSize::BIT,
+                    "findFirstSet() is only for List(Bool).");
+      return reader.findBit(start * ELEMENTS, true) / ELEMENTS;
+    }
+    inline uint findFirstUnset(uint start = 0) {
+      static_assert(internal::FieldSizeForType<T>::value == internal::FieldSize::BIT,
+                    "findFirstUnset() is only for List(Bool).");
+      return reader.findBit(start * ELEMENTS, false) / ELEMENTS;
+    }
+    // For List(Bool):  the number of true elements, and the index of the first true or false
+    // element at or after `start` (or size() if there is none).  These work on 64 elements at a
+    // time.
+
   private:
     internal::ListReader reader;
+    friend struct internal::ReaderAccess;
   };
 
   class Builder {
@@ -185,25 +304,104 @@ struct List<T, true> {
     inline iterator begin() { return iterator(this, 0); }
     inline iterator end() { return iterator(this, size()); }
 
+    inline ArrayPtr<T> asArray() {
+      static_assert(internal::HasNativeLayout<T>::value,
+                    "Lists of Void and bool are not laid out as arrays.");
+      return builder.template getDataArray<T>();
+    }
+    // Returns the elements as an array pointing into the message, so that they can be filled in
+    // directly.
+
     template <typename Other>
     void copyFrom(const Other& other) {
-      auto i = other.begin();
-      auto end = other.end();
+      copyFromContainer(other, 0);
+    }
+    void copyFrom(std::initializer_list<T> other) {
+      copyFromRange(other.begin(), other.end());
+    }
+    // Sets the elements to those of `other`, which should be exactly size() long.  If it isn't,
+    // only the elements that fit in both are copied.  If `other` is contiguous in memory (an
+    // ArrayPtr, initializer_list, or anything with data() and size(), like std::vector) this is a
+    // single memcpy().  Bools (e.g. from a std::vector<bool>) are packed and stored 64 at a time.
+
+    inline void andWith(typename List<T>::Reader other) {
+      static_assert(internal::FieldSizeForType<T>::value == internal::FieldSize::BIT,
+                    "andWith() is only for List(Bool).");
+      builder.andBits(internal::ReaderAccess::getListReader(other));
+    }
+    inline void orWith(typename List<T>::Reader other) {
+      static_assert(internal::FieldSizeForType<T>::value == internal::FieldSize::BIT,
+                    "orWith() is only for List(Bool).");
+      builder.orBits(internal::ReaderAccess::getListReader(other));
+    }
+    // For List(Bool):  sets each element to itself AND / OR the corresponding element of `other`,
+    // 64 elements at a time.  Elements past the end of `other` count as false.
+
+    inline uint countSet() { return asReader().countSet(); }
+    inline uint findFirstSet(uint start = 0) { return asReader().findFirstSet(start); }
+    inline uint findFirstUnset(uint start = 0) { return asReader().findFirstUnset(start); }
+    // See the Reader versions.
+
+  private:
+    internal::ListBuilder builder;
+
+    inline typename List<T>::Reader asReader() {
+      return typename List<T>::Reader(builder.asReader(internal::FieldSizeForType<T>::value));
+    }
+
+    template <typename Iterator>
+    void copyFromRange(Iterator i, Iterator end) {
+      copyElements(i, end, static_cast<T*>(nullptr));
+    }
+    template <typename Iterator, typename Element>
+    void copyElements(Iterator i, Iterator end, Element*) {
       uint pos = 0;
-      for (; i != end && pos < size(); ++i) {
+      for (; i != end && pos < size(); ++i, ++pos) {
         set(pos, *i);
       }
       CAPNPROTO_DEBUG_ASSERT(pos == size() && i == end, "copyFrom() argument had different size.");
     }
-    void copyFrom(std::initializer_list<T> other) {
-      CAPNPROTO_DEBUG_ASSERT(other.size() == size(), "copyFrom() argument had different size.");
-      for (uint i = 0; i < other.size(); i++) {
-        set(i, other.begin()[i]);
+    template <typename Iterator>
+    void copyElements(Iterator i, Iterator end, bool*) {
+      uint pos = 0;
+      uint64_t bits = 0;
+      for (; i != end && pos < size(); ++i, ++pos) {
+        bits |= uint64_t(bool(*i)) << (pos % 64);
+        if (pos % 64 == 63) {
+          builder.setBitWord(pos / 64, bits);
+          bits = 0;
+        }
+      }
+      if (pos % 64 != 0) {
+        builder.setBitWord(pos / 64, bits);
+      }
+      CAPNPROTO_DEBUG_ASSERT(pos == size() && i == end, "copyFrom() argument had different size.");
+    }
+    void copyFromRange(const T* begin, const T* end) {
+      if (internal::HasNativeLayout<T>::value) {
+        CAPNPROTO_DEBUG_ASSERT(uint(end - begin) == size(),
+            "copyFrom() argument had different size.");
+        size_t count = uint(end - begin) < size() ? end - begin : size();
+        memcpy(builder.template getDataArray<T>().begin(), begin, count * sizeof(T));
+      } else {
+        copyElements(begin, end, static_cast<T*>(nullptr));
       }
     }
+    inline void copyFromRange(T* begin, T* end) {
+      copyFromRange(static_cast<const T*>(begin), static_cast<const T*>(end));
+    }
 
-  private:
-    internal::ListBuilder builder;
+    // copyFrom() dispatch:  prefer data() and size() where the container has them, so that e.g.
+    // a std::vector<T> gets the memcpy() above rather than going through its iterators.
+    template <typename Other>
+    inline auto copyFromContainer(const Other& other, int)
+        -> decltype(copyFromRange(other.data(), other.data() + other.size())) {
+      copyFromRange(other.data(), other.data() + other.size());
+    }
+    template <typename Other>
+    inline void copyFromContainer(const Other& other, long) {
+      copyFromRange(other.begin(), other.end());
+    }
   };
 };
 
@@ -215,6 +413,9 @@ struct List<T, false> {
     inline explicit Reader(internal::ListReader reader): reader(reader) {}
 
     inline uint size() { return reader.size() / ELEMENTS; }
+    inline MessageSize totalSize() {
+      return reader.totalSize(internal::FieldSizeForType<T>::value);
+    }
     inline typename T::Reader operator[](uint index) {
       return typename T::Reader(reader.getStructElement(index * ELEMENTS, T::DEFAULT.words));
     }
@@ -223,8 +424,22 @@ struct List<T, false> {
     inline iterator begin() { return iterator(this, 0); }
     inline iterator end() { return iterator(this, size()); }
 
+    inline internal::PrefetchingRange<Reader, typename T::Reader> prefetching(
+        uint distance = internal::DEFAULT_PREFETCH_DISTANCE) {
+      return internal::PrefetchingRange<Reader, typename T::Reader>(*this, distance);
+    }
+    // Iterate over the result instead of the list itself to have upcoming elements, and the
+    // objects they reference, prefetched.  `distance` is in elements.
+
   private:
     internal::ListReader reader;
+    friend struct internal::ReaderAccess;
+    friend class internal::PrefetchingRange<Reader, typename T::Reader>;
+
+    inline void prefetchElement(uint index) { reader.prefetchElement(index * ELEMENTS); }
+    inline void prefetchElementTargets(uint index) {
+      reader.prefetchStructElementTargets(index * ELEMENTS);
+    }
   };
 
   class Builder {
@@ -261,6 +476,9 @@ struct List<List<T>, true> {
     inline explicit Reader(internal::ListReader reader): reader(reader) {}
 
     inline uint size() { return reader.size() / ELEMENTS; }
+    inline MessageSize totalSize() {
+      return reader.totalSize(internal::FieldSizeForType<List<T>>::value);
+    }
     inline typename List<T>::Reader operator[](uint index) {
       return typename List<T>::Reader(reader.getListElement(index * REFERENCES,
           internal::FieldSizeForType<T>::value));
@@ -270,8 +488,22 @@ struct List<List<T>, true> {
     inline iterator begin() { return iterator(this, 0); }
     inline iterator end() { return iterator(this, size()); }
 
+    inline internal::PrefetchingRange<Reader, typename List<T>::Reader> prefetching(
+        uint distance = internal::DEFAULT_PREFETCH_DISTANCE) {
+      return internal::PrefetchingRange<Reader, typename List<T>::Reader>(*this, distance);
+    }
+    // Iterate over the result instead of the list itself to have upcoming elements, and the
+    // objects they reference, prefetched.  `distance` is in elements.
+
   private:
     internal::ListReader reader;
+    friend struct internal::ReaderAccess;
+    friend class internal::PrefetchingRange<Reader, typename List<T>::Reader>;
+
+    inline void prefetchElement(uint index) { reader.prefetchElement(index * ELEMENTS); }
+    inline void prefetchElementTargets(uint index) {
+      reader.prefetchReferenceTarget(index * REFERENCES);
+    }
   };
 
   class Builder {
@@ -310,6 +542,9 @@ struct List<List<T>, false> {
     inline explicit Reader(internal::ListReader reader): reader(reader) {}
 
     inline uint size() { return reader.size() / ELEMENTS; }
+    inline MessageSize totalSize() {
+      return reader.totalSize(internal::FieldSizeForType<List<T>>::value);
+    }
     inline typename List<T>::Reader operator[](uint index) {
       return typename List<T>::Reader(reader.getListElement(index * REFERENCES,
           internal::FieldSizeForType<T>::value));
@@ -319,8 +554,22 @@ struct List<List<T>, false> {
     inline iterator begin() { return iterator(this, 0); }
     inline iterator end() { return iterator(this, size()); }
 
+    inline internal::PrefetchingRange<Reader, typename List<T>::Reader> prefetching(
+        uint distance = internal::DEFAULT_PREFETCH_DISTANCE) {
+      return internal::PrefetchingRange<Reader, typename List<T>::Reader>(*this, distance);
+    }
+    // Iterate over the result instead of the list itself to have upcoming elements, and the
+    // objects they reference, prefetched.  `distance` is in elements.
+
   private:
     internal::ListReader reader;
+    friend struct internal::ReaderAccess;
+    friend class internal::PrefetchingRange<Reader, typename List<T>::Reader>;
+
+    inline void prefetchElement(uint index) { reader.prefetchElement(index * ELEMENTS); }
+    inline void prefetchElementTargets(uint index) {
+      reader.prefetchReferenceTarget(index * REFERENCES);
+    }
   };
 
   class Builder {
@@ -359,6 +608,9 @@ struct List<Data, false> {
     inline explicit Reader(internal::ListReader reader): reader(reader) {}
 
     inline uint size() { return reader.size() / ELEMENTS; }
+    inline MessageSize totalSize() {
+      return reader.totalSize(internal::FieldSizeForType<Data>::value);
+    }
     inline Data::Reader operator[](uint index) {
       return reader.getDataElement(index * REFERENCES);
     }
@@ -367,8 +619,22 @@ struct List<Data, false> {
     inline iterator begin() { return iterator(this, 0); }
     inline iterator end() { return iterator(this, size()); }
 
+    inline internal::PrefetchingRange<Reader, Data::Reader> prefetching(
+        uint distance = internal::DEFAULT_PREFETCH_DISTANCE) {
+      return internal::PrefetchingRange<Reader, Data::Reader>(*this, distance);
+    }
+    // Iterate over the result instead of the list itself to have upcoming elements, and the
+    // objects they reference, prefetched.  `distance` is in elements.
+
   private:
     internal::ListReader reader;
+    friend struct internal::ReaderAccess;
+    friend class internal::PrefetchingRange<Reader, Data::Reader>;
+
+    inline void prefetchElement(uint index) { reader.prefetchElement(index * ELEMENTS); }
+    inline void prefetchElementTargets(uint index) {
+      reader.prefetchReferenceTarget(index * REFERENCES);
+    }
   };
 
   class Builder {
@@ -396,7 +662,7 @@ struct List<Data, false> {
       auto i = other.begin();
       auto end = other.end();
       uint pos = 0;
-      for (; i != end && pos < size(); ++i) {
+      for (; i != end && pos < size(); ++i, ++pos) {
         set(pos, *i);
       }
       CAPNPROTO_DEBUG_ASSERT(pos == size() && i == end, "copyFrom() argument had different size.");
@@ -421,6 +687,9 @@ struct List<Text, false> {
     inline explicit Reader(internal::ListReader reader): reader(reader) {}
 
     inline uint size() { return reader.size() / ELEMENTS; }
+    inline MessageSize totalSize() {
+      return reader.totalSize(internal::FieldSizeForType<Text>::value);
+    }
     inline Text::Reader operator[](uint index) {
       return reader.getTextElement(index * REFERENCES);
     }
@@ -429,8 +698,22 @@ struct List<Text, false> {
     inline iterator begin() { return iterator(this, 0); }
     inline iterator end() { return iterator(this, size()); }
 
+    inline internal::PrefetchingRange<Reader, Text::Reader> prefetching(
+        uint distance = internal::DEFAULT_PREFETCH_DISTANCE) {
+      return internal::PrefetchingRange<Reader, Text::Reader>(*this, distance);
+    }
+    // Iterate over the result instead of the list itself to have upcoming elements, and the
+    // objects they reference, prefetched.  `distance` is in elements.
+
   private:
     internal::ListReader reader;
+    friend struct internal::ReaderAccess;
+    friend class internal::PrefetchingRange<Reader, Text::Reader>;
+
+    inline void prefetchElement(uint index) { reader.prefetchElement(index * ELEMENTS); }
+    inline void prefetchElementTargets(uint index) {
+      reader.prefetchReferenceTarget(index * REFERENCES);
+    }
   };
 
   class Builder {
@@ -458,7 +741,7 @@ struct List<Text, false> {
       auto i = other.begin();
       auto end = other.end();
       uint pos = 0;
-      for (; i != end && pos < size(); ++i) {
+      for (; i != end && pos < size(); ++i, ++pos) {
         set(pos, *i);
       }
       CAPNPROTO_DEBUG_ASSERT(pos == size() && i == end, "copyFrom() argument had different size.");
@@ -52,6 +52,10 @@ namespace internal {
 // expect the condition to be true/false enough of the time that it's worth hard-coding branch
 // prediction.
 
+#define CAPNPROTO_PREFETCH(address) __builtin_prefetch(address)
+// Hints to the CPU that the memory at the given address will be read soon.  Never faults, even if
+// the address is invalid, so it can be applied to pointers read from an unchecked message.
+
 #define CAPNPROTO_ALWAYS_INLINE(prototype) inline prototype __attribute__((always_inline))
 // Force a function to always be inlined.  Apply only to the prototype, not to the definition.
 
@@ -70,6 +74,13 @@ void assertionFailure(const char* file, int line, const char* expectation, const
 #define CAPNPROTO_DEBUG_ASSERT(condition, message) CAPNPROTO_ASSERT(condition, message)
 #endif
 
+#ifndef CAPNPROTO_ALLOCATION_STATS
+#define CAPNPROTO_ALLOCATION_STATS 0
+#endif
+// Define as 1 to have MessageBuilder count its allocations; see AllocationStats in message.h.  When
+// 0, the counting code compiles away entirely.  Must be the same for the library and its users,
+// since it changes the size of MessageBuilder.
+
 // Allocate an array, preferably on the stack, unless it is too big.  On GCC this will use
 // variable-sized arrays.  For other compilers we could just use a fixed-size array.
 #define CAPNPROTO_STACK_ARRAY(type, name, size, maxStack) \
@@ -22,7 +22,9 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "message.h"
+#include "layout.h"
 #include <gtest/gtest.h>
+#include <thread>
 
 namespace capnproto {
 namespace internal {
@@ -45,6 +47,235 @@ TEST(Message, MallocBuilderWithFirstSegment) {
   EXPECT_EQ(16u, segment.size());
 }
 
+TEST(Message, AdaptiveFirstSegmentSize) {
+  AdaptiveFirstSegmentSize size(1024);
+  EXPECT_EQ(1024u, size.suggest());
+
+  {
+    MallocMessageBuilder builder(size);
+    EXPECT_EQ(1024u, builder.allocateSegment(1).size());
+  }
+
+  // Sizes spread evenly over [1000, 5000):  the 99th percentile is about 4960.
+  uint seed = 1;
+  for (uint i = 0; i < 5000; i++) {
+    seed = seed * 1103515245 + 12345;
+    size.record(1000 + (seed >> 8) % 4000);
+  }
+  EXPECT_GT(size.suggest(), 4500u);
+  EXPECT_LT(size.suggest(), 6000u);
+
+  // Then the messages get small, and the suggestion follows them down.
+  for (uint i = 0; i < 10000; i++) {
+    size.record(50);
+  }
+  EXPECT_GE(size.suggest(), 40u);
+  EXPECT_LE(size.suggest(), 64u);
+
+  // Never below the minimum.
+  for (uint i = 0; i < 10000; i++) {
+    size.record(1);
+  }
+  EXPECT_EQ(AdaptiveFirstSegmentSize::MIN_WORDS, size.suggest());
+}
+
+static bool isZero(ArrayPtr<word> segment) {
+  for (word& w: segment) {
+    if (memcmp(&w, "\0\0\0\0\0\0\0\0", sizeof(word)) != 0) return false;
+  }
+  return true;
+}
+
+struct TestRoot {
+  // Just enough of a generated type for initRoot():  a struct with one data word.
+  static const AlignedData<2> DEFAULT;
+
+  class Builder {
+  public:
+    explicit Builder(StructBuilder base): base(base) {}
+    StructBuilder base;
+  };
+};
+const AlignedData<2> TestRoot::DEFAULT = {{0,0,0,0,1,0,0,0,  0,0,0,0,0,0,0,0}};
+
+struct TestWrapper {
+  // A struct with one reference, for external data.
+  static const AlignedData<1> DEFAULT;
+
+  class Builder {
+  public:
+    explicit Builder(StructBuilder base): base(base) {}
+    StructBuilder base;
+  };
+};
+const AlignedData<1> TestWrapper::DEFAULT = {{0,0,0,0,0,0,1,0}};
+
+TEST(Message, AdaptiveFirstSegmentSizeIgnoresExternalData) {
+  // Each message is four words of its own plus a large external blob.  Only the four words should
+  // count.
+  static word blob[4096];
+  AdaptiveFirstSegmentSize size(AdaptiveFirstSegmentSize::MIN_WORDS);
+  for (uint i = 0; i < 100; i++) {
+    MallocMessageBuilder builder(size);
+    builder.initRoot<TestWrapper>().base.setExternalDataField(
+        0 * REFERENCES, arrayPtr(blob, 4096), 4096 * WORDS * BYTES_PER_WORD);
+    ASSERT_EQ(2u, builder.getSegmentsForOutput().size());
+  }
+  EXPECT_EQ(AdaptiveFirstSegmentSize::MIN_WORDS, size.suggest());
+}
+
+TEST(Message, MallocBuilderRezeroesFirstSegment) {
+  // Overwriting a field follows the old reference, so scratch space passed to the next builder
+  // must come back zeroed.
+  word scratch[16];
+  memset(scratch, 0, sizeof(scratch));
+
+  {
+    MallocMessageBuilder builder(arrayPtr(scratch, 16), AllocationStrategy::FIXED_SIZE);
+    builder.initRoot<TestRoot>().base.setDataField<uint64_t>(0 * ELEMENTS, 0x1234);
+    EXPECT_FALSE(isZero(arrayPtr(scratch, 16)));
+  }
+  EXPECT_TRUE(isZero(arrayPtr(scratch, 16)));
+
+  {
+    // Same when the message spills into a second segment.
+    MallocMessageBuilder builder(arrayPtr(scratch, 1), AllocationStrategy::FIXED_SIZE);
+    builder.initRoot<TestRoot>().base.setDataField<uint64_t>(0 * ELEMENTS, 0x1234);
+    EXPECT_EQ(2u, builder.getSegmentsForOutput().size());
+  }
+  EXPECT_TRUE(isZero(arrayPtr(scratch, 16)));
+
+  {
+    // compact() moves the message out of scratch space that is too small to hold it.
+    MallocMessageBuilder builder(arrayPtr(scratch, 1), AllocationStrategy::FIXED_SIZE);
+    builder.initRoot<TestRoot>().base.setDataField<uint64_t>(0 * ELEMENTS, 0x1234);
+    builder.compact();
+    EXPECT_NE(scratch, builder.getSegmentsForOutput()[0].begin());
+  }
+  EXPECT_TRUE(isZero(arrayPtr(scratch, 16)));
+}
+
+TEST(Message, InlineBuilder) {
+  InlineMessageBuilder<16> builder(AllocationStrategy::FIXED_SIZE);
+  const byte* begin = reinterpret_cast<const byte*>(&builder);
+  const byte* end = begin + sizeof(builder);
+
+  ArrayPtr<word> segment = builder.allocateSegment(1);
+  EXPECT_EQ(16u, segment.size());
+  EXPECT_TRUE(reinterpret_cast<byte*>(segment.begin()) >= begin &&
+              reinterpret_cast<byte*>(segment.end()) <= end);
+  EXPECT_TRUE(isZero(segment));
+
+  // Once the inline segment is used up, further segments come from the heap.
+  segment = builder.allocateSegment(1);
+  EXPECT_EQ(16u, segment.size());
+  EXPECT_FALSE(reinterpret_cast<byte*>(segment.begin()) >= begin &&
+               reinterpret_cast<byte*>(segment.begin()) < end);
+  EXPECT_TRUE(isZero(segment));
+
+  segment = builder.allocateSegment(100);
+  EXPECT_EQ(100u, segment.size());
+}
+
+TEST(Message, PooledBuilderReusesSegments) {
+  word* first;
+  word* second;
+
+  {
+    PooledMessageBuilder builder(100, AllocationStrategy::FIXED_SIZE);
+
+    ArrayPtr<word> segment = builder.allocateSegment(1);
+    EXPECT_EQ(128u, segment.size());  // rounded up to a size class
+    EXPECT_TRUE(isZero(segment));
+    memset(segment.begin(), 0xff, segment.size() * sizeof(word));
+    first = segment.begin();
+
+    segment = builder.allocateSegment(1);
+    EXPECT_EQ(128u, segment.size());
+    EXPECT_TRUE(isZero(segment));
+    memset(segment.begin(), 0xff, 3 * sizeof(word));
+    second = segment.begin();
+  }
+
+  {
+    // The segments come back, most recently released first, and fully zeroed.
+    PooledMessageBuilder builder(100, AllocationStrategy::FIXED_SIZE);
+
+    ArrayPtr<word> segment = builder.allocateSegment(1);
+    EXPECT_EQ(second, segment.begin());
+    EXPECT_TRUE(isZero(segment));
+
+    segment = builder.allocateSegment(1);
+    EXPECT_EQ(first, segment.begin());
+    EXPECT_TRUE(isZero(segment));
+  }
+}
+
+TEST(Message, PooledBuilderCrossThreadRelease) {
+  // A builder destroyed on another thread returns its segments to the pool of the thread that
+  // built it.
+
+  word* segmentPtr;
+  PooledMessageBuilder* builder = new PooledMessageBuilder(2000, AllocationStrategy::FIXED_SIZE);
+  ArrayPtr<word> segment = builder->allocateSegment(1);
+  EXPECT_EQ(2048u, segment.size());
+  memset(segment.begin(), 0xff, segment.size() * sizeof(word));
+  segmentPtr = segment.begin();
+
+  std::thread([builder]() { delete builder; }).join();
+
+  PooledMessageBuilder builder2(2000, AllocationStrategy::FIXED_SIZE);
+  segment = builder2.allocateSegment(1);
+  EXPECT_EQ(segmentPtr, segment.begin());
+  EXPECT_TRUE(isZero(segment));
+
+  // A builder whose thread has already exited frees its segments instead.
+  PooledMessageBuilder* orphan = nullptr;
+  std::thread([&orphan]() {
+    orphan = new PooledMessageBuilder(2000);
+    orphan->allocateSegment(1);
+  }).join();
+  delete orphan;
+}
+
+TEST(Message, PooledBuilderReleasedDuringThreadExit) {
+  // A builder in a thread_local that was constructed before the thread's pool is destroyed after
+  // the pool's holder.  Releasing it must not touch the holder again.
+
+  struct Holder {
+    PooledMessageBuilder builder{2000};
+  };
+
+  std::thread([]() {
+    static thread_local Holder holder;
+    ArrayPtr<word> segment = holder.builder.allocateSegment(1);
+    memset(segment.begin(), 0xff, segment.size() * sizeof(word));
+  }).join();
+}
+
+TEST(Message, MmapBuilder) {
+  for (auto hugePages: { MmapMessageBuilder::HugePages::NONE,
+                         MmapMessageBuilder::HugePages::TRANSPARENT,
+                         MmapMessageBuilder::HugePages::EXPLICIT }) {
+    MmapMessageBuilder builder(1000, hugePages);
+
+    ArrayPtr<word> segment = builder.allocateSegment(1);
+    EXPECT_LE(1000u, segment.size());
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(segment.begin()) % 4096);
+    EXPECT_TRUE(isZero(segment));
+    memset(segment.begin(), 0xff, segment.size() * sizeof(word));
+
+    // Overflow segments get at least the requested size.
+    ArrayPtr<word> segment2 = builder.allocateSegment(100000);
+    EXPECT_LE(100000u, segment2.size());
+    EXPECT_TRUE(isZero(segment2));
+  }
+
+  // The reservation is capped at what a pointer can address.
+  MmapMessageBuilder builder(size_t(1) << 32, MmapMessageBuilder::HugePages::NONE);
+  EXPECT_EQ(MmapMessageBuilder::MAX_SEGMENT_WORDS, builder.allocateSegment(1).size());
+}
+
 // TODO:  More tests.
 
 }  // namespace
@@ -27,7 +27,11 @@
 #include <exception>
 #include <string>
 #include <vector>
+#include <atomic>
+#include <thread>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <math.h>
 
 namespace capnproto {
 
@@ -38,7 +42,70 @@ MessageReader::~MessageReader() {
   }
 }
 
-internal::StructReader MessageReader::getRoot(const word* defaultValue) {
+void MessageReader::reset() {
+  if (allocatedArena) {
+    arena()->reset();
+  }
+}
+
+bool MessageReader::validate() {
+  allocateArena();
+  return arena()->validate();
+}
+
+void MessageReader::assumeValid() {
+  allocateArena();
+  arena()->assumeValid();
+}
+
+Array<word> MessageReader::canonicalize() {
+  allocateArena();
+
+  internal::SegmentReader* segment = arena()->tryGetSegment(SegmentId(0));
+  if (segment == nullptr ||
+      !segment->containsInterval(segment->getStartPtr(), segment->getStartPtr() + 1)) {
+    arena()->reportInvalidData("Message did not contain a root pointer.");
+    Array<word> result = newArray<word>(1);
+    memset(result.begin(), 0, sizeof(word));
+    return result;
+  }
+
+  return internal::canonicalizeMessage(segment, options.nestingLimit);
+}
+
+uint64_t MessageReader::canonicalHash() {
+  Array<word> canonical = canonicalize();
+  return hashCanonicalMessage(arrayPtr(canonical.begin(), canonical.size()));
+}
+
+bool MessageReader::canonicallyEquals(MessageReader& other) {
+  allocateArena();
+  other.allocateArena();
+
+  // Identical bytes mean identical content, so try that first.
+  for (uint id = 0;; id++) {
+    internal::SegmentReader* a = arena()->tryGetSegment(SegmentId(id));
+    internal::SegmentReader* b = other.arena()->tryGetSegment(SegmentId(id));
+    if (a == nullptr || b == nullptr) {
+      if (a == b && id > 0) {
+        return true;
+      }
+      break;
+    }
+    ArrayPtr<const word> aWords = a->getArray();
+    ArrayPtr<const word> bWords = b->getArray();
+    if (aWords.size() != bWords.size() ||
+        memcmp(aWords.begin(), bWords.begin(), aWords.size() * sizeof(word)) != 0) {
+      break;
+    }
+  }
+
+  Array<word> a = canonicalize();
+  Array<word> b = other.canonicalize();
+  return a.size() == b.size() && memcmp(a.begin(), b.begin(), a.size() * sizeof(word)) == 0;
+}
+
+void MessageReader::allocateArena() {
   if (!allocatedArena) {
     static_assert(sizeof(internal::ReaderArena) <= sizeof(arenaSpace),
         "arenaSpace is too small to hold a ReaderArena.  Please increase it.  This will break "
@@ -46,6 +113,10 @@ internal::StructReader MessageReader::getRoot(const word* defaultValue) {
     new(arena()) internal::ReaderArena(this);
     allocatedArena = true;
   }
+}
+
+internal::StructReader MessageReader::getRoot(const word* defaultValue) {
+  allocateArena();
 
   internal::SegmentReader* segment = arena()->tryGetSegment(SegmentId(0));
   if (segment == nullptr ||
@@ -58,9 +129,46 @@ internal::StructReader MessageReader::getRoot(const word* defaultValue) {
   }
 }
 
+uint64_t hashCanonicalMessage(ArrayPtr<const word> canonical) {
+  // MurmurHash3's 64-bit mixing, one word at a time.  Canonical messages are always whole words,
+  // so there's no tail to deal with.
+  const uint64_t c1 = 0x87c37b91114253d5ull;
+  const uint64_t c2 = 0x4cf5ad432745937full;
+
+  uint64_t h = canonical.size();
+  for (const word& w: canonical) {
+    uint64_t k = reinterpret_cast<const internal::WireValue<uint64_t>*>(&w)->get();
+    k *= c1;
+    k = (k << 31) | (k >> 33);
+    k *= c2;
+    h ^= k;
+    h = (h << 27) | (h >> 37);
+    h = h * 5 + 0x52dce729;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
 // -------------------------------------------------------------------
 
-MessageBuilder::MessageBuilder(): allocatedArena(false) {}
+AllocationStats& AllocationStats::operator+=(const AllocationStats& other) {
+  wordsAllocated += other.wordsAllocated;
+  wordsReserved += other.wordsReserved;
+  segmentsAllocated += other.segmentsAllocated;
+  farReferences += other.farReferences;
+  defaultValueCopies += other.defaultValueCopies;
+  wordsZeroed += other.wordsZeroed;
+  return *this;
+}
+
+MessageBuilder::MessageBuilder()
+    : allocatedArena(false), concurrentBuilding(false), reuseFreedSpace(false),
+      zeroOverwritten(false) {}
 MessageBuilder::~MessageBuilder() {
   if (allocatedArena) {
     arena()->~BuilderArena();
@@ -74,7 +182,8 @@ internal::SegmentBuilder* MessageBuilder::getRootSegment() {
     static_assert(sizeof(internal::BuilderArena) <= sizeof(arenaSpace),
         "arenaSpace is too small to hold a BuilderArena.  Please increase it.  This will break "
         "ABI compatibility.");
-    new(arena()) internal::BuilderArena(this);
+    new(arena()) internal::BuilderArena(
+        this, concurrentBuilding, reuseFreedSpace, zeroOverwritten);
     allocatedArena = true;
 
     WordCount refSize = 1 * REFERENCES * WORDS_PER_REFERENCE;
@@ -100,6 +209,11 @@ internal::StructBuilder MessageBuilder::getRoot(const word* defaultValue) {
       rootSegment, rootSegment->getPtrUnchecked(0 * WORDS), defaultValue);
 }
 
+void MessageBuilder::setRoot(const internal::StructReader& value) {
+  internal::SegmentBuilder* rootSegment = getRootSegment();
+  internal::StructBuilder::setRoot(rootSegment, rootSegment->getPtrUnchecked(0 * WORDS), value);
+}
+
 ArrayPtr<const ArrayPtr<const word>> MessageBuilder::getSegmentsForOutput() {
   if (allocatedArena) {
     return arena()->getSegmentsForOutput();
@@ -108,6 +222,38 @@ ArrayPtr<const ArrayPtr<const word>> MessageBuilder::getSegmentsForOutput() {
   }
 }
 
+void MessageBuilder::compact() {
+  if (allocatedArena) {
+    arena()->compact();
+  }
+}
+
+void MessageBuilder::enableConcurrentBuilding() {
+  CAPNPROTO_ASSERT(!allocatedArena,
+      "enableConcurrentBuilding() must be called before the message root is initialized.");
+  concurrentBuilding = true;
+}
+
+AllocationStats MessageBuilder::getAllocationStats() {
+  if (allocatedArena) {
+    return arena()->getAllocationStats();
+  } else {
+    return AllocationStats();
+  }
+}
+
+void MessageBuilder::enableFreedSpaceReuse() {
+  CAPNPROTO_ASSERT(!allocatedArena,
+      "enableFreedSpaceReuse() must be called before the message root is initialized.");
+  reuseFreedSpace = true;
+}
+
+void MessageBuilder::enableOverwriteZeroing() {
+  CAPNPROTO_ASSERT(!allocatedArena,
+      "enableOverwriteZeroing() must be called before the message root is initialized.");
+  zeroOverwritten = true;
+}
+
 // =======================================================================================
 
 ErrorReporter::~ErrorReporter() {}
@@ -189,6 +335,55 @@ ArrayPtr<const word> SegmentArrayMessageReader::getSegment(uint id) {
 
 // -------------------------------------------------------------------
 
+constexpr uint AdaptiveFirstSegmentSize::MIN_WORDS;
+constexpr uint AdaptiveFirstSegmentSize::MAX_WORDS;
+
+namespace {
+
+// Larger steps learn faster but jitter more.  With 1/8, a message that doesn't fit raises the
+// estimate by about 9% (at the 99th percentile), and a few hundred messages that fit comfortably
+// are needed to bring it down by half.
+constexpr double LOG_STEP = 1.0 / 8;
+
+}  // namespace
+
+AdaptiveFirstSegmentSize::AdaptiveFirstSegmentSize(uint initialWords, double percentile)
+    : upStep(lround(LOG_STEP * percentile * (1 << LOG_FRACTION_BITS))),
+      downStep(lround(LOG_STEP * (1 - percentile) * (1 << LOG_FRACTION_BITS))),
+      logEstimate(lround(log2(std::max(initialWords, 1u)) * (1 << LOG_FRACTION_BITS))),
+      suggestedWords(std::min(std::max(initialWords, MIN_WORDS), MAX_WORDS)) {
+  CAPNPROTO_ASSERT(percentile > 0 && percentile < 1, "percentile must be between 0 and 1.");
+  if (downStep == 0) downStep = 1;
+}
+
+void AdaptiveFirstSegmentSize::record(size_t totalWords) {
+  // Stochastic gradient descent on the quantile loss, in log space so that the step is relative
+  // to the size.  The estimate is stable where the fraction of messages larger than it is
+  // downStep / (upStep + downStep), i.e. 1 - percentile.
+  int32_t estimate = logEstimate.load(std::memory_order_relaxed);
+  double estimatedWords = exp2(double(estimate) / (1 << LOG_FRACTION_BITS));
+  if (totalWords > estimatedWords) {
+    estimate += upStep;
+  } else {
+    estimate -= downStep;
+  }
+
+  // Don't let the estimate wander far past the range we'd suggest, or it would take ages to come
+  // back.
+  constexpr int32_t LOG_MIN = 4 << LOG_FRACTION_BITS;    // 16 words
+  constexpr int32_t LOG_MAX = 20 << LOG_FRACTION_BITS;   // 2^20 words
+  static_assert(1u << (LOG_MIN >> LOG_FRACTION_BITS) == MIN_WORDS, "LOG_MIN out of sync.");
+  static_assert(1u << (LOG_MAX >> LOG_FRACTION_BITS) == MAX_WORDS, "LOG_MAX out of sync.");
+  estimate = std::min(std::max(estimate, LOG_MIN), LOG_MAX);
+
+  logEstimate.store(estimate, std::memory_order_relaxed);
+  suggestedWords.store(
+      std::min<uint>(ceil(exp2(double(estimate) / (1 << LOG_FRACTION_BITS))), MAX_WORDS),
+      std::memory_order_relaxed);
+}
+
+// -------------------------------------------------------------------
+
 struct MallocMessageBuilder::MoreSegments {
   std::vector<void*> segments;
 };
@@ -196,22 +391,45 @@ struct MallocMessageBuilder::MoreSegments {
 MallocMessageBuilder::MallocMessageBuilder(
     uint firstSegmentWords, AllocationStrategy allocationStrategy)
     : nextSize(firstSegmentWords), allocationStrategy(allocationStrategy),
-      ownFirstSegment(true), firstSegment(nullptr) {}
+      ownFirstSegment(true), returnedFirstSegment(false), firstSegment(nullptr) {}
+
+MallocMessageBuilder::MallocMessageBuilder(
+    AdaptiveFirstSegmentSize& firstSegmentSize, AllocationStrategy allocationStrategy)
+    : nextSize(firstSegmentSize.suggest()), allocationStrategy(allocationStrategy),
+      ownFirstSegment(true), returnedFirstSegment(false), firstSegment(nullptr),
+      firstSegmentSize(&firstSegmentSize) {}
 
 MallocMessageBuilder::MallocMessageBuilder(
     ArrayPtr<word> firstSegment, AllocationStrategy allocationStrategy)
     : nextSize(firstSegment.size()), allocationStrategy(allocationStrategy),
-      ownFirstSegment(false), firstSegment(firstSegment.begin()) {}
+      ownFirstSegment(false), returnedFirstSegment(false), firstSegment(firstSegment.begin()) {}
 
 MallocMessageBuilder::~MallocMessageBuilder() {
+  if (firstSegmentSize != nullptr) {
+    ArrayPtr<const ArrayPtr<const word>> segments = getSegmentsForOutput();
+    if (segments.size() > 0) {
+      // Only count segments we allocated.  External segments (see
+      // StructBuilder::setExternalDataField()) are caller memory, and would inflate the suggestion.
+      size_t totalWords = 0;
+      for (auto& segment: segments) {
+        if (isOwnSegment(segment.begin())) {
+          totalWords += segment.size();
+        }
+      }
+      firstSegmentSize->record(totalWords);
+    }
+  }
+
   if (ownFirstSegment) {
     free(firstSegment);
   } else {
-    ArrayPtr<const ArrayPtr<const word>> segments = getSegmentsForOutput();
-    if (segments.size() > 0) {
-      CAPNPROTO_ASSERT(segments[0].begin() == firstSegment,
-          "First segment in getSegmentsForOutput() is not the first segment allocated?");
-      memset(firstSegment, 0, segments[0].size() * sizeof(word));
+    // compact() may have moved segment 0 elsewhere, in which case it already zeroed the scratch
+    // space and kept it as a spare, which may since have been handed out as some other segment.
+    for (auto& segment: getSegmentsForOutput()) {
+      if (segment.begin() == firstSegment) {
+        memset(firstSegment, 0, segment.size() * sizeof(word));
+        break;
+      }
     }
   }
   if (moreSegments != nullptr) {
@@ -221,17 +439,33 @@ MallocMessageBuilder::~MallocMessageBuilder() {
   }
 }
 
+bool MallocMessageBuilder::isOwnSegment(const word* begin) {
+  if (begin == firstSegment) {
+    return true;
+  }
+  if (moreSegments != nullptr) {
+    for (void* ptr: moreSegments->segments) {
+      if (begin == ptr) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
 ArrayPtr<word> MallocMessageBuilder::allocateSegment(uint minimumSize) {
-  if (!ownFirstSegment) {
+  if (!ownFirstSegment && !returnedFirstSegment) {
+    // Keep pointing at the provided segment so that the destructor can re-zero it.
     ArrayPtr<word> result = arrayPtr(reinterpret_cast<word*>(firstSegment), nextSize);
-    firstSegment = nullptr;
-    ownFirstSegment = true;
+    returnedFirstSegment = true;
     if (result.size() >= minimumSize) {
       return result;
     }
     // If the provided first segment wasn't big enough, we discard it and proceed to allocate
     // our own.  This never happens in practice since minimumSize is always 1 for the first
     // segment.
+    firstSegment = nullptr;
+    ownFirstSegment = true;
   }
 
   uint size = std::max(minimumSize, nextSize);
@@ -255,4 +489,366 @@ ArrayPtr<word> MallocMessageBuilder::allocateSegment(uint minimumSize) {
   return arrayPtr(reinterpret_cast<word*>(result), size);
 }
 
+// -------------------------------------------------------------------
+
+class PooledMessageBuilder::Pool {
+  // Free lists of zeroed segments, one per size class, owned by a single thread.  Only the owning
+  // thread touches the free lists.  Other threads push segments onto `remoteFreed`, which the owner
+  // takes over wholesale with an atomic exchange, so the list never needs a lock and pops are not
+  // subject to ABA.
+  //
+  // Pools are reference-counted:  the owning thread holds one reference and each builder that has
+  // allocated from the pool holds another, so a builder released after its thread exits still has
+  // somewhere to put its segments.
+
+public:
+  ~Pool();
+
+  static const std::shared_ptr<Pool>& forCurrentThread();
+
+  inline bool isOwnedByCurrentThread() {
+    // Doesn't touch the thread-local holder, so it's safe to call while the thread is exiting,
+    // after the holder may already have been destroyed.  Once the owner has started exiting, its
+    // free lists won't be drained again, so it no longer counts as the owner.
+    return owner == std::this_thread::get_id() && !ownerExited.load(std::memory_order_relaxed);
+  }
+
+  ArrayPtr<word> allocate(uint minimumSize);
+  // Returns a zeroed segment of at least the given size.
+
+  void release(ArrayPtr<word> segment, size_t usedWords);
+  // Returns a segment to the pool.  Only the first `usedWords` words are assumed to be non-zero.
+  // Must be called on the owning thread.
+
+  void releaseRemote(ArrayPtr<word> segment, size_t usedWords);
+  // Like release(), but may be called from any thread.
+
+private:
+  struct FreeSegment {
+    // Header written over the first words of a pooled segment.  Zeroed again when the segment is
+    // handed out.
+
+    FreeSegment* next;
+    uint sizeClass;
+  };
+
+  static constexpr uint MIN_SIZE_CLASS_BITS = 6;
+  static constexpr uint SIZE_CLASS_COUNT = 12;
+  // Size classes are 64, 128, ..., 128k words.
+
+  std::thread::id owner = std::this_thread::get_id();
+  FreeSegment* freeLists[SIZE_CLASS_COUNT] = {};
+  size_t pooledWords = 0;
+
+  std::atomic<FreeSegment*> remoteFreed{nullptr};
+  std::atomic<size_t> remoteWords{0};
+  std::atomic<bool> ownerExited{false};
+
+  static inline int sizeClassFor(size_t words) {
+    // Returns the smallest size class that can hold `words`, or -1 if there isn't one.
+    if (words <= (1u << MIN_SIZE_CLASS_BITS)) return 0;
+    if (words > (1u << (MIN_SIZE_CLASS_BITS + SIZE_CLASS_COUNT - 1))) return -1;
+    return (32 - __builtin_clz(words - 1)) - MIN_SIZE_CLASS_BITS;
+  }
+
+  static inline size_t classSize(uint sizeClass) {
+    return size_t(1) << (sizeClass + MIN_SIZE_CLASS_BITS);
+  }
+
+  void push(ArrayPtr<word> segment, uint sizeClass);
+  void drainRemote();
+  void freeAll();
+};
+
+PooledMessageBuilder::Pool::~Pool() {
+  freeAll();
+}
+
+const std::shared_ptr<PooledMessageBuilder::Pool>& PooledMessageBuilder::Pool::forCurrentThread() {
+  struct Holder {
+    std::shared_ptr<Pool> pool = std::make_shared<Pool>();
+
+    ~Holder() {
+      // Segments released remotely from now on are freed by releaseRemote(), or by ~Pool() if they
+      // race with this.
+      pool->ownerExited.store(true, std::memory_order_release);
+      pool->freeAll();
+    }
+  };
+
+  static thread_local Holder holder;
+  return holder.pool;
+}
+
+ArrayPtr<word> PooledMessageBuilder::Pool::allocate(uint minimumSize) {
+  int sizeClass = sizeClassFor(minimumSize);
+  if (sizeClass < 0) {
+    void* result = calloc(minimumSize, sizeof(word));
+    if (result == nullptr) {
+      throw std::bad_alloc();
+    }
+    return arrayPtr(reinterpret_cast<word*>(result), minimumSize);
+  }
+
+  if (freeLists[sizeClass] == nullptr &&
+      remoteFreed.load(std::memory_order_relaxed) != nullptr) {
+    drainRemote();
+  }
+
+  size_t size = classSize(sizeClass);
+  FreeSegment* segment = freeLists[sizeClass];
+  if (segment != nullptr) {
+    freeLists[sizeClass] = segment->next;
+    pooledWords -= size;
+    memset(segment, 0, sizeof(FreeSegment));
+    return arrayPtr(reinterpret_cast<word*>(segment), size);
+  }
+
+  void* result = calloc(size, sizeof(word));
+  if (result == nullptr) {
+    throw std::bad_alloc();
+  }
+  return arrayPtr(reinterpret_cast<word*>(result), size);
+}
+
+void PooledMessageBuilder::Pool::release(ArrayPtr<word> segment, size_t usedWords) {
+  int sizeClass = sizeClassFor(segment.size());
+  if (sizeClass < 0 || pooledWords + segment.size() > MAX_POOLED_WORDS_PER_THREAD) {
+    free(segment.begin());
+    return;
+  }
+
+  memset(segment.begin(), 0, usedWords * sizeof(word));
+  push(segment, sizeClass);
+}
+
+void PooledMessageBuilder::Pool::releaseRemote(ArrayPtr<word> segment, size_t usedWords) {
+  int sizeClass = sizeClassFor(segment.size());
+  if (sizeClass < 0 || ownerExited.load(std::memory_order_acquire) ||
+      remoteWords.load(std::memory_order_relaxed) + segment.size() >
+          MAX_POOLED_WORDS_PER_THREAD) {
+    free(segment.begin());
+    return;
+  }
+
+  memset(segment.begin(), 0, usedWords * sizeof(word));
+  remoteWords.fetch_add(segment.size(), std::memory_order_relaxed);
+
+  FreeSegment* node = reinterpret_cast<FreeSegment*>(segment.begin());
+  node->sizeClass = sizeClass;
+  node->next = remoteFreed.load(std::memory_order_relaxed);
+  while (!remoteFreed.compare_exchange_weak(
+      node->next, node, std::memory_order_release, std::memory_order_relaxed)) {}
+}
+
+void PooledMessageBuilder::Pool::push(ArrayPtr<word> segment, uint sizeClass) {
+  FreeSegment* node = reinterpret_cast<FreeSegment*>(segment.begin());
+  node->next = freeLists[sizeClass];
+  node->sizeClass = sizeClass;
+  freeLists[sizeClass] = node;
+  pooledWords += segment.size();
+}
+
+void PooledMessageBuilder::Pool::drainRemote() {
+  FreeSegment* node = remoteFreed.exchange(nullptr, std::memory_order_acquire);
+  while (node != nullptr) {
+    FreeSegment* next = node->next;
+    size_t size = classSize(node->sizeClass);
+    remoteWords.fetch_sub(size, std::memory_order_relaxed);
+    if (pooledWords + size > MAX_POOLED_WORDS_PER_THREAD) {
+      free(node);
+    } else {
+      push(arrayPtr(reinterpret_cast<word*>(node), size), node->sizeClass);
+    }
+    node = next;
+  }
+}
+
+void PooledMessageBuilder::Pool::freeAll() {
+  for (FreeSegment*& list: freeLists) {
+    while (list != nullptr) {
+      FreeSegment* next = list->next;
+      free(list);
+      list = next;
+    }
+  }
+  pooledWords = 0;
+
+  FreeSegment* node = remoteFreed.exchange(nullptr, std::memory_order_acquire);
+  while (node != nullptr) {
+    FreeSegment* next = node->next;
+    remoteWords.fetch_sub(classSize(node->sizeClass), std::memory_order_relaxed);
+    free(node);
+    node = next;
+  }
+}
+
+constexpr uint PooledMessageBuilder::MAX_POOLED_WORDS_PER_THREAD;
+
+struct PooledMessageBuilder::MoreSegments {
+  std::vector<ArrayPtr<word>> segments;
+};
+
+PooledMessageBuilder::PooledMessageBuilder(
+    uint firstSegmentWords, AllocationStrategy allocationStrategy)
+    : nextSize(firstSegmentWords), allocationStrategy(allocationStrategy) {}
+
+PooledMessageBuilder::~PooledMessageBuilder() {
+  if (pool == nullptr) {
+    return;
+  }
+
+  // Segments are listed by getSegmentsForOutput() in the order we allocated them.  Anything the
+  // arena doesn't know about (e.g. if allocateSegment() was called directly) is zeroed in full.
+  ArrayPtr<const ArrayPtr<const word>> used = getSegmentsForOutput();
+  bool local = pool->isOwnedByCurrentThread();
+  uint i = 0;
+  auto release = [&](ArrayPtr<word> segment) {
+    size_t usedWords = segment.size();
+    if (i < used.size() && used[i].begin() == segment.begin()) {
+      usedWords = used[i].size();
+    }
+    ++i;
+    if (local) {
+      pool->release(segment, usedWords);
+    } else {
+      pool->releaseRemote(segment, usedWords);
+    }
+  };
+
+  release(firstSegment);
+  if (moreSegments != nullptr) {
+    for (ArrayPtr<word> segment: moreSegments->segments) {
+      release(segment);
+    }
+  }
+}
+
+ArrayPtr<word> PooledMessageBuilder::allocateSegment(uint minimumSize) {
+  uint size = std::max(minimumSize, nextSize);
+
+  // With concurrent building, this may be called on any thread, so always allocate from the
+  // calling thread's pool.  Segments are interchangeable between pools, so the destructor simply
+  // returns all of them to the pool of the thread that allocated the first one.
+  const std::shared_ptr<Pool>& threadPool = Pool::forCurrentThread();
+  ArrayPtr<word> result = threadPool->allocate(size);
+
+  if (pool == nullptr) {
+    pool = threadPool;
+    firstSegment = result;
+    if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) nextSize = result.size();
+  } else {
+    if (moreSegments == nullptr) {
+      moreSegments = std::unique_ptr<MoreSegments>(new MoreSegments);
+    }
+    moreSegments->segments.push_back(result);
+    if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) nextSize += result.size();
+  }
+
+  return result;
+}
+
+// -------------------------------------------------------------------
+
+namespace {
+
+constexpr size_t HUGE_PAGE_SIZE = 2u << 20;
+
+void* mapZeroedPages(size_t& size, MmapMessageBuilder::HugePages hugePages) {
+  // Maps `size` bytes of anonymous memory, rounding `size` up as needed for the page size in use.
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+  if (hugePages == MmapMessageBuilder::HugePages::NONE) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size = (size + pageSize - 1) & ~(pageSize - 1);
+    void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (result == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    return result;
+  }
+
+  size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  if (hugePages == MmapMessageBuilder::HugePages::EXPLICIT) {
+    // No MAP_NORESERVE here:  we want the kernel to reserve the huge pages now and fail the mmap()
+    // if there aren't enough, rather than SIGBUS when we touch them later.  The page size is
+    // requested explicitly (2^21 bytes = HUGE_PAGE_SIZE) because the system default may be
+    // larger, e.g. 1 GiB, and then `size` wouldn't be a multiple of it and munmap() would fail.
+    void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        (flags & ~MAP_NORESERVE) | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+    if (result != MAP_FAILED) {
+      return result;
+    }
+  }
+#endif
+
+  // Over-map by one huge page and trim, so that the result is huge-page-aligned.
+  size_t paddedSize = size + HUGE_PAGE_SIZE;
+  void* padded = mmap(nullptr, paddedSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (padded == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(padded);
+  uintptr_t alignedStart = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  if (alignedStart > start) {
+    munmap(padded, alignedStart - start);
+  }
+  if (alignedStart + size < start + paddedSize) {
+    munmap(reinterpret_cast<void*>(alignedStart + size), start + paddedSize - alignedStart - size);
+  }
+
+  void* result = reinterpret_cast<void*>(alignedStart);
+#ifdef MADV_HUGEPAGE
+  // Only a hint; fails harmlessly on kernels without THP.
+  madvise(result, size, MADV_HUGEPAGE);
+#endif
+  return result;
+}
+
+}  // namespace
+
+constexpr uint MmapMessageBuilder::MAX_SEGMENT_WORDS;
+
+struct MmapMessageBuilder::MoreSegments {
+  std::vector<Mapping> mappings;
+};
+
+MmapMessageBuilder::MmapMessageBuilder(size_t reserveWords, HugePages hugePages)
+    : nextSize(std::min<size_t>(reserveWords, MAX_SEGMENT_WORDS)), hugePages(hugePages),
+      firstMapping { nullptr, 0 } {}
+
+MmapMessageBuilder::~MmapMessageBuilder() {
+  if (firstMapping.ptr != nullptr) {
+    munmap(firstMapping.ptr, firstMapping.size);
+  }
+  if (moreSegments != nullptr) {
+    for (Mapping& mapping: moreSegments->mappings) {
+      munmap(mapping.ptr, mapping.size);
+    }
+  }
+}
+
+ArrayPtr<word> MmapMessageBuilder::allocateSegment(uint minimumSize) {
+  size_t size = std::max<size_t>(minimumSize, nextSize) * sizeof(word);
+  Mapping mapping { mapZeroedPages(size, hugePages), size };
+
+  if (firstMapping.ptr == nullptr) {
+    firstMapping = mapping;
+  } else {
+    if (moreSegments == nullptr) {
+      moreSegments = std::unique_ptr<MoreSegments>(new MoreSegments);
+    }
+    moreSegments->mappings.push_back(mapping);
+  }
+
+  // If the reservation overflowed, keep doubling the total size, like GROW_HEURISTICALLY.
+  size_t words = std::min<size_t>(size / sizeof(word), MAX_SEGMENT_WORDS);
+  nextSize = std::min<size_t>(nextSize + words, MAX_SEGMENT_WORDS);
+
+  return arrayPtr(reinterpret_cast<word*>(mapping.ptr), words);
+}
+
 }  // namespace capnproto
@@ -23,6 +23,7 @@
 
 #include <cstddef>
 #include <memory>
+#include <atomic>
 #include "macros.h"
 #include "type-safety.h"
 #include "layout.h"
@@ -92,7 +93,8 @@ struct ReaderOptions {
   // It makes sense to set a traversal limit that is much larger than the underlying message.
   // Together with sensible coding practices (e.g. trying to avoid calling sub-object getters
   // multiple times, which is expensive anyway), this should provide adequate protection without
-  // inconvenience.
+  // inconvenience.  Messages that are read over and over can instead be checked up front with
+  // MessageReader::validate(), after which the limit no longer applies.
   //
   // The default limit is 64 MiB.  This may or may not be a sensible number for any given use case,
   // but probably at least prevents easy exploitation while also avoiding causing problems in most
@@ -133,6 +135,49 @@ public:
   template <typename RootType>
   typename RootType::Reader getRoot();
 
+  bool validate();
+  // Walks the whole message once, checking every reference:  that it is well-formed and in bounds,
+  // that nothing is nested deeper than ReaderOptions::nestingLimit, and that no two objects overlap
+  // (which also rules out cycles).  Problems are reported to the ErrorReporter, the same as when
+  // they're found by a getter; returns false if there were any.
+  //
+  // Once a message has passed, the readers returned by getRoot() skip bounds checks and no longer
+  // count against the traversal limit, since the message can't be larger than it looks.  This
+  // makes sense for messages that are read many times, such as cached or mmap()ed data, which
+  // would otherwise pay for bounds checks on every access and could even hit the traversal limit
+  // by reading the same fields repeatedly.  Getters still check that each reference has the type
+  // they expect, since validation doesn't know the schema.  Calling validate() again does nothing.
+
+  void assumeValid();
+  // DANGER:  As with readMessageTrusted(), an invalid message can crash your program or worse.
+  //
+  // Treat the message as if validate() had succeeded, without checking it.  Unlike
+  // readMessageTrusted(), this works with messages of any number of segments.  Only use it for
+  // messages your own system created, e.g. files you wrote and are now mmap()ing back in.
+
+  Array<word> canonicalize();
+  // Returns the message in canonical form:  a single segment, starting with the root reference,
+  // with objects laid out in preorder, no far references, and trailing zero data words and null
+  // references trimmed from every struct.  Two messages with the same content have the same
+  // canonical bytes regardless of how they were built or segmented, so the result makes a good
+  // key for caching or deduplication, and can be read back with readMessageTrusted().  Invalid
+  // references are reported to the ErrorReporter and canonicalized as null, like the getters
+  // would treat them.
+
+  uint64_t canonicalHash();
+  // Equivalent to hashCanonicalMessage(canonicalize()).
+
+  bool canonicallyEquals(MessageReader& other);
+  // Returns true if the two messages have the same content, i.e. the same canonical form.  If the
+  // raw segments are byte-for-byte identical, returns true without canonicalizing either.
+
+protected:
+  void reset();
+  // Forget the segment table, so that the next getRoot() starts over with whatever getSegment()
+  // returns at that point.  For subclasses that read a sequence of messages into the same object.
+  // The arena and its tables are kept, so a reset reader can read a new message without
+  // allocating.  Readers previously returned by getRoot() become invalid.
+
 private:
   ReaderOptions options;
 
@@ -144,9 +189,36 @@ private:
   bool allocatedArena;
 
   internal::ReaderArena* arena() { return reinterpret_cast<internal::ReaderArena*>(arenaSpace); }
+  void allocateArena();
   internal::StructReader getRoot(const word* defaultValue);
 };
 
+struct AllocationStats {
+  // How a MessageBuilder used its memory.  Only collected when compiled with
+  // CAPNPROTO_ALLOCATION_STATS=1; otherwise getAllocationStats() returns all zeros.
+
+  uint64_t wordsAllocated = 0;
+  // Words handed out to objects, including far reference landing pads.  Space later given back by
+  // overwriting an object is not subtracted, and compact() counts the words it copies.
+
+  uint64_t wordsReserved = 0;
+  uint64_t segmentsAllocated = 0;
+  // Total size and number of segments obtained from allocateSegment().
+
+  uint64_t farReferences = 0;
+  // Objects that didn't fit in their parent's segment and so needed a far reference and a landing
+  // pad.  (Builders never need double-far landing pads, so there is no counter for those.)
+
+  uint64_t defaultValueCopies = 0;
+  // Times a get*() accessor found a field unset and deep-copied its default value into the message.
+
+  uint64_t wordsZeroed = 0;
+  // Words zeroed because an object was overwritten (see enableOverwriteZeroing()) or because
+  // compact() discarded the old segments.
+
+  AllocationStats& operator+=(const AllocationStats& other);
+};
+
 class MessageBuilder {
 public:
   MessageBuilder();
@@ -163,22 +235,83 @@ public:
   template <typename RootType>
   typename RootType::Builder getRoot();
 
+  template <typename Reader>
+  void setRoot(Reader value);
+  // Sets the root to a deep copy of the given struct Reader, which may belong to any message.  To
+  // get a single-segment message, make sure the first segment has room for
+  // value.totalSize().wordCount + 1 words, e.g. by passing that as MallocMessageBuilder's
+  // firstSegmentWords.
+
   ArrayPtr<const ArrayPtr<const word>> getSegmentsForOutput();
 
+  void compact();
+  // Rewrites the message into a single segment holding only the objects reachable from the root.
+  // Space left behind by overwritten fields is dropped, as are all far pointers, so
+  // getSegmentsForOutput() returns exactly one segment afterwards.  The memory of segments that are
+  // no longer needed stays with the message and is reused if it grows again.
+  //
+  // This copies the whole message, so call it once building is done, not after every change.  All
+  // Builders and Readers previously obtained from the message are invalidated; call getRoot() to
+  // get a new one.
+
+  void enableConcurrentBuilding();
+  // Allows different threads to fill in different parts of this message at the same time.  Must be
+  // called before the first call to initRoot() or getRoot().  After that, builders for different
+  // sub-objects may be handed to different threads, as long as no two threads modify the same
+  // object (including initializing fields of the same struct).  allocateSegment() is always called
+  // with a lock held, so subclasses do not need to be thread-safe themselves.
+  //
+  // In this mode each allocation costs an atomic fetch-add rather than a plain pointer bump, so it
+  // is off by default.  Do not call getSegmentsForOutput() until all building threads are done.
+
+  AllocationStats getAllocationStats();
+  // Counters describing the allocations made so far.  All zero unless the library was compiled
+  // with CAPNPROTO_ALLOCATION_STATS=1.
+
+  void enableOverwriteZeroing();
+  // By default, overwriting a struct, list, or blob field (e.g. calling initFoo() or setFoo()
+  // twice) simply abandons the old object, which stays in the message.  With this enabled, the
+  // old object and everything reachable from it is zeroed, so that it packs to almost nothing and
+  // doesn't leak into the output, and if it was the last thing allocated its space is given back.
+  // This roughly doubles the cost of an overwrite, so it is off by default.  Must be called before
+  // the first call to initRoot() or getRoot().
+  //
+  // Any Builder previously obtained for the overwritten object is invalidated.
+
+  void enableFreedSpaceReuse();
+  // Implies enableOverwriteZeroing().  Additionally, space freed in the middle of a segment is
+  // remembered and reused by later allocations that would otherwise spill into a new segment.
+  // Useful for messages that are edited heavily in place.  Must be called before the first call to
+  // initRoot() or getRoot().
+
 private:
   // Space in which we can construct a BuilderArena.  We don't use BuilderArena directly here
   // because we don't want clients to have to #include arena.h, which itself includes a bunch of
   // big STL headers.  We don't use a pointer to a BuilderArena because that would require an
   // extra malloc on every message which could be expensive when processing small messages.
+#if CAPNPROTO_ALLOCATION_STATS
+  void* arenaSpace[21];
+#else
   void* arenaSpace[15];
+#endif
   bool allocatedArena = false;
+  bool concurrentBuilding = false;
+  bool reuseFreedSpace = false;
+  bool zeroOverwritten = false;
 
   internal::BuilderArena* arena() { return reinterpret_cast<internal::BuilderArena*>(arenaSpace); }
   internal::SegmentBuilder* getRootSegment();
   internal::StructBuilder initRoot(const word* defaultValue);
   internal::StructBuilder getRoot(const word* defaultValue);
+  void setRoot(const internal::StructReader& value);
 };
 
+uint64_t hashCanonicalMessage(ArrayPtr<const word> canonical);
+// A fast 64-bit hash of a message in the form returned by MessageReader::canonicalize(), for
+// content-addressed caches that store canonical messages.  The hash depends only on the content,
+// not the machine's byte order.  It is not cryptographic, so don't rely on it where an attacker
+// could benefit from causing collisions; compare the canonical words themselves to be sure.
+
 template <typename RootType>
 static typename RootType::Reader readMessageTrusted(const word* data);
 // IF THE INPUT IS INVALID, THIS MAY CRASH, CORRUPT MEMORY, CREATE A SECURITY HOLE IN YOUR APP,
@@ -194,7 +327,7 @@ static typename RootType::Reader readMessageTrusted(const word* data);
 // size is larger than the message size.  This guarantees that the message will be allocated as a
 // single segment, meaning getSegmentsForOutput() returns a single word array.  That word array
 // is your message; you may pass a pointer to its first word into readTrusted() to read the
-// message.
+// message.  For messages with more than one segment, see MessageReader::assumeValid().
 //
 // This can be particularly handy for embedding messages in generated code:  you can
 // embed the raw bytes (using AlignedData) then make a Reader for it using this.  This is the way
@@ -243,6 +376,52 @@ enum class AllocationStrategy: uint8_t {
 constexpr uint SUGGESTED_FIRST_SEGMENT_WORDS = 1024;
 constexpr AllocationStrategy SUGGESTED_ALLOCATION_STRATEGY = AllocationStrategy::GROW_HEURISTICALLY;
 
+class AdaptiveFirstSegmentSize {
+  // Learns how big some kind of message tends to be, and suggests a first segment size such that
+  // about 99% of them fit in a single segment.  Share one instance across all builders of the same
+  // kind of message (e.g. make it a static next to the code that builds them), and pass it to
+  // MallocMessageBuilder in place of firstSegmentWords.
+  //
+  // The estimate is a running high percentile of recent final message sizes:  each message larger
+  // than the estimate raises it by a few percent, and each smaller one lowers it by a tiny amount,
+  // so that it settles where the right fraction of messages exceed it and follows the sizes as
+  // they drift.  Safe to use from multiple threads; simultaneous updates may occasionally overwrite
+  // each other, which only slows learning slightly.
+
+public:
+  explicit AdaptiveFirstSegmentSize(uint initialWords = SUGGESTED_FIRST_SEGMENT_WORDS,
+                                    double percentile = 0.99);
+  CAPNPROTO_DISALLOW_COPY(AdaptiveFirstSegmentSize);
+
+  inline uint suggest() const { return suggestedWords.load(std::memory_order_relaxed); }
+  // The first segment size to use for the next message, in words.
+
+  void record(size_t totalWords);
+  // Report the final total size of a message, in words.  MallocMessageBuilder does this
+  // automatically when destroyed; other MessageBuilders can call it with the sum of the sizes of
+  // the segments in getSegmentsForOutput() that they allocated themselves (i.e. not counting
+  // external data).
+
+  static constexpr uint MIN_WORDS = 16;
+  static constexpr uint MAX_WORDS = 1u << 20;
+  // The suggestion is kept within these bounds.  Beyond a few megabytes, zeroing a segment that
+  // might not be needed costs more than allocating a second segment.
+
+private:
+  int32_t upStep;
+  int32_t downStep;
+  // Adjustments to logEstimate when a message is bigger or not bigger than the estimate.  Their
+  // ratio determines the percentile.
+
+  std::atomic<int32_t> logEstimate;
+  // log2 of the estimated size in words, as fixed-point with LOG_FRACTION_BITS fractional bits.
+
+  std::atomic<uint> suggestedWords;
+  // 2^logEstimate, clamped, cached so that suggest() is just a load.
+
+  static constexpr int LOG_FRACTION_BITS = 16;
+};
+
 class MallocMessageBuilder: public MessageBuilder {
   // A simple MessageBuilder that uses malloc() (actually, calloc()) to allocate segments.  This
   // implementation should be reasonable for any case that doesn't require writing the message to
@@ -263,6 +442,12 @@ public:
   // The defaults have been chosen to be reasonable for most people, so don't change them unless you
   // have reason to believe you need to.
 
+  explicit MallocMessageBuilder(AdaptiveFirstSegmentSize& firstSegmentSize,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  // Uses firstSegmentSize.suggest() for the size of the first segment, and reports the message's
+  // final size back to firstSegmentSize when destroyed.  firstSegmentSize must outlive the
+  // builder.
+
   explicit MallocMessageBuilder(ArrayPtr<word> firstSegment,
       AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
   // This version always returns the given array for the first segment, and then proceeds with the
@@ -282,8 +467,141 @@ private:
   AllocationStrategy allocationStrategy;
 
   bool ownFirstSegment;
+  bool returnedFirstSegment;
   void* firstSegment;
 
+  AdaptiveFirstSegmentSize* firstSegmentSize = nullptr;
+
+  struct MoreSegments;
+  std::unique_ptr<MoreSegments> moreSegments;
+
+  bool isOwnSegment(const word* begin);
+  // Whether `begin` is the start of a segment this builder allocated (or was given).
+};
+
+template <uint N>
+class InlineMessageBuilder: public MessageBuilder {
+  // A MessageBuilder whose first segment, N words long, is part of the builder object itself, so
+  // that building a small message on the stack needs no heap allocation at all.  If the message
+  // outgrows the inline segment, more segments are allocated as in MallocMessageBuilder.
+  //
+  // The inline segment is zeroed when the builder is constructed, and nothing needs to be zeroed
+  // when it is destroyed, since the space goes away with it.  So choose N close to the size of the
+  // messages actually built, not "as big as might ever be needed":  zeroing unused space is wasted
+  // time, and a large N makes the builder too big for the stack anyway.
+
+public:
+  inline InlineMessageBuilder(AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY)
+      : firstSegment(), returnedFirstSegment(false), moreSegments(N, allocationStrategy) {}
+  CAPNPROTO_DISALLOW_COPY(InlineMessageBuilder);
+
+  virtual ArrayPtr<word> allocateSegment(uint minimumSize) override {
+    if (!returnedFirstSegment && minimumSize <= N) {
+      returnedFirstSegment = true;
+      return arrayPtr(firstSegment, N);
+    } else {
+      return moreSegments.allocateSegment(minimumSize);
+    }
+  }
+
+private:
+  static_assert(N > 0, "InlineMessageBuilder needs at least one inline word.");
+
+  word firstSegment[N];
+  bool returnedFirstSegment;
+
+  MallocMessageBuilder moreSegments;
+  // Never used as a message; it just allocates the segments that don't fit inline, and frees them
+  // when destroyed.  Constructing it doesn't allocate anything.
+};
+
+class PooledMessageBuilder: public MessageBuilder {
+  // A MessageBuilder which takes its segments from a per-thread pool of already-zeroed segments
+  // instead of calling calloc() for each one.  When the builder is destroyed, only the part of each
+  // segment that the message actually used is re-zeroed before the segment goes back to the pool,
+  // so building lots of messages in a loop avoids both malloc/free and zeroing whole segments.
+  //
+  // Segments are rounded up to power-of-two size classes.  Segments larger than the largest size
+  // class (128k words) are allocated and freed directly.  Each thread's pool holds at most
+  // MAX_POOLED_WORDS_PER_THREAD words; segments released beyond that are freed.
+  //
+  // A builder may be destroyed on a different thread than the one that built it.  In that case
+  // its segments are handed back to the building thread's pool through a lock-free list, which
+  // that thread drains the next time it runs out of segments of some size.  If the building thread
+  // has already exited, the segments are simply freed.
+
+public:
+  explicit PooledMessageBuilder(uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  // Same as the corresponding MallocMessageBuilder constructor.
+
+  CAPNPROTO_DISALLOW_COPY(PooledMessageBuilder);
+  virtual ~PooledMessageBuilder();
+
+  virtual ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+  static constexpr uint MAX_POOLED_WORDS_PER_THREAD = 1u << 20;
+  // 8 MiB.
+
+private:
+  class Pool;
+
+  uint nextSize;
+  AllocationStrategy allocationStrategy;
+
+  std::shared_ptr<Pool> pool;
+  ArrayPtr<word> firstSegment;
+
+  struct MoreSegments;
+  std::unique_ptr<MoreSegments> moreSegments;
+};
+
+class MmapMessageBuilder: public MessageBuilder {
+  // A MessageBuilder for very large messages.  The first segment is a single anonymous mmap()
+  // reservation big enough for the whole message.  Physical pages are only faulted in as the
+  // message grows into them, and they come from the kernel already zeroed, so the message stays in
+  // one segment (no far pointers) without ever calling memset() or copying.  Only if the
+  // reservation turns out to be too small are further segments mapped.
+  //
+  // Reserving address space is cheap on 64-bit systems, so err on the side of reserving too much.
+
+public:
+  enum class HugePages: uint8_t {
+    NONE,
+    // Use normal pages.
+
+    TRANSPARENT,
+    // Align mappings to 2 MiB and madvise(MADV_HUGEPAGE) them so that the kernel backs them with
+    // transparent huge pages when it can.  Harmless if THP is disabled.
+
+    EXPLICIT
+    // Map with MAP_HUGETLB, using 2 MiB pages.  This needs 2 MiB huge pages to have been reserved
+    // by the administrator; if the mapping fails, falls back to TRANSPARENT.
+  };
+
+  static constexpr uint MAX_SEGMENT_WORDS = internal::MAX_SEGMENT_WORDS;
+  // Largest segment that can be addressed by a pointer:  4 GiB.
+
+  explicit MmapMessageBuilder(size_t reserveWords = 1u << 27,
+                              HugePages hugePages = HugePages::TRANSPARENT);
+  // Reserves `reserveWords` words (1 GiB by default) for the first segment, capped at
+  // MAX_SEGMENT_WORDS.  Nothing is mapped until the message root is first initialized.
+
+  CAPNPROTO_DISALLOW_COPY(MmapMessageBuilder);
+  virtual ~MmapMessageBuilder();
+
+  virtual ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+private:
+  size_t nextSize;
+  HugePages hugePages;
+
+  struct Mapping {
+    void* ptr;
+    size_t size;
+  };
+  Mapping firstMapping;
+
   struct MoreSegments;
   std::unique_ptr<MoreSegments> moreSegments;
 };
@@ -310,6 +628,11 @@ inline typename RootType::Builder MessageBuilder::getRoot() {
   return typename RootType::Builder(getRoot(RootType::DEFAULT.words));
 }
 
+template <typename Reader>
+inline void MessageBuilder::setRoot(Reader value) {
+  setRoot(internal::ReaderAccess::getStructReader(value));
+}
+
 template <typename RootType>
 typename RootType::Reader readMessageTrusted(const word* data) {
   return typename RootType::Reader(internal::StructReader::readRootTrusted(
@@ -376,6 +376,24 @@ TEST(Packed, RoundTripTwoMessages) {
   }
 }
 
+TEST(Packed, RoundTripTwoMessagesReset) {
+  TestMessageBuilder builder(7);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  TestMessageBuilder builder2(1);
+  builder2.initRoot<TestAllTypes>().setTextField("Second message.");
+
+  TestPipe pipe;
+  writePackedMessage(pipe, builder);
+  writePackedMessage(pipe, builder2);
+
+  PackedMessageReader reader(pipe);
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+
+  reader.reset();
+  EXPECT_EQ("Second message.", reader.getRoot<TestAllTypes>().getTextField());
+}
+
 // =======================================================================================
 
 TEST(Packed, RoundTripAllZero) {
@@ -25,7 +25,15 @@
 #include "serialize.h"
 #include <gtest/gtest.h>
 #include <string>
+#include <vector>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <thread>
 #include "test-util.h"
 
 namespace capnproto {
@@ -200,6 +208,112 @@ TEST(Serialize, InputStreamEvenSegmentCountLazy) {
   checkTestMessage(reader.getRoot<TestAllTypes>());
 }
 
+TEST(Serialize, InputStreamInPlace) {
+  TestMessageBuilder builder(7);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  Array<word> serialized = messageToFlatArray(builder);
+  ArrayPtr<const byte> bytes = arrayPtr(reinterpret_cast<const byte*>(serialized.begin()),
+                                        serialized.size() * sizeof(word));
+
+  ArrayInputStream stream(bytes);
+  {
+    BufferedInputStreamMessageReader reader(stream, ReaderOptions());
+
+    // The whole message is in the stream's buffer, so the segments point straight into it.
+    for (uint i = 0; i < 7; i++) {
+      ArrayPtr<const word> segment = reader.getSegment(i);
+      EXPECT_TRUE(segment.begin() >= serialized.begin() && segment.end() <= serialized.end());
+    }
+    checkTestMessage(reader.getRoot<TestAllTypes>());
+
+    // Nothing is consumed until the reader is done with the buffer.
+    EXPECT_EQ(bytes.size(), stream.getReadBuffer().size());
+  }
+  EXPECT_EQ(0u, stream.getReadBuffer().size());
+}
+
+TEST(Serialize, InputStreamInPlaceStraddlesRefill) {
+  TestMessageBuilder builder(7);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  Array<word> serialized = messageToFlatArray(builder);
+
+  // The wrapper's buffer is much smaller than the message, so it must be copied.
+  ArrayInputStream inner(arrayPtr(reinterpret_cast<const byte*>(serialized.begin()),
+                                  serialized.size() * sizeof(word)));
+  word buffer[8];
+  BufferedInputStreamWrapper stream(
+      inner, arrayPtr(reinterpret_cast<byte*>(buffer), sizeof(buffer)));
+  BufferedInputStreamMessageReader reader(stream, ReaderOptions());
+
+  const word* segment0 = reader.getSegment(0).begin();
+  EXPECT_TRUE(segment0 < buffer || segment0 >= buffer + 8);
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+}
+
+TEST(Serialize, InputStreamFromBufferedStreamConsumesEagerly) {
+  // A plain InputStreamMessageReader doesn't read in place, even from a BufferedInputStream, so
+  // two readers alive at once get consecutive messages.
+  TestMessageBuilder builder1(1);
+  builder1.initRoot<TestAllTypes>().setUInt32Field(1000);
+  TestMessageBuilder builder2(1);
+  builder2.initRoot<TestAllTypes>().setUInt32Field(1001);
+
+  Array<word> serialized1 = messageToFlatArray(builder1);
+  Array<word> serialized2 = messageToFlatArray(builder2);
+  Array<word> both = newArray<word>(serialized1.size() + serialized2.size());
+  memcpy(both.begin(), serialized1.begin(), serialized1.size() * sizeof(word));
+  memcpy(both.begin() + serialized1.size(), serialized2.begin(),
+         serialized2.size() * sizeof(word));
+
+  ArrayInputStream stream(arrayPtr(reinterpret_cast<const byte*>(both.begin()),
+                                   both.size() * sizeof(word)));
+  InputStreamMessageReader reader1(stream, ReaderOptions());
+  InputStreamMessageReader reader2(stream, ReaderOptions());
+  EXPECT_EQ(1000u, reader1.getRoot<TestAllTypes>().getUInt32Field());
+  EXPECT_EQ(1001u, reader2.getRoot<TestAllTypes>().getUInt32Field());
+}
+
+TEST(Serialize, InputStreamReset) {
+  TestMessageBuilder builder(1);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  TestMessageBuilder builder2(10);
+  initTestMessage(builder2.initRoot<TestAllTypes>());
+  TestMessageBuilder builder3(7);
+  initTestMessage(builder3.initRoot<TestAllTypes>());
+  TestMessageBuilder builder4(1);
+  builder4.initRoot<TestAllTypes>().setTextField("Last message.");
+
+  Array<word> serialized[4] = {
+    messageToFlatArray(builder), messageToFlatArray(builder2),
+    messageToFlatArray(builder3), messageToFlatArray(builder4)
+  };
+  size_t totalSize = 0;
+  for (auto& message: serialized) {
+    totalSize += message.size();
+  }
+  Array<word> all = newArray<word>(totalSize);
+  word* pos = all.begin();
+  for (auto& message: serialized) {
+    memcpy(pos, message.begin(), message.size() * sizeof(word));
+    pos += message.size();
+  }
+
+  TestInputStream stream(all.asPtr(), true);
+  InputStreamMessageReader reader(stream, ReaderOptions());
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+
+  // Don't look at the second message, so that reset() has to skip over its unread segments.
+  reader.reset();
+
+  reader.reset();
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+
+  reader.reset();
+  EXPECT_EQ("Last message.", reader.getRoot<TestAllTypes>().getTextField());
+}
+
 class TestOutputStream: public OutputStream {
 public:
   TestOutputStream() {}
@@ -254,6 +368,80 @@ TEST(Serialize, WriteMessageEvenSegmentCount) {
   EXPECT_TRUE(output.dataEquals(serialized.asPtr()));
 }
 
+class BatchCountingOutputStream: public TestOutputStream {
+public:
+  uint batches = 0;
+
+  using TestOutputStream::write;
+  void write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
+    ++batches;
+    OutputStream::write(pieces);
+  }
+};
+
+Array<word> repeat(ArrayPtr<const word> words, uint count) {
+  Array<word> result = newArray<word>(words.size() * count);
+  for (uint i = 0; i < count; i++) {
+    memcpy(result.begin() + i * words.size(), words.begin(), words.size() * sizeof(word));
+  }
+  return result;
+}
+
+TEST(Serialize, BatchingMessageWriter) {
+  TestMessageBuilder builder(7);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  Array<word> serialized = messageToFlatArray(builder);
+
+  BatchCountingOutputStream output;
+  {
+    BatchingOptions options;
+    options.maxMessages = 3;
+    options.copyLimitBytes = 1u << 20;
+    BatchingMessageWriter writer(output, options);
+    for (uint i = 0; i < 5; i++) {
+      writer.write(builder);
+    }
+    EXPECT_EQ(1u, output.batches);
+
+    writer.flush();
+    EXPECT_EQ(2u, output.batches);
+  }
+  // Nothing was left to write on destruction.
+  EXPECT_EQ(2u, output.batches);
+
+  EXPECT_TRUE(output.dataEquals(repeat(serialized.asPtr(), 5).asPtr()));
+}
+
+TEST(Serialize, BatchingMessageWriterLargeSegments) {
+  TestMessageBuilder builder(7);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  Array<word> serialized = messageToFlatArray(builder);
+
+  BatchCountingOutputStream output;
+  {
+    // Every segment is written from the message, so each write() must flush.
+    BatchingOptions options;
+    options.copyLimitBytes = 0;
+    BatchingMessageWriter writer(output, options);
+    writer.write(builder);
+    EXPECT_EQ(1u, output.batches);
+    writer.write(builder);
+    EXPECT_EQ(2u, output.batches);
+  }
+
+  {
+    // A staging buffer much smaller than the message.
+    BatchingOptions options;
+    options.maxBytes = 64;
+    BatchingMessageWriter writer(output, options);
+    writer.write(builder);
+  }
+
+  EXPECT_TRUE(output.dataEquals(repeat(serialized.asPtr(), 3).asPtr()));
+}
+
 TEST(Serialize, FileDescriptors) {
   char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
   AutoCloseFd tmpfile(mkstemp(filename));
@@ -287,6 +475,341 @@ TEST(Serialize, FileDescriptors) {
   }
 }
 
+std::string readAll(int fd) {
+  std::string result;
+  char buffer[4096];
+  for (;;) {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    EXPECT_GE(n, 0);
+    if (n <= 0) return result;
+    result.append(buffer, n);
+  }
+}
+
+TEST(Serialize, FdOutputStreamManyPieces) {
+  // More pieces than writev() accepts in one call, including some empty ones.
+  std::string expected;
+  for (uint i = 0; i < IOV_MAX * 2 + 3; i++) {
+    expected.append(i % 5, 'a' + i % 26);
+  }
+
+  std::vector<ArrayPtr<const byte>> pieces;
+  const byte* pos = reinterpret_cast<const byte*>(expected.data());
+  for (uint i = 0; i < IOV_MAX * 2 + 3; i++) {
+    pieces.push_back(arrayPtr(pos, i % 5));
+    pos += i % 5;
+  }
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  AutoCloseFd input(fds[0]);
+
+  std::string actual;
+  std::thread reader([&]() { actual = readAll(input.get()); });
+  {
+    FdOutputStream output{AutoCloseFd(fds[1])};
+    output.write(arrayPtr(pieces.data(), pieces.size()));
+  }
+  reader.join();
+
+  EXPECT_TRUE(expected == actual);
+}
+
+void ignoreSignal(int) {}
+
+TEST(Serialize, FdOutputStreamInterrupted) {
+  // Interrupt a writev() to a full pipe over and over, so that it fails with EINTR or returns
+  // after writing only part of the pieces.  Every byte must still arrive exactly once.
+  struct sigaction action, oldAction;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &ignoreSignal;  // No SA_RESTART.
+  ASSERT_EQ(0, sigaction(SIGUSR1, &action, &oldAction));
+
+  std::string expected;
+  for (uint i = 0; i < 256 * 4096; i++) {
+    expected.push_back(i * 7 % 251);
+  }
+
+  std::vector<ArrayPtr<const byte>> pieces;
+  for (uint i = 0; i < 256; i++) {
+    pieces.push_back(arrayPtr(reinterpret_cast<const byte*>(expected.data()) + i * 4096, 4096));
+  }
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  AutoCloseFd input(fds[0]);
+
+  bool done = false;
+  std::thread writer([&]() {
+    FdOutputStream output{AutoCloseFd(fds[1])};
+    output.write(arrayPtr(pieces.data(), pieces.size()));
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+  });
+
+  // Let the writer fill the pipe and block before the first signal.
+  usleep(10000);
+
+  // Read in odd-sized chunks so that the writer keeps finding room for only part of a piece.
+  std::string actual;
+  char buffer[1000];
+  for (;;) {
+    if (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+      pthread_kill(writer.native_handle(), SIGUSR1);
+    }
+    ssize_t n = read(input.get(), buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    EXPECT_GE(n, 0);
+    if (n <= 0) break;
+    actual.append(buffer, n);
+  }
+  writer.join();
+
+  sigaction(SIGUSR1, &oldAction, nullptr);
+
+  EXPECT_TRUE(expected == actual);
+}
+
+TEST(Serialize, MessageStreamReader) {
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+  AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+
+  // Unlink the file so that it will be deleted on close.
+  EXPECT_EQ(0, unlink(filename));
+
+  for (uint i = 0; i < 20; i++) {
+    if (i % 5 == 2) {
+      // Much bigger than the reader's buffer.
+      TestMessageBuilder builder(7);
+      initTestMessage(builder.initRoot<TestAllTypes>());
+      writeMessageToFd(tmpfile.get(), builder);
+    } else {
+      TestMessageBuilder builder(1);
+      builder.initRoot<TestAllTypes>().setUInt32Field(i);
+      writeMessageToFd(tmpfile.get(), builder);
+    }
+  }
+
+  lseek(tmpfile, 0, SEEK_SET);
+
+  // A tiny buffer so that messages straddle the end of it.
+  MessageStreamReader stream(tmpfile.get(), ReaderOptions(), 64);
+  for (uint i = 0; i < 20; i++) {
+    ASSERT_TRUE(stream.next());
+    if (i % 5 == 2) {
+      checkTestMessage(stream.getMessage().getRoot<TestAllTypes>());
+    } else {
+      EXPECT_EQ(i, stream.getMessage().getRoot<TestAllTypes>().getUInt32Field());
+    }
+  }
+  EXPECT_FALSE(stream.next());
+}
+
+TEST(Serialize, MessageStreamReaderTruncated) {
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+  AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+  EXPECT_EQ(0, unlink(filename));
+
+  TestMessageBuilder builder(1);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  Array<word> serialized = messageToFlatArray(builder);
+  FdOutputStream(tmpfile.get()).write(serialized.begin(), serialized.size() * sizeof(word) - 8);
+
+  lseek(tmpfile, 0, SEEK_SET);
+
+  MessageStreamReader stream(tmpfile.get());
+  EXPECT_ANY_THROW(stream.next());
+  EXPECT_FALSE(stream.next());
+}
+
+Array<word> readWholeFile(int fd) {
+  off_t size = lseek(fd, 0, SEEK_END);
+  EXPECT_EQ(0, size % sizeof(word));
+  Array<word> result = newArray<word>(size / sizeof(word));
+  EXPECT_EQ(size, pread(fd, result.begin(), size, 0));
+  return result;
+}
+
+TEST(Serialize, FdFileMessageBuilder) {
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+  AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+
+  // Unlink the file so that it will be deleted on close.
+  EXPECT_EQ(0, unlink(filename));
+
+  {
+    FdFileMessageBuilder builder(tmpfile.get());
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    size_t size = builder.finish();
+
+    TestMessageBuilder expected(1);
+    initTestMessage(expected.initRoot<TestAllTypes>());
+
+    // The segment table has room for 16 segments, 15 of which are empty.
+    EXPECT_EQ((messageToFlatArray(expected).size() + 8) * sizeof(word), size);
+  }
+
+  {
+    Array<word> contents = readWholeFile(tmpfile.get());
+    FlatArrayMessageReader reader(contents.asPtr());
+    checkTestMessage(reader.getRoot<TestAllTypes>());
+  }
+
+  {
+    // Overflow the first segment (a single page) into a second one, then overwrite the file.
+    FdFileMessageBuilder builder(tmpfile.get(), 0, 3);
+    auto root = builder.initRoot<TestAllTypes>();
+    auto list = root.initInt64List(5000);
+    for (uint i = 0; i < 5000; i++) {
+      list.set(i, i * 3);
+    }
+    root.setTextField("after the big list");
+
+    EXPECT_EQ(2u, builder.getSegmentsForOutput().size());
+    builder.finish();
+  }
+
+  {
+    Array<word> contents = readWholeFile(tmpfile.get());
+    FlatArrayMessageReader reader(contents.asPtr());
+    auto root = reader.getRoot<TestAllTypes>();
+    auto list = root.getInt64List();
+    ASSERT_EQ(5000u, list.size());
+    for (uint i = 0; i < 5000; i++) {
+      EXPECT_EQ(i * 3, list[i]);
+    }
+    EXPECT_EQ("after the big list", root.getTextField());
+  }
+}
+
+TEST(Serialize, FdFileMessageBuilderDiscardsOldContent) {
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+  AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+
+  // Unlink the file so that it will be deleted on close.
+  EXPECT_EQ(0, unlink(filename));
+
+  // Fill the file with garbage that would be mapped into the first segment if left in place.
+  char garbage[8192];
+  memset(garbage, 'A', sizeof(garbage));
+  ASSERT_EQ(ssize_t(sizeof(garbage)), pwrite(tmpfile.get(), garbage, sizeof(garbage), 0));
+
+  {
+    FdFileMessageBuilder builder(tmpfile.get(), 0, 3);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    builder.finish();
+  }
+
+  {
+    Array<word> contents = readWholeFile(tmpfile.get());
+    FlatArrayMessageReader reader(contents.asPtr());
+    checkTestMessage(reader.getRoot<TestAllTypes>());
+  }
+}
+
+TEST(Serialize, FdFileMessageBuilderRejectsMovedSegments) {
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+  AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+
+  // Unlink the file so that it will be deleted on close.
+  EXPECT_EQ(0, unlink(filename));
+
+  // compact() moves the message into the bigger second segment, so segment 0 of the output is no
+  // longer at the start of the file.
+  FdFileMessageBuilder builder(tmpfile.get(), 0, 3);
+  auto root = builder.initRoot<TestAllTypes>();
+  auto list = root.initInt64List(5000);
+  for (uint i = 0; i < 5000; i++) {
+    list.set(i, i * 3);
+  }
+  builder.compact();
+
+  EXPECT_ANY_THROW(builder.finish());
+}
+
+TEST(Serialize, FdFileMessageReader) {
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+  AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+
+  // Unlink the file so that it will be deleted on close.
+  EXPECT_EQ(0, unlink(filename));
+
+  size_t firstSize;
+  {
+    TestMessageBuilder builder(7);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    firstSize = messageToFlatArray(builder).size() * sizeof(word);
+    writeMessageToFd(tmpfile.get(), builder);
+  }
+
+  {
+    TestMessageBuilder builder(1);
+    builder.initRoot<TestAllTypes>().setTextField("second message in file");
+    writeMessageToFd(tmpfile.get(), builder);
+  }
+
+  {
+    FdFileMessageReader reader(tmpfile.get(), ReaderOptions(), FileAdvice::RANDOM);
+    checkTestMessage(reader.getRoot<TestAllTypes>());
+  }
+
+  {
+    off_t fileSize = lseek(tmpfile, 0, SEEK_END);
+    FdFileMessageReader reader(tmpfile.get(), firstSize, fileSize - firstSize);
+    EXPECT_EQ("second message in file", reader.getRoot<TestAllTypes>().getTextField());
+  }
+
+  {
+    // A range past the end of the file is rejected up front, rather than raising SIGBUS when the
+    // missing pages are touched.
+    off_t fileSize = lseek(tmpfile, 0, SEEK_END);
+    EXPECT_ANY_THROW(FdFileMessageReader(tmpfile.get(), firstSize, fileSize - firstSize + 8192));
+    EXPECT_ANY_THROW(FdFileMessageReader(tmpfile.get(), fileSize + 8192, 64));
+  }
+
+  {
+    FdFileMessageIterator iter(tmpfile.get());
+
+    ASSERT_TRUE(iter.next());
+    EXPECT_EQ(0u, iter.getOffset());
+    checkTestMessage(iter.getMessage().getRoot<TestAllTypes>());
+
+    ASSERT_TRUE(iter.next());
+    EXPECT_EQ(firstSize, iter.getOffset());
+    EXPECT_EQ("second message in file", iter.getMessage().getRoot<TestAllTypes>().getTextField());
+
+    EXPECT_FALSE(iter.next());
+  }
+
+  {
+    // Chop the end off the second message.
+    off_t fileSize = lseek(tmpfile, 0, SEEK_END);
+    EXPECT_EQ(0, ftruncate(tmpfile, fileSize - sizeof(word)));
+
+    FdFileMessageIterator iter(tmpfile.get());
+    ASSERT_TRUE(iter.next());
+    checkTestMessage(iter.getMessage().getRoot<TestAllTypes>());
+    EXPECT_ANY_THROW(iter.next());
+    EXPECT_FALSE(iter.next());
+  }
+}
+
+TEST(Serialize, FdFileMessageReaderEmptyFile) {
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+  AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+  EXPECT_EQ(0, unlink(filename));
+
+  FdFileMessageIterator iter(tmpfile.get());
+  EXPECT_FALSE(iter.next());
+}
+
 // TODO:  Test error cases.
 
 }  // namespace
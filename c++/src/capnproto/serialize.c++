@@ -23,16 +23,36 @@
 
 #include "serialize.h"
 #include "layout.h"
+#include <exception>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 namespace capnproto {
 
 FlatArrayMessageReader::FlatArrayMessageReader(ArrayPtr<const word> array, ReaderOptions options)
-    : MessageReader(options) {
+    : MessageReader(options), moreSegmentCount(0), end(array.begin()) {
+  parse(array);
+}
+
+void FlatArrayMessageReader::reset(ArrayPtr<const word> array) {
+  segment0 = nullptr;
+  moreSegmentCount = 0;
+  end = array.begin();
+  parse(array);
+  MessageReader::reset();
+}
+
+void FlatArrayMessageReader::parse(ArrayPtr<const word> array) {
   if (array.size() < 1) {
     // Assume empty message.
     return;
   }
 
+  ErrorReporter* errorReporter = getOptions().errorReporter;
+
   const internal::WireValue<uint32_t>* table =
       reinterpret_cast<const internal::WireValue<uint32_t>*>(array.begin());
 
@@ -40,18 +60,21 @@ FlatArrayMessageReader::FlatArrayMessageReader(ArrayPtr<const word> array, Reade
   size_t offset = segmentCount / 2u + 1u;
 
   if (array.size() < offset) {
-    options.errorReporter->reportError("Message ends prematurely in segment table.");
+    end = array.end();
+    errorReporter->reportError("Message ends prematurely in segment table.");
     return;
   }
 
   if (segmentCount == 0) {
+    end = array.begin() + offset;
     return;
   }
 
   uint segmentSize = table[1].get();
 
   if (array.size() < offset + segmentSize) {
-    options.errorReporter->reportError("Message ends prematurely in first segment.");
+    end = array.end();
+    errorReporter->reportError("Message ends prematurely in first segment.");
     return;
   }
 
@@ -59,27 +82,33 @@ FlatArrayMessageReader::FlatArrayMessageReader(ArrayPtr<const word> array, Reade
   offset += segmentSize;
 
   if (segmentCount > 1) {
-    moreSegments = newArray<ArrayPtr<const word>>(segmentCount - 1);
+    if (moreSegments.size() < segmentCount - 1) {
+      moreSegments = newArray<ArrayPtr<const word>>(segmentCount - 1);
+    }
 
     for (uint i = 1; i < segmentCount; i++) {
       uint segmentSize = table[i + 1].get();
 
       if (array.size() < offset + segmentSize) {
-        moreSegments = nullptr;
-        options.errorReporter->reportError("Message ends prematurely.");
+        end = array.end();
+        errorReporter->reportError("Message ends prematurely.");
         return;
       }
 
       moreSegments[i - 1] = array.slice(offset, offset + segmentSize);
       offset += segmentSize;
     }
+
+    moreSegmentCount = segmentCount - 1;
   }
+
+  end = array.begin() + offset;
 }
 
 ArrayPtr<const word> FlatArrayMessageReader::getSegment(uint id) {
   if (id == 0) {
     return segment0;
-  } else if (id <= moreSegments.size()) {
+  } else if (id <= moreSegmentCount) {
     return moreSegments[id - 1];
   } else {
     return nullptr;
@@ -130,7 +159,45 @@ Array<word> messageToFlatArray(ArrayPtr<const ArrayPtr<const word>> segments) {
 
 InputStreamMessageReader::InputStreamMessageReader(
     InputStream& inputStream, ReaderOptions options, ArrayPtr<word> scratchSpace)
-    : MessageReader(options), inputStream(inputStream), readPos(nullptr) {
+    : MessageReader(options), inputStream(inputStream), bufferedStream(nullptr),
+      scratchSpace(scratchSpace), readPos(nullptr), pinnedBytes(0), moreSegmentCount(0) {
+  readMessage();
+}
+
+InputStreamMessageReader::InputStreamMessageReader(
+    BufferedInputStream& inputStream, ReaderOptions options, ArrayPtr<word> scratchSpace,
+    bool readInPlace)
+    : MessageReader(options), inputStream(inputStream),
+      bufferedStream(readInPlace ? &inputStream : nullptr),
+      scratchSpace(scratchSpace), readPos(nullptr), pinnedBytes(0), moreSegmentCount(0) {
+  readMessage();
+}
+
+InputStreamMessageReader::~InputStreamMessageReader() {
+  if (readPos != nullptr || pinnedBytes != 0) {
+    if (std::uncaught_exception()) {
+      try {
+        skipUnreadSegments();
+      } catch (...) {
+        // TODO:  Devise some way to report secondary errors during unwind.
+      }
+    } else {
+      skipUnreadSegments();
+    }
+  }
+}
+
+void InputStreamMessageReader::reset() {
+  skipUnreadSegments();
+  readMessage();
+  MessageReader::reset();
+}
+
+void InputStreamMessageReader::readMessage() {
+  if (bufferedStream != nullptr && tryReadInPlace()) {
+    return;
+  }
+
   internal::WireValue<uint32_t> firstWord[2];
 
   inputStream.read(firstWord, sizeof(firstWord));
@@ -149,53 +216,113 @@ InputStreamMessageReader::InputStreamMessageReader(
     }
   }
 
-  if (scratchSpace.size() < totalWords) {
-    // TODO:  Consider allocating each segment as a separate chunk to reduce memory fragmentation.
-    ownedSpace = newArray<word>(totalWords);
-    scratchSpace = ownedSpace;
+  ArrayPtr<word> space = scratchSpace;
+  if (space.size() < totalWords) {
+    if (ownedSpace.size() < totalWords) {
+      // TODO:  Consider allocating each segment as a separate chunk to reduce memory fragmentation.
+      ownedSpace = newArray<word>(totalWords);
+    }
+    space = ownedSpace;
   }
 
-  segment0 = scratchSpace.slice(0, segment0Size);
+  segment0 = space.slice(0, segment0Size);
 
-  if (segmentCount > 1) {
-    moreSegments = newArray<ArrayPtr<const word>>(segmentCount - 1);
+  moreSegmentCount = segmentCount > 1 ? segmentCount - 1 : 0;
+  if (moreSegmentCount > 0) {
+    if (moreSegments.size() < moreSegmentCount) {
+      moreSegments = newArray<ArrayPtr<const word>>(moreSegmentCount);
+    }
     size_t offset = segment0Size;
 
-    for (uint i = 0; i < segmentCount - 1; i++) {
+    for (uint i = 0; i < moreSegmentCount; i++) {
       uint segmentSize = moreSizes[i].get();
-      moreSegments[i] = scratchSpace.slice(offset, offset + segmentSize);
+      moreSegments[i] = space.slice(offset, offset + segmentSize);
       offset += segmentSize;
     }
   }
 
   if (segmentCount == 1) {
-    inputStream.read(scratchSpace.begin(), totalWords * sizeof(word));
+    inputStream.read(space.begin(), totalWords * sizeof(word));
   } else if (segmentCount > 1) {
-    readPos = reinterpret_cast<byte*>(scratchSpace.begin());
+    readPos = reinterpret_cast<byte*>(space.begin());
     readPos += inputStream.read(readPos, segment0Size * sizeof(word), totalWords * sizeof(word));
   }
 }
 
-InputStreamMessageReader::~InputStreamMessageReader() {
-  if (readPos != nullptr) {
-    // Note that lazy reads only happen when we have multiple segments, so moreSegments.back() is
-    // valid.
-    const byte* allEnd = reinterpret_cast<const byte*>(moreSegments.back().end());
+bool InputStreamMessageReader::tryReadInPlace() {
+  ArrayPtr<const byte> buffer = bufferedStream->getReadBuffer();
 
-    if (std::uncaught_exception()) {
-      try {
-        inputStream.skip(allEnd - readPos);
-      } catch (...) {
-        // TODO:  Devise some way to report secondary errors during unwind.
-      }
-    } else {
-      inputStream.skip(allEnd - readPos);
+  if (reinterpret_cast<uintptr_t>(buffer.begin()) % sizeof(word) != 0 ||
+      buffer.size() < sizeof(word)) {
+    return false;
+  }
+
+  const word* start = reinterpret_cast<const word*>(buffer.begin());
+  size_t available = buffer.size() / sizeof(word);
+  const internal::WireValue<uint32_t>* table =
+      reinterpret_cast<const internal::WireValue<uint32_t>*>(start);
+
+  uint segmentCount = table[0].get() + 1;
+  if (segmentCount == 0) {
+    // Let the copying path deal with this.
+    return false;
+  }
+
+  size_t offset = segmentCount / 2u + 1u;
+  if (available < offset) {
+    return false;
+  }
+
+  size_t totalWords = offset;
+  for (uint i = 0; i < segmentCount; i++) {
+    totalWords += table[i + 1].get();
+  }
+  if (available < totalWords) {
+    return false;
+  }
+
+  segment0 = arrayPtr(start + offset, table[1].get());
+  offset += table[1].get();
+
+  moreSegmentCount = segmentCount - 1;
+  if (moreSegmentCount > 0) {
+    if (moreSegments.size() < moreSegmentCount) {
+      moreSegments = newArray<ArrayPtr<const word>>(moreSegmentCount);
+    }
+
+    for (uint i = 0; i < moreSegmentCount; i++) {
+      uint segmentSize = table[i + 2].get();
+      moreSegments[i] = arrayPtr(start + offset, segmentSize);
+      offset += segmentSize;
     }
   }
+
+  pinnedBytes = totalWords * sizeof(word);
+  return true;
+}
+
+void InputStreamMessageReader::skipUnreadSegments() {
+  if (pinnedBytes != 0) {
+    // Clear pinnedBytes first so that a failed skip isn't retried by the destructor.
+    size_t bytes = pinnedBytes;
+    pinnedBytes = 0;
+    bufferedStream->skip(bytes);
+  }
+
+  if (readPos != nullptr) {
+    // Note that lazy reads only happen when we have multiple segments, so the last of
+    // moreSegments is valid.
+    const byte* allEnd = reinterpret_cast<const byte*>(moreSegments[moreSegmentCount - 1].end());
+    byte* pos = readPos;
+
+    // Clear readPos first so that a failed skip isn't retried by the destructor.
+    readPos = nullptr;
+    inputStream.skip(allEnd - pos);
+  }
 }
 
 ArrayPtr<const word> InputStreamMessageReader::getSegment(uint id) {
-  if (id > moreSegments.size()) {
+  if (id > moreSegmentCount) {
     return nullptr;
   }
 
@@ -205,9 +332,9 @@ ArrayPtr<const word> InputStreamMessageReader::getSegment(uint id) {
     // May need to lazily read more data.
     const byte* segmentEnd = reinterpret_cast<const byte*>(segment.end());
     if (readPos < segmentEnd) {
-      // Note that lazy reads only happen when we have multiple segments, so moreSegments.back() is
-      // valid.
-      const byte* allEnd = reinterpret_cast<const byte*>(moreSegments.back().end());
+      // Note that lazy reads only happen when we have multiple segments, so the last of
+      // moreSegments is valid.
+      const byte* allEnd = reinterpret_cast<const byte*>(moreSegments[moreSegmentCount - 1].end());
       readPos += inputStream.read(readPos, segmentEnd - readPos, allEnd - readPos);
     }
   }
@@ -245,6 +372,138 @@ void writeMessage(OutputStream& output, ArrayPtr<const ArrayPtr<const word>> seg
   output.write(arrayPtr(pieces, segments.size() + 1));
 }
 
+// -------------------------------------------------------------------
+
+static uint64_t monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+}
+
+BatchingMessageWriter::BatchingMessageWriter(OutputStream& output, BatchingOptions options)
+    : output(output), options(options), staging(newArray<byte>(options.maxBytes)),
+      stagingPos(staging.begin()), pieces(newArray<ArrayPtr<const byte>>(64)), pieceCount(0),
+      pendingBytes(0), pendingMessages(0), oldestPendingTime(0) {
+  CAPNPROTO_ASSERT(options.maxBytes >= sizeof(word),
+      "BatchingMessageWriter needs room to stage at least a segment table.");
+}
+
+BatchingMessageWriter::~BatchingMessageWriter() {
+  if (pieceCount > 0) {
+    if (std::uncaught_exception()) {
+      try {
+        flush();
+      } catch (...) {
+        // TODO:  Report secondary faults.
+      }
+    } else {
+      flush();
+    }
+  }
+}
+
+void BatchingMessageWriter::write(ArrayPtr<const ArrayPtr<const word>> segments) {
+  CAPNPROTO_ASSERT(segments.size() > 0, "Tried to serialize uninitialized message.");
+
+  if (pendingMessages == 0 && options.maxDelayNanos > 0) {
+    oldestPendingTime = monotonicNanos();
+  }
+
+  // Same table as writeMessage() produces.
+  internal::WireValue<uint32_t> table[(segments.size() + 2) & ~size_t(1)];
+  table[0].set(segments.size() - 1);
+  for (uint i = 0; i < segments.size(); i++) {
+    table[i + 1].set(segments[i].size());
+  }
+  if (segments.size() % 2 == 0) {
+    // Set padding byte.
+    table[segments.size() + 1].set(0);
+  }
+  addCopy(table, sizeof(table));
+
+  bool referencesMessage = false;
+  for (auto& segment: segments) {
+    size_t size = segment.size() * sizeof(word);
+    if (size > options.copyLimitBytes) {
+      addPiece(arrayPtr(reinterpret_cast<const byte*>(segment.begin()), size));
+      referencesMessage = true;
+    } else {
+      addCopy(segment.begin(), size);
+    }
+  }
+
+  ++pendingMessages;
+
+  if (referencesMessage ||
+      pendingBytes >= options.maxBytes ||
+      pendingMessages >= options.maxMessages ||
+      (options.maxDelayNanos > 0 &&
+       monotonicNanos() - oldestPendingTime >= options.maxDelayNanos)) {
+    flush();
+  }
+}
+
+void BatchingMessageWriter::flush() {
+  if (pieceCount > 0) {
+    // Reset first so that a failed write isn't retried by the destructor.
+    uint count = pieceCount;
+    pieceCount = 0;
+    stagingPos = staging.begin();
+    pendingBytes = 0;
+    pendingMessages = 0;
+
+    output.write(arrayPtr(pieces.begin(), count));
+  }
+}
+
+void BatchingMessageWriter::addCopy(const void* data, size_t size) {
+  const byte* pos = reinterpret_cast<const byte*>(data);
+
+  while (size > 0) {
+    if (stagingPos == staging.end()) {
+      // Staging is full.  The rest of this message goes out in the next batch, so that batch's
+      // delay starts now.
+      flush();
+      if (options.maxDelayNanos > 0) {
+        oldestPendingTime = monotonicNanos();
+      }
+    }
+
+    size_t amount = std::min<size_t>(size, staging.end() - stagingPos);
+    memcpy(stagingPos, pos, amount);
+
+    if (pieceCount > 0 && pieces[pieceCount - 1].end() == stagingPos) {
+      // Extend the previous staged piece.
+      ArrayPtr<const byte>& last = pieces[pieceCount - 1];
+      last = arrayPtr(last.begin(), last.size() + amount);
+      pendingBytes += amount;
+    } else {
+      addPiece(arrayPtr(stagingPos, amount));
+    }
+
+    stagingPos += amount;
+    pos += amount;
+    size -= amount;
+  }
+}
+
+void BatchingMessageWriter::addPiece(ArrayPtr<const byte> piece) {
+  if (piece.size() == 0) {
+    return;
+  }
+
+  if (pieceCount == pieces.size()) {
+    Array<ArrayPtr<const byte>> bigger = newArray<ArrayPtr<const byte>>(pieces.size() * 2);
+    for (uint i = 0; i < pieceCount; i++) {
+      bigger[i] = pieces[i];
+    }
+    pieces = move(bigger);
+  }
+
+  pieces[pieceCount++] = piece;
+  pendingBytes += piece.size();
+}
+
 // =======================================================================================
 StreamFdMessageReader::~StreamFdMessageReader() {}
 
@@ -253,4 +512,354 @@ void writeMessageToFd(int fd, ArrayPtr<const ArrayPtr<const word>> segments) {
   writeMessage(stream, segments);
 }
 
+// -------------------------------------------------------------------
+
+MessageStreamReader::MessageStreamReader(int fd, ReaderOptions options, size_t bufferWords)
+    : fd(fd), buffer(newArray<word>(bufferWords)), messageEnd(buffer.begin()),
+      readEnd(reinterpret_cast<byte*>(buffer.begin())), reader(nullptr, options) {}
+
+MessageStreamReader::MessageStreamReader(AutoCloseFd fd, ReaderOptions options, size_t bufferWords)
+    : fd(fd), autoclose(move(fd)), buffer(newArray<word>(bufferWords)),
+      messageEnd(buffer.begin()), readEnd(reinterpret_cast<byte*>(buffer.begin())),
+      reader(nullptr, options) {}
+
+MessageStreamReader::~MessageStreamReader() {}
+
+bool MessageStreamReader::next() {
+  const word* start = messageEnd;
+  if (reinterpret_cast<const byte*>(start) == readEnd) {
+    // Everything received has been handed out, so start over at the front of the buffer.
+    start = buffer.begin();
+    readEnd = reinterpret_cast<byte*>(buffer.begin());
+  }
+
+  for (;;) {
+    size_t availableBytes = readEnd - reinterpret_cast<const byte*>(start);
+    size_t needed = neededWords(start, availableBytes);
+
+    if (needed * sizeof(word) <= availableBytes) {
+      messageEnd = start + needed;
+      reader.reset(arrayPtr(start, needed));
+      return true;
+    }
+
+    if (needed > buffer.size()) {
+      return readOversized(start, availableBytes, needed);
+    }
+
+    // Move the partial message to the front so that the read can fill the rest of the buffer.
+    if (start != buffer.begin()) {
+      memmove(buffer.begin(), start, availableBytes);
+      start = buffer.begin();
+      readEnd = reinterpret_cast<byte*>(buffer.begin()) + availableBytes;
+    }
+
+    size_t n = readSome(readEnd, reinterpret_cast<byte*>(buffer.end()) - readEnd);
+    if (n == 0) {
+      messageEnd = buffer.begin();
+      readEnd = reinterpret_cast<byte*>(buffer.begin());
+      if (availableBytes > 0) {
+        reportPrematureEof();
+      }
+      return false;
+    }
+    readEnd += n;
+  }
+}
+
+size_t MessageStreamReader::neededWords(const word* start, size_t availableBytes) {
+  // Returns the number of words the message at `start` is known to need given the bytes received
+  // so far.  If that's no more than what's available, it's the message's full size.
+  if (availableBytes < sizeof(word)) {
+    return 1;
+  }
+
+  const internal::WireValue<uint32_t>* table =
+      reinterpret_cast<const internal::WireValue<uint32_t>*>(start);
+
+  uint segmentCount = table[0].get() + 1;
+  size_t totalWords = segmentCount / 2u + 1u;
+  if (availableBytes < totalWords * sizeof(word)) {
+    return totalWords;
+  }
+
+  for (uint i = 0; i < segmentCount; i++) {
+    totalWords += table[i + 1].get();
+  }
+  return totalWords;
+}
+
+bool MessageStreamReader::readOversized(
+    const word* start, size_t availableBytes, size_t needed) {
+  if (oversized.size() < needed) {
+    oversized = newArray<word>(needed);
+  }
+  memcpy(oversized.begin(), start, availableBytes);
+
+  // The buffer is now empty.  Only the rest of this message is read into `oversized`, so the next
+  // message starts at the front of the buffer.
+  messageEnd = buffer.begin();
+  readEnd = reinterpret_cast<byte*>(buffer.begin());
+
+  size_t received = availableBytes;
+  for (;;) {
+    // `needed` may only cover the segment table so far, so recompute it as more arrives.
+    needed = neededWords(oversized.begin(), received);
+    if (needed * sizeof(word) <= received) {
+      reader.reset(arrayPtr(oversized.begin(), needed));
+      return true;
+    }
+
+    if (oversized.size() < needed) {
+      Array<word> bigger = newArray<word>(needed);
+      memcpy(bigger.begin(), oversized.begin(), received);
+      oversized = move(bigger);
+    }
+
+    size_t n = readSome(reinterpret_cast<byte*>(oversized.begin()) + received,
+                        needed * sizeof(word) - received);
+    if (n == 0) {
+      reportPrematureEof();
+      return false;
+    }
+    received += n;
+  }
+}
+
+size_t MessageStreamReader::readSome(byte* pos, size_t maxBytes) {
+  for (;;) {
+    ssize_t n = ::read(fd, pos, maxBytes);
+    if (n >= 0) {
+      return n;
+    }
+
+    int error = errno;
+    if (error != EINTR) {
+      internal::throwOsException("read", error);
+    }
+  }
+}
+
+void MessageStreamReader::reportPrematureEof() {
+  reader.getOptions().errorReporter->reportError("Stream ended in the middle of a message.");
+}
+
+// -------------------------------------------------------------------
+
+static int adviceToMadvise(FileAdvice advice) {
+  switch (advice) {
+    case FileAdvice::NORMAL: return MADV_NORMAL;
+    case FileAdvice::SEQUENTIAL: return MADV_SEQUENTIAL;
+    case FileAdvice::RANDOM: return MADV_RANDOM;
+    case FileAdvice::WILLNEED: return MADV_WILLNEED;
+  }
+  return MADV_NORMAL;
+}
+
+static size_t fileSize(int fd) {
+  struct stat stats;
+  if (fstat(fd, &stats) < 0) {
+    internal::throwOsException("fstat", errno);
+  }
+  return stats.st_size;
+}
+
+FileMapping::FileMapping(int fd, size_t offset, size_t size, FileAdvice advice)
+    : mapping(nullptr), mappingSize(0) {
+  CAPNPROTO_ASSERT(offset % sizeof(word) == 0, "File offset must be word-aligned.");
+
+  if (size < sizeof(word)) {
+    // Nothing to map.  (mmap() rejects zero-length mappings.)
+    return;
+  }
+
+  // mmap() happily maps past the end of the file, but touching those pages raises SIGBUS, so
+  // check up front.
+  size_t total = fileSize(fd);
+  if (offset > total || size > total - offset) {
+    internal::throwPrematureEof();
+  }
+
+  // mmap() wants a page-aligned offset, so map from the start of the page containing `offset`.
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t pageOffset = offset & ~(pageSize - 1);
+  size_t skip = offset - pageOffset;
+
+  mappingSize = skip + size;
+  mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, pageOffset);
+  if (mapping == MAP_FAILED) {
+    mapping = nullptr;
+    mappingSize = 0;
+    internal::throwOsException("mmap", errno);
+  }
+
+  const word* start = reinterpret_cast<const word*>(reinterpret_cast<byte*>(mapping) + skip);
+  words = arrayPtr(start, size / sizeof(word));
+
+  if (advice != FileAdvice::NORMAL) {
+    advise(advice);
+  }
+}
+
+FileMapping::~FileMapping() {
+  if (mapping != nullptr) {
+    munmap(mapping, mappingSize);
+  }
+}
+
+void FileMapping::advise(FileAdvice advice) {
+  if (mapping != nullptr) {
+    // The advice is only a hint, so failures are ignored.
+    madvise(mapping, mappingSize, adviceToMadvise(advice));
+  }
+}
+
+void FileMapping::advise(ArrayPtr<const word> range, FileAdvice advice) {
+  if (mapping == nullptr || range.size() == 0) {
+    return;
+  }
+
+  CAPNPROTO_ASSERT(range.begin() >= words.begin() && range.end() <= words.end(),
+      "Range passed to FileMapping::advise() is not within the mapping.");
+
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = reinterpret_cast<uintptr_t>(range.begin()) & ~(pageSize - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(range.end());
+  madvise(reinterpret_cast<void*>(begin), end - begin, adviceToMadvise(advice));
+}
+
+FdFileMessageReader::FdFileMessageReader(int fd, ReaderOptions options, FileAdvice advice)
+    : FileMapping(fd, 0, fileSize(fd), advice),
+      FlatArrayMessageReader(getWords(), options) {}
+
+FdFileMessageReader::FdFileMessageReader(
+    int fd, size_t offset, size_t size, ReaderOptions options, FileAdvice advice)
+    : FileMapping(fd, offset, size, advice),
+      FlatArrayMessageReader(getWords(), options) {}
+
+FdFileMessageReader::~FdFileMessageReader() {}
+
+FdFileMessageIterator::FdFileMessageIterator(int fd, ReaderOptions options, FileAdvice advice)
+    : FileMapping(fd, 0, fileSize(fd), advice),
+      reader(nullptr, options), pos(nullptr) {}
+
+FdFileMessageIterator::~FdFileMessageIterator() {}
+
+bool FdFileMessageIterator::next() {
+  const word* start = pos == nullptr ? getWords().begin() : reader.getEnd();
+  if (start == getWords().end()) {
+    return false;
+  }
+
+  pos = start;
+  reader.reset(arrayPtr(start, getWords().end()));
+  return true;
+}
+
+// -------------------------------------------------------------------
+
+namespace {
+
+class SegmentMismatchException: public std::exception {
+public:
+  const char* what() const noexcept override {
+    return "FdFileMessageBuilder::finish():  The message's segments aren't the ones the builder "
+           "allocated in the file.  Was compact() or setExternalDataField() used on it?";
+  }
+};
+
+}  // namespace
+
+FdFileMessageBuilder::FdFileMessageBuilder(int fd, size_t firstSegmentWords, uint maxSegments)
+    : fd(fd), nextSize(firstSegmentWords), headerWords(maxSegments / 2 + 1), fileSize(0),
+      segments(newArray<Segment>(maxSegments)), segmentCount(0) {
+  CAPNPROTO_ASSERT(maxSegments > 0, "FdFileMessageBuilder needs room for at least one segment.");
+
+  // The builder relies on new segments reading as zeros, so discard any old content up front
+  // rather than mapping over it.
+  if (ftruncate(fd, 0) < 0) {
+    internal::throwOsException("ftruncate", errno);
+  }
+}
+
+FdFileMessageBuilder::~FdFileMessageBuilder() {
+  for (uint i = 0; i < segmentCount; i++) {
+    munmap(segments[i].mapping, segments[i].mappingSize);
+  }
+}
+
+ArrayPtr<word> FdFileMessageBuilder::allocateSegment(uint minimumSize) {
+  CAPNPROTO_ASSERT(segmentCount < segments.size(),
+      "FdFileMessageBuilder ran out of segments.  Increase firstSegmentWords or maxSegments.");
+
+  // Each mapping starts and ends on a page boundary.  The first one also holds the segment table.
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t offset = fileSize;
+  size_t headerBytes = segmentCount == 0 ? headerWords * sizeof(word) : 0;
+  size_t mappingSize = headerBytes + std::max<size_t>(minimumSize, nextSize) * sizeof(word);
+  mappingSize = (mappingSize + pageSize - 1) & ~(pageSize - 1);
+
+  if (ftruncate(fd, offset + mappingSize) < 0) {
+    internal::throwOsException("ftruncate", errno);
+  }
+  void* mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+  if (mapping == MAP_FAILED) {
+    internal::throwOsException("mmap", errno);
+  }
+  fileSize = offset + mappingSize;
+
+  size_t words = std::min<size_t>((mappingSize - headerBytes) / sizeof(word),
+                                  internal::MAX_SEGMENT_WORDS);
+  word* start = reinterpret_cast<word*>(reinterpret_cast<byte*>(mapping) + headerBytes);
+  Segment& segment = segments[segmentCount++];
+  segment.mapping = mapping;
+  segment.mappingSize = mappingSize;
+  segment.fileOffset = offset + headerBytes;
+  segment.space = arrayPtr(start, words);
+
+  nextSize = std::min<size_t>(nextSize + words, internal::MAX_SEGMENT_WORDS);
+  return segment.space;
+}
+
+size_t FdFileMessageBuilder::finish() {
+  size_t end = 0;
+
+  if (segmentCount > 0) {
+    // Check everything before writing anything, so that a misused builder leaves the file's
+    // previous table alone rather than half-rewritten.
+    ArrayPtr<const ArrayPtr<const word>> used = getSegmentsForOutput();
+    if (used.size() > segmentCount) {
+      throw SegmentMismatchException();
+    }
+    for (uint i = 0; i < used.size(); i++) {
+      if (used[i].begin() != segments[i].space.begin()) {
+        throw SegmentMismatchException();
+      }
+    }
+
+    internal::WireValue<uint32_t>* table =
+        reinterpret_cast<internal::WireValue<uint32_t>*>(segments[0].mapping);
+    table[0].set(segments.size() - 1);
+    for (uint i = 0; i < segments.size(); i++) {
+      uint size = 0;
+      if (i + 1 < used.size()) {
+        size = segments[i].space.size();
+      } else if (i + 1 == used.size()) {
+        size = used[i].size();
+        end = segments[i].fileOffset + size * sizeof(word);
+      }
+      table[i + 1].set(size);
+    }
+    if (segments.size() % 2 == 0) {
+      // Padding.
+      table[segments.size() + 1].set(0);
+    }
+  }
+
+  if (ftruncate(fd, end) < 0) {
+    internal::throwOsException("ftruncate", errno);
+  }
+  return end;
+}
+
 }  // namespace capnproto
@@ -56,12 +56,29 @@ public:
   FlatArrayMessageReader(ArrayPtr<const word> array, ReaderOptions options = ReaderOptions());
   // The array must remain valid until the MessageReader is destroyed.
 
+  void reset(ArrayPtr<const word> array);
+  // Start over reading the message at the beginning of `array`, reusing this reader's tables.
+  // Readers previously returned by getRoot() become invalid.  If this throws (because the message
+  // is truncated), the reader may only be destroyed or reset() again.
+
+  inline const word* getEnd() const { return end; }
+  // Returns a pointer to the first word after the end of the message within the array, i.e. the
+  // start of the next message if several were written back-to-back.  If the message was
+  // truncated, returns the end of the array.
+
   ArrayPtr<const word> getSegment(uint id) override;
 
 private:
   // Optimize for single-segment case.
   ArrayPtr<const word> segment0;
   Array<ArrayPtr<const word>> moreSegments;
+  uint moreSegmentCount;
+  // moreSegments may be bigger than needed after a reset(); only the first moreSegmentCount
+  // elements belong to the current message.
+
+  const word* end;
+
+  void parse(ArrayPtr<const word> array);
 };
 
 Array<word> messageToFlatArray(MessageBuilder& builder);
@@ -79,19 +96,64 @@ public:
                            ArrayPtr<word> scratchSpace = nullptr);
   ~InputStreamMessageReader();
 
+  void reset();
+  // Finish with the current message and read the next one from the same stream.  Any part of the
+  // current message not yet read is skipped first.  The reader reuses its segment table, its
+  // arena, and the buffer it allocated (if scratchSpace was too small), growing them only when the
+  // new message needs more room, so a loop that reads many messages with one reader doesn't
+  // allocate once it has warmed up.  Readers previously returned by getRoot() become invalid.
+  //
+  // If this throws (e.g. at end of stream), the reader may only be destroyed.
+
   // implements MessageReader ----------------------------------------
   ArrayPtr<const word> getSegment(uint id) override;
 
+protected:
+  InputStreamMessageReader(BufferedInputStream& inputStream, ReaderOptions options,
+                           ArrayPtr<word> scratchSpace, bool readInPlace);
+  // For BufferedInputStreamMessageReader.
+
 private:
   InputStream& inputStream;
+  BufferedInputStream* bufferedStream;
+  // Non-null if messages may be read in place.
+  ArrayPtr<word> scratchSpace;
   byte* readPos;
 
+  size_t pinnedBytes;
+  // If non-zero, the current message was read in place from bufferedStream's read buffer, and
+  // this many bytes still need to be skipped.
+
   // Optimize for single-segment case.
   ArrayPtr<const word> segment0;
   Array<ArrayPtr<const word>> moreSegments;
+  uint moreSegmentCount;
+  // moreSegments may be bigger than needed after a reset(); only the first moreSegmentCount
+  // elements belong to the current message.
 
   Array<word> ownedSpace;
   // Only if scratchSpace wasn't big enough.
+
+  void readMessage();
+  bool tryReadInPlace();
+  void skipUnreadSegments();
+};
+
+class BufferedInputStreamMessageReader: public InputStreamMessageReader {
+  // Like InputStreamMessageReader, but when the stream's read buffer already holds the whole
+  // message (and is word-aligned), the segments point directly into that buffer instead of being
+  // copied.  Otherwise, e.g. when the message straddles a refill, the message is copied into
+  // scratch space as usual.
+  //
+  // The catch:  a message read in place is only skip()ed once the reader is destroyed or reset(),
+  // so until then the stream doesn't move past it.  Don't read anything else from the stream
+  // (including with another reader) while this reader is alive.
+
+public:
+  BufferedInputStreamMessageReader(BufferedInputStream& inputStream,
+                                   ReaderOptions options = ReaderOptions(),
+                                   ArrayPtr<word> scratchSpace = nullptr)
+      : InputStreamMessageReader(inputStream, options, scratchSpace, true) {}
 };
 
 void writeMessage(OutputStream& output, MessageBuilder& builder);
@@ -100,6 +162,68 @@ void writeMessage(OutputStream& output, MessageBuilder& builder);
 void writeMessage(OutputStream& output, ArrayPtr<const ArrayPtr<const word>> segments);
 // Write the segment array to the given output stream.
 
+struct BatchingOptions {
+  // When a BatchingMessageWriter flushes.
+
+  size_t maxBytes = 65536;
+  // Flush once this many bytes are pending.  This is also the size of the staging buffer.
+
+  uint maxMessages = 1024;
+  // Flush once this many messages are pending.
+
+  uint64_t maxDelayNanos = 0;
+  // If non-zero, flush when writing a message finds that the oldest pending message has been
+  // waiting at least this long.
+
+  size_t copyLimitBytes = 4096;
+  // Segments bigger than this are written from the message itself rather than copied.
+};
+
+class BatchingMessageWriter {
+  // Writes many messages to an OutputStream in a few large writes instead of one write per
+  // message.  Small segments (and every segment table) are copied into a staging buffer; a
+  // segment too big to be worth copying is written straight from the message along with
+  // everything staged before it, so the writer never holds on to the caller's memory after
+  // write() returns.
+  //
+  // Pending data is written out when any of the limits in BatchingOptions is reached, when
+  // flush() is called, or when the writer is destroyed.  There's no background timer:
+  // maxDelayNanos is only checked when a message is written, so a producer that goes idle should
+  // call flush().
+
+public:
+  explicit BatchingMessageWriter(OutputStream& output,
+                                 BatchingOptions options = BatchingOptions());
+  CAPNPROTO_DISALLOW_COPY(BatchingMessageWriter);
+  ~BatchingMessageWriter();
+  // Flushes.
+
+  void write(MessageBuilder& builder);
+  void write(ArrayPtr<const ArrayPtr<const word>> segments);
+  // Add a message to the batch, flushing if that reaches one of the limits.
+
+  void flush();
+  // Write everything pending to the output stream.
+
+private:
+  OutputStream& output;
+  BatchingOptions options;
+
+  Array<byte> staging;
+  byte* stagingPos;
+
+  Array<ArrayPtr<const byte>> pieces;
+  uint pieceCount;
+  // Pending output, in order.  Consecutive staged bytes share one piece.
+
+  size_t pendingBytes;
+  uint pendingMessages;
+  uint64_t oldestPendingTime;
+
+  void addCopy(const void* data, size_t size);
+  void addPiece(ArrayPtr<const byte> piece);
+};
+
 // =======================================================================================
 // Specializations for reading from / writing to file descriptors.
 
@@ -121,6 +245,160 @@ public:
   ~StreamFdMessageReader();
 };
 
+class MessageStreamReader {
+  // Reads a sequence of back-to-back messages from a stream-based file descriptor, e.g. a pipe or
+  // socket.  StreamFdMessageReader makes at least two read() calls per message (segment table,
+  // then content); this instead read()s as much as is available into one large buffer and hands
+  // out each complete message found there in place, so a stream of small messages costs a small
+  // fraction of a system call per message.
+  //
+  //     MessageStreamReader stream(fd);
+  //     while (stream.next()) {
+  //       process(stream.getMessage().getRoot<Foo>());
+  //     }
+  //
+  // When a message runs off the end of the buffer, its partial beginning is moved to the front
+  // before reading more.  A message too big for the buffer is read into a separate array of its
+  // own, which is kept for reuse.
+
+public:
+  explicit MessageStreamReader(int fd, ReaderOptions options = ReaderOptions(),
+                               size_t bufferWords = 32768);
+  // Reads from the file descriptor, without taking ownership of it.  The default buffer is
+  // 256 KiB.
+
+  explicit MessageStreamReader(AutoCloseFd fd, ReaderOptions options = ReaderOptions(),
+                               size_t bufferWords = 32768);
+  // Reads from the file descriptor, taking ownership of it.
+
+  CAPNPROTO_DISALLOW_COPY(MessageStreamReader);
+  ~MessageStreamReader();
+
+  bool next();
+  // Advance to the next message, blocking until all of it has been received.  Returns false if the
+  // stream ended between messages.  Readers obtained from the previous message become invalid.
+  // A stream that ends in the middle of a message is reported to the ErrorReporter (after which,
+  // if it returns, next() returns false).
+
+  inline FlatArrayMessageReader& getMessage() { return reader; }
+  // The current message.
+
+private:
+  int fd;
+  AutoCloseFd autoclose;
+
+  Array<word> buffer;
+  const word* messageEnd;
+  // End of the current message, i.e. start of the data not yet handed out.
+  byte* readEnd;
+  // End of the data received so far.  May not be on a word boundary.
+
+  Array<word> oversized;
+  // Holds the current message if it didn't fit in `buffer`.
+
+  FlatArrayMessageReader reader;
+
+  size_t neededWords(const word* start, size_t availableBytes);
+  bool readOversized(const word* start, size_t availableBytes, size_t needed);
+  size_t readSome(byte* pos, size_t maxBytes);
+  void reportPrematureEof();
+};
+
+enum class FileAdvice {
+  // How a mapped file is going to be accessed.  Passed on to the kernel with madvise(), which uses
+  // it to pick a readahead strategy.
+
+  NORMAL,       // No particular pattern.
+  SEQUENTIAL,   // Front to back; read ahead aggressively and drop pages soon after they're used.
+  RANDOM,       // Scattered small reads; don't bother reading ahead.
+  WILLNEED      // The whole range is needed soon; start reading it in the background now.
+};
+
+class FileMapping {
+  // A read-only mmap() of a range of a file.  The mapping costs the same no matter how big the
+  // range is; pages are read in from the page cache (or disk) only as they are touched.
+
+public:
+  FileMapping(int fd, size_t offset, size_t size, FileAdvice advice = FileAdvice::NORMAL);
+  // Maps `size` bytes of `fd` starting at byte `offset`, which must be a multiple of the word
+  // size.  A trailing partial word is not included in getWords().  Throws the same exception as a
+  // premature EOF if the range extends past the end of the file.  (If the file is truncated later,
+  // while mapped, touching the missing pages raises SIGBUS.)  Does not take ownership of the
+  // descriptor, which may be closed once this returns.
+
+  CAPNPROTO_DISALLOW_COPY(FileMapping);
+  ~FileMapping();
+
+  inline ArrayPtr<const word> getWords() { return words; }
+
+  void advise(FileAdvice advice);
+  // Change the access hint for the whole range.
+
+  void advise(ArrayPtr<const word> range, FileAdvice advice);
+  // Change the access hint for part of the range, e.g. WILLNEED on a message that is about to be
+  // read.  The range is widened to page boundaries.
+
+private:
+  void* mapping;
+  size_t mappingSize;
+  ArrayPtr<const word> words;
+};
+
+class FdFileMessageReader: private FileMapping, public FlatArrayMessageReader {
+  // A MessageReader that mmap()s the message out of a file instead of reading it.  Construction
+  // only touches the segment table, so opening a message takes the same time however large the
+  // file is, and only the pages the application actually visits are ever read from disk.
+
+public:
+  explicit FdFileMessageReader(int fd, ReaderOptions options = ReaderOptions(),
+                               FileAdvice advice = FileAdvice::NORMAL);
+  // Read the message at the start of the file.  Does not take ownership of the descriptor.
+
+  FdFileMessageReader(int fd, size_t offset, size_t size, ReaderOptions options = ReaderOptions(),
+                      FileAdvice advice = FileAdvice::NORMAL);
+  // Read the message found in `size` bytes of the file starting at byte `offset`, which must be a
+  // multiple of the word size.
+
+  ~FdFileMessageReader();
+
+  using FileMapping::advise;
+};
+
+class FdFileMessageIterator: private FileMapping {
+  // Reads a file containing any number of messages written back-to-back, e.g. by repeated calls
+  // to writeMessageToFd().  The file is mapped once, and each message is read in place.
+  //
+  //     FdFileMessageIterator iter(fd);
+  //     while (iter.next()) {
+  //       process(iter.getMessage().getRoot<Foo>());
+  //     }
+
+public:
+  explicit FdFileMessageIterator(int fd, ReaderOptions options = ReaderOptions(),
+                                 FileAdvice advice = FileAdvice::SEQUENTIAL);
+  // Does not take ownership of the descriptor.
+
+  ~FdFileMessageIterator();
+
+  bool next();
+  // Advance to the next message, returning false if there are none left.  Must also be called
+  // before looking at the first message.  Readers obtained from the previous message become
+  // invalid.  If a message is truncated, the error is reported to the ErrorReporter and the
+  // following call returns false.
+
+  inline FlatArrayMessageReader& getMessage() { return reader; }
+  // The current message.
+
+  inline size_t getOffset() { return (pos - getWords().begin()) * sizeof(word); }
+  // Byte offset of the current message within the file.
+
+  using FileMapping::advise;
+
+private:
+  FlatArrayMessageReader reader;
+  const word* pos;
+};
+
 void writeMessageToFd(int fd, MessageBuilder& builder);
 // Write the message to the given file descriptor.
 //
@@ -135,6 +413,63 @@ void writeMessageToFd(int fd, ArrayPtr<const ArrayPtr<const word>> segments);
 // you catch this exception at the call site.  If throwing an exception is not acceptable, you
 // can implement your own OutputStream with arbitrary error handling and then use writeMessage().
 
+class FdFileMessageBuilder: public MessageBuilder {
+  // A MessageBuilder whose segments are carved directly out of a memory-mapped file, laid out in
+  // the same format that writeMessage() produces.  When building is done, finish() fills in the
+  // segment table and trims the file, after which the file can be mmap()ed and read with
+  // FlatArrayMessageReader.  The message content is never copied, and never needs to be held in
+  // anonymous memory, so messages larger than RAM can be written.
+  //
+  // Space is reserved by extending the file with ftruncate() before each segment is mapped, so
+  // unused space is a sparse hole that reads as zeros and costs no disk space.  Since segments are
+  // placed in the file before their final sizes are known:
+  // * Every segment except the last is recorded at its full capacity, i.e. any unused tail is
+  //   written out as zeros.
+  // * The segment table always has room for `maxSegments` entries; unused entries are recorded as
+  //   empty segments.
+  // Both are valid in the serialization format.  Choose a firstSegmentWords big enough for the
+  // whole message and normally only segment zero is used.
+  //
+  // Since segments must stay in the file in the order they were allocated, don't call compact()
+  // on this builder.  External data (StructBuilder::setExternalDataField()) can't be placed in the
+  // file either, so don't use it here.
+
+public:
+  explicit FdFileMessageBuilder(int fd, size_t firstSegmentWords = 1u << 24, uint maxSegments = 16);
+  // Builds into `fd`, which must be a regular file open for both reading and writing, starting at
+  // offset zero.  The file is truncated to zero length first, so any existing content is lost.
+  // Does not take ownership of the descriptor.
+  // By default reserves 128 MiB for the first segment.
+
+  CAPNPROTO_DISALLOW_COPY(FdFileMessageBuilder);
+  virtual ~FdFileMessageBuilder();
+  // Unmaps the file.  Does not call finish().
+
+  virtual ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+  size_t finish();
+  // Writes the segment table and truncates the file to the end of the message.  Returns the size
+  // of the message in bytes.  Throws an exception, leaving the file untouched, if the message's
+  // segments are no longer the ones this builder allocated (see above).  The message must not be modified after this is called.  Like
+  // writeMessageToFd(), this leaves the data in the page cache; call fsync() if you need it to be
+  // durable.
+
+private:
+  int fd;
+  size_t nextSize;
+  uint headerWords;
+  size_t fileSize;
+
+  struct Segment {
+    void* mapping;
+    size_t mappingSize;
+    size_t fileOffset;
+    ArrayPtr<word> space;
+  };
+  Array<Segment> segments;
+  uint segmentCount;
+};
+
 // =======================================================================================
 // inline stuff
 
@@ -146,6 +481,10 @@ inline void writeMessage(OutputStream& output, MessageBuilder& builder) {
   writeMessage(output, builder.getSegmentsForOutput());
 }
 
+inline void BatchingMessageWriter::write(MessageBuilder& builder) {
+  write(builder.getSegmentsForOutput());
+}
+
 inline void writeMessageToFd(int fd, MessageBuilder& builder) {
   writeMessageToFd(fd, builder.getSegmentsForOutput());
 }
@@ -59,6 +59,9 @@ isBlob (BuiltinType BuiltinText) = True
 isBlob (BuiltinType BuiltinData) = True
 isBlob _ = False
 
+isData (BuiltinType BuiltinData) = True
+isData _ = False
+
 isStruct (StructType _) = True
 isStruct _ = False
 
@@ -185,6 +188,7 @@ fieldContext parent desc = mkStrContext context where
     context "fieldUpperCase" = MuVariable $ toUpperCaseWithUnderscores $ fieldName desc
     context "fieldIsPrimitive" = MuBool $ isPrimitive $ fieldType desc
     context "fieldIsBlob" = MuBool $ isBlob $ fieldType desc
+    context "fieldIsData" = MuBool $ isData $ fieldType desc
     context "fieldIsStruct" = MuBool $ isStruct $ fieldType desc
     context "fieldIsList" = MuBool $ isList $ fieldType desc
     context "fieldIsNonStructList" = MuBool $ isNonStructList $ fieldType desc